@@ -8,34 +8,182 @@
 // #include <asm/io.h>
 #include <linux/io.h>
 #include "hvisor.h"
-#include <linux/sched/signal.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
 #include <linux/of.h>
 #include <linux/of_irq.h>
 #include <linux/gfp.h>
 #include <linux/vmalloc.h>
 #include <linux/string.h> 
+#include <linux/version.h>
+#include <linux/huge_mm.h>
+#include <linux/mutex.h>
+#include <linux/bitmap.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
 #include <asm/cacheflush.h>
 struct virtio_bridge *virtio_bridge; 
+static int bridge_order;
+// The pages of a bridge and the user mappings of them. remap_pfn_range takes no
+// page references, so a bridge replaced by a restarted daemon is freed only once
+// the last mapping of it is gone.
+struct bridge_mem {
+    struct virtio_bridge *bridge;
+    struct virtio_bridge hdr;	// the layout, the daemon can write the one in the bridge
+    int order;
+    int maps;
+    bool retired;	// hvisor switched to another bridge
+};
+static struct bridge_mem *cur_bridge;
+// Serializes the switch to a new bridge against other inits and mappings of the bridge.
+static DEFINE_MUTEX(bridge_lock);
 int hvisor_irq = -1;
-static struct task_struct *task = NULL;
+static atomic64_t irq_ns = ATOMIC64_INIT(0);
+// The open /dev/hvisor files. files_lock also guards cur_bridge against the
+// irq handler, which reads the request rings of the bridge.
+static LIST_HEAD(hvisor_files);
+static DEFINE_SPINLOCK(files_lock);
+
+// Per open file state. An irq bumps irq_seq of the files owning a request ring
+// with requests in it, and wakes up their readers only.
+struct hvisor_file {
+    struct list_head node;
+    wait_queue_head_t wq;
+    atomic64_t irq_seq;
+    u64 seen_seq;
+    unsigned long *rings;	// bitmap of cpus, NULL for every irq
+};
+
+static inline bool is_pow2_depth(__u32 depth)
+{
+    return depth >= 2 && depth <= MAX_REQ_DEPTH && (depth & (depth - 1)) == 0;
+}
+
+static void hvisor_free_bridge(struct virtio_bridge *bridge, int order)
+{
+    unsigned long i;
+    if (bridge == NULL)
+        return;
+    for (i = 0; i < (PAGE_SIZE << order); i += PAGE_SIZE)
+        ClearPageReserved(virt_to_page((void *)bridge + i));
+    free_pages((unsigned long)bridge, order);
+}
+
+// Drop a bridge hvisor no longer uses, now or once it is unmapped. Called with bridge_lock held.
+static void hvisor_retire_bridge(struct bridge_mem *mem)
+{
+    if (mem == NULL)
+        return;
+    mem->retired = true;
+    if (mem->maps > 0)
+        return;
+    hvisor_free_bridge(mem->bridge, mem->order);
+    kfree(mem);
+}
+
+// Lay out the bridge arrays for the requested geometry, return the bridge size.
+static unsigned long hvisor_bridge_layout(struct virtio_bridge *hdr,
+                struct hvisor_virtio_init *init)
+{
+    unsigned long size = ALIGN(sizeof(struct virtio_bridge), SMP_CACHE_BYTES);
+    hdr->magic = HVISOR_VIRTIO_MAGIC;
+    hdr->abi_version = HVISOR_VIRTIO_ABI_VERSION;
+    hdr->cpus = init->cpus;
+    hdr->req_depth = init->req_depth;
+    hdr->res_depth = init->res_depth;
+    hdr->max_devs = init->max_devs;
+    hdr->res_list_off = size;
+    size += ALIGN(init->res_depth * sizeof(struct device_res), SMP_CACHE_BYTES);
+    hdr->cfg_flags_off = size;
+    size += ALIGN(init->cpus * sizeof(__u64), SMP_CACHE_BYTES);
+    hdr->cfg_values_off = size;
+    size += ALIGN(init->cpus * sizeof(__u64), SMP_CACHE_BYTES);
+    hdr->mmio_addrs_off = size;
+    size += ALIGN(init->max_devs * sizeof(__u64), SMP_CACHE_BYTES);
+    hdr->req_ring_size = ALIGN(sizeof(struct device_req_ring) +
+                init->req_depth * sizeof(struct device_req), SMP_CACHE_BYTES);
+    hdr->req_size = sizeof(struct device_req);
+    hdr->req_rings_off = size;
+    size += (unsigned long)init->cpus * hdr->req_ring_size;
+    return PAGE_ALIGN(size);
+}
 
 // initial virtio el2 shared region
-static int hvisor_init_virtio(void) 
+static int hvisor_init_virtio(struct hvisor_virtio_init __user *arg) 
 {
-	int err;
+	int err, order;
+	unsigned long i, size;
+	struct hvisor_virtio_init init;
+	struct virtio_bridge hdr, *bridge;
+	struct bridge_mem *mem, *old;
     if (hvisor_irq == -1) {
         pr_err("virtio device is not available\n");
-        return ENOTTY;
+        return -ENOTTY;
     }
-	virtio_bridge = (struct virtio_bridge *)__get_free_pages(GFP_KERNEL, 0);
-	if (virtio_bridge == NULL)
+    if (copy_from_user(&init, arg, sizeof(init)))
+        return -EFAULT;
+    if (init.abi_version != HVISOR_VIRTIO_ABI_VERSION) {
+        pr_err("hvisor: daemon virtio bridge abi is %u, expected %u\n",
+                init.abi_version, HVISOR_VIRTIO_ABI_VERSION);
+        return -EPROTO;
+    }
+    if (init.req_size != sizeof(struct device_req)) {
+        pr_err("hvisor: daemon requests are %u bytes, expected %zu\n",
+                init.req_size, sizeof(struct device_req));
+        return -EINVAL;
+    }
+    if (!is_pow2_depth(init.req_depth) || !is_pow2_depth(init.res_depth) ||
+            init.cpus == 0 || init.cpus > MAX_CPUS ||
+            init.max_devs == 0 || init.max_devs > MAX_DEVS) {
+        pr_err("hvisor: invalid virtio bridge geometry\n");
+        return -EINVAL;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    size = hvisor_bridge_layout(&hdr, &init);
+    mem = kzalloc(sizeof(struct bridge_mem), GFP_KERNEL);
+    if (mem == NULL)
+        return -ENOMEM;
+	// hvisor accesses the bridge by its physical address, so it must be contiguous.
+    order = get_order(size);
+	bridge = (struct virtio_bridge *)__get_free_pages(GFP_KERNEL | __GFP_NOWARN, order);
+	if (bridge == NULL) {
+        pr_err("hvisor: failed to allocate %lu bytes for virtio bridge\n", size);
+        kfree(mem);
 		return -ENOMEM;
-    SetPageReserved(virt_to_page(virtio_bridge));
+    }
+    mem->bridge = bridge;
+    mem->hdr = hdr;
+    mem->order = order;
+	for (i = 0; i < (PAGE_SIZE << order); i += PAGE_SIZE)
+		SetPageReserved(virt_to_page((void *)bridge + i));
     // init device region
-	memset(virtio_bridge, 0, sizeof(struct virtio_bridge));
-	err = hvisor_call(HVISOR_HC_INIT_VIRTIO, __pa(virtio_bridge), 0);
-	if (err)
+	memset(bridge, 0, PAGE_SIZE << order);
+    memcpy(bridge, &hdr, sizeof(hdr));
+    mutex_lock(&bridge_lock);
+	// hvisor fails it if it doesn't know the layout version of the header.
+	err = hvisor_call(HVISOR_HC_INIT_VIRTIO, __pa(bridge), size);
+	if (err) {
+        pr_err("hvisor: hvisor rejected the virtio bridge of abi %u, err is %d\n",
+                HVISOR_VIRTIO_ABI_VERSION, err);
+        mutex_unlock(&bridge_lock);
+        hvisor_free_bridge(bridge, order);
+        kfree(mem);
 		return err;
+    }
+    // the daemon is restarted, hvisor switched to the new bridge. The old one may
+    // still be mapped by the previous daemon, it is freed on the last unmap.
+    old = cur_bridge;
+    spin_lock_irq(&files_lock);
+    cur_bridge = mem;
+    spin_unlock_irq(&files_lock);
+    hvisor_retire_bridge(old);
+    virtio_bridge = bridge;
+    bridge_order = order;
+    mutex_unlock(&bridge_lock);
+    init.size = size;
+    if (copy_to_user(arg, &init, sizeof(init)))
+        return -EFAULT;
 	return 0;
 }
 
@@ -93,6 +241,26 @@ static int hvisor_zone_start(struct hvisor_zone_info __user* arg) {
     return err;
 }
 
+// Make the file wake up only for requests queued in the given rings.
+static int hvisor_set_wakeup_rings(struct file *file, struct hvisor_wakeup_rings __user *arg)
+{
+    struct hvisor_file *hfile = file->private_data;
+    unsigned long *rings, *old;
+    rings = bitmap_zalloc(MAX_CPUS, GFP_KERNEL);
+    if (rings == NULL)
+        return -ENOMEM;
+    if (copy_from_user(rings, arg->cpus, sizeof(arg->cpus))) {
+        bitmap_free(rings);
+        return -EFAULT;
+    }
+    spin_lock_irq(&files_lock);
+    old = hfile->rings;
+    hfile->rings = rings;
+    spin_unlock_irq(&files_lock);
+    bitmap_free(old);
+    return 0;
+}
+
 static long hvisor_ioctl(struct file *file, unsigned int ioctl,
 			    unsigned long arg)
 {
@@ -100,8 +268,7 @@ static long hvisor_ioctl(struct file *file, unsigned int ioctl,
     switch (ioctl)
     {
     case HVISOR_INIT_VIRTIO:
-        err = hvisor_init_virtio(); 
-		task = get_current(); // get hvisor user process
+        err = hvisor_init_virtio((struct hvisor_virtio_init __user*) arg); 
         break;
     case HVISOR_ZONE_START:
         err = hvisor_zone_start((struct hvisor_zone_info __user*) arg);
@@ -112,6 +279,9 @@ static long hvisor_ioctl(struct file *file, unsigned int ioctl,
     case HVISOR_FINISH_REQ:
         err = hvisor_finish_req();
         break;
+    case HVISOR_SET_WAKEUP_RINGS:
+        err = hvisor_set_wakeup_rings(file, (struct hvisor_wakeup_rings __user*) arg);
+        break;
     default:
         err = -EINVAL;
         break;
@@ -119,13 +289,83 @@ static long hvisor_ioctl(struct file *file, unsigned int ioctl,
     return err;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+// Map non root memory on demand, pfn of the page is the mmap offset plus its offset in vma.
+static vm_fault_t hvisor_mem_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    unsigned long addr = vmf->address & PAGE_MASK;
+    unsigned long pfn = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+    return vmf_insert_pfn(vma, addr, pfn);
+}
+
+// Map 2MiB at once when both the user address and the physical address are aligned.
+static vm_fault_t hvisor_mem_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    struct vm_area_struct *vma = vmf->vma;
+    unsigned long addr = vmf->address & PMD_MASK;
+    unsigned long pfn;
+    if (order != PMD_ORDER)
+        return VM_FAULT_FALLBACK;
+    if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+        return VM_FAULT_FALLBACK;
+    pfn = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+    if (pfn & (PTRS_PER_PMD - 1))
+        return VM_FAULT_FALLBACK;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+    return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+    return vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), vmf->flags & FAULT_FLAG_WRITE);
+#endif
+#else
+    return VM_FAULT_FALLBACK;
+#endif
+}
+
+static const struct vm_operations_struct hvisor_mem_vm_ops = {
+    .fault = hvisor_mem_fault,
+    .huge_fault = hvisor_mem_huge_fault,
+};
+#endif
+
+// Count the mappings of a bridge, vmas are copied on fork and split on partial munmap.
+static void hvisor_bridge_vm_open(struct vm_area_struct *vma)
+{
+    struct bridge_mem *mem = vma->vm_private_data;
+    mutex_lock(&bridge_lock);
+    mem->maps++;
+    mutex_unlock(&bridge_lock);
+}
+
+static void hvisor_bridge_vm_close(struct vm_area_struct *vma)
+{
+    struct bridge_mem *mem = vma->vm_private_data;
+    mutex_lock(&bridge_lock);
+    if (--mem->maps == 0 && mem->retired) {
+        hvisor_free_bridge(mem->bridge, mem->order);
+        kfree(mem);
+    }
+    mutex_unlock(&bridge_lock);
+}
+
+static const struct vm_operations_struct hvisor_bridge_vm_ops = {
+    .open = hvisor_bridge_vm_open,
+    .close = hvisor_bridge_vm_close,
+};
+
 // Kernel mmap handler
 static int hvisor_map(struct file * filp, struct vm_area_struct *vma) 
 {
     unsigned long phys;
     int err;
     if (vma->vm_pgoff == 0) {
+        mutex_lock(&bridge_lock);
         // virtio_bridge must be aligned to one page.
+        if (virtio_bridge == NULL || vma->vm_end - vma->vm_start > (PAGE_SIZE << bridge_order)) {
+            mutex_unlock(&bridge_lock);
+            return -EINVAL;
+        }
         phys = virt_to_phys(virtio_bridge);
         // vma->vm_flags |= (VM_IO | VM_LOCKED | (VM_DONTEXPAND | VM_DONTDUMP)); Not sure should we add this line.
         err = remap_pfn_range(vma, 
@@ -133,26 +373,104 @@ static int hvisor_map(struct file * filp, struct vm_area_struct *vma)
                         phys >> PAGE_SHIFT,
                         vma->vm_end - vma->vm_start,
                         vma->vm_page_prot);
-        if (err)
+        if (err) {
+            mutex_unlock(&bridge_lock);
             return err;
+        }
+        // ->open isn't called for the first mapping
+        cur_bridge->maps++;
+        vma->vm_private_data = cur_bridge;
+        vma->vm_ops = &hvisor_bridge_vm_ops;
+        mutex_unlock(&bridge_lock);
         pr_info("virtio bridge mmap succeed!\n");
     } else {
-        pr_info("-------------------------\n");
-	    size_t size = vma->vm_end - vma->vm_start;
-        err = remap_pfn_range(vma,
-                vma->vm_start,
-                vma->vm_pgoff,
-                size,
-                vma->vm_page_prot);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+        // Non root memory is mapped by faults, with PMD mappings where alignment allows.
+        // VM_HUGEPAGE lets huge faults through when THP is in madvise mode.
+        vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE);
+        vma->vm_ops = &hvisor_mem_vm_ops;
+#else
+        // Before 6.12 the fault path never calls ->huge_fault of a VM_PFNMAP vma, so
+        // map the whole range now with 4 KiB pages and don't take faults on it later.
+        pr_info_once("hvisor: 2 MiB mappings of non root memory need linux 6.12, using 4 KiB pages\n");
+        err = remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff,
+                        vma->vm_end - vma->vm_start, vma->vm_page_prot);
         if (err)
             return err;
+#endif
         pr_info("non root region mmap succeed!\n");
     }
     return 0;
 }
 
+static int hvisor_open(struct inode *inode, struct file *file)
+{
+    struct hvisor_file *hfile;
+    hfile = kzalloc(sizeof(struct hvisor_file), GFP_KERNEL);
+    if (hfile == NULL)
+        return -ENOMEM;
+    init_waitqueue_head(&hfile->wq);
+    atomic64_set(&hfile->irq_seq, 0);
+    file->private_data = hfile;
+    spin_lock_irq(&files_lock);
+    list_add_tail(&hfile->node, &hvisor_files);
+    spin_unlock_irq(&files_lock);
+    return 0;
+}
+
+static int hvisor_release(struct inode *inode, struct file *file)
+{
+    struct hvisor_file *hfile = file->private_data;
+    spin_lock_irq(&files_lock);
+    list_del(&hfile->node);
+    spin_unlock_irq(&files_lock);
+    bitmap_free(hfile->rings);
+    kfree(hfile);
+    return 0;
+}
+
+static __poll_t hvisor_poll(struct file *file, poll_table *wait)
+{
+    struct hvisor_file *hfile = file->private_data;
+    poll_wait(file, &hfile->wq, wait);
+    if (atomic64_read(&hfile->irq_seq) != hfile->seen_seq)
+        return EPOLLIN | EPOLLRDNORM;
+    return 0;
+}
+
+// Wait for irqs from hvisor like an eventfd, and report when the latest one arrived.
+static ssize_t hvisor_read(struct file *file, char __user *buf,
+                size_t count, loff_t *ppos)
+{
+    struct hvisor_file *hfile = file->private_data;
+    struct hvisor_wakeup wakeup;
+    u64 seq;
+    int err;
+    if (count < sizeof(wakeup))
+        return -EINVAL;
+    seq = atomic64_read(&hfile->irq_seq);
+    if (seq == hfile->seen_seq) {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        err = wait_event_interruptible(hfile->wq,
+                (seq = atomic64_read(&hfile->irq_seq)) != hfile->seen_seq);
+        if (err)
+            return err;
+    }
+    wakeup.count = seq - hfile->seen_seq;
+    wakeup.irq_ns = atomic64_read(&irq_ns);
+    hfile->seen_seq = seq;
+    if (copy_to_user(buf, &wakeup, sizeof(wakeup)))
+        return -EFAULT;
+    return sizeof(wakeup);
+}
+
 static const struct file_operations hvisor_fops = {
     .owner = THIS_MODULE,
+    .open = hvisor_open,
+    .release = hvisor_release,
+    .read = hvisor_read,
+    .poll = hvisor_poll,
     .unlocked_ioctl = hvisor_ioctl,
     .compat_ioctl = hvisor_ioctl, 
     .mmap = hvisor_map,
@@ -164,25 +482,42 @@ static struct miscdevice hvisor_misc_dev = {
 	.fops = &hvisor_fops,
 };
 
+// Whether a request ring of the file has requests, the irq is for its reader then.
+// Called with files_lock held.
+static bool hvisor_file_has_reqs(struct hvisor_file *hfile)
+{
+    volatile struct device_req_ring *ring;
+    unsigned int cpu;
+    if (hfile->rings == NULL || cur_bridge == NULL)
+        return true;
+    for_each_set_bit(cpu, hfile->rings, cur_bridge->hdr.cpus) {
+        ring = (void *)cur_bridge->bridge + cur_bridge->hdr.req_rings_off +
+                (unsigned long)cpu * cur_bridge->hdr.req_ring_size;
+        if (READ_ONCE(ring->front) != READ_ONCE(ring->rear))
+            return true;
+    }
+    return false;
+}
+
 // Interrupt handler for IRQ.
 static irqreturn_t irq_handler(int irq, void *dev_id) 
 {
-    struct siginfo info;
+    struct hvisor_file *hfile;
     if (dev_id != &hvisor_misc_dev) {
         return IRQ_NONE;
     }
-
-    memset(&info, 0, sizeof(struct siginfo));
-    info.si_signo = SIGHVI;
-    info.si_code = SI_QUEUE;
-    info.si_int = 1;
-    // Send signale SIGHVI to hvisor user task
-    if (task != NULL) {
-        // pr_info("send signal to hvisor device\n");
-        if(send_sig_info(SIGHVI, (struct kernel_siginfo *)&info, task) < 0) {
-            pr_err("Unable to send signal\n");
-        }
+    atomic64_set(&irq_ns, ktime_get_ns());
+    // hvisor raises the irq after queueing the request
+    rmb();
+    // Wake up only the readers whose rings have requests, not every dispatcher.
+    spin_lock(&files_lock);
+    list_for_each_entry(hfile, &hvisor_files, node) {
+        if (!hvisor_file_has_reqs(hfile))
+            continue;
+        atomic64_inc(&hfile->irq_seq);
+        wake_up_interruptible(&hfile->wq);
     }
+    spin_unlock(&files_lock);
     return IRQ_HANDLED;
 }
 
@@ -227,10 +562,8 @@ static void __exit hvisor_exit(void)
     if (hvisor_irq != -1)
 	    free_irq(hvisor_irq,&hvisor_misc_dev);
 
-	if (virtio_bridge != NULL) {
-		ClearPageReserved(virt_to_page(virtio_bridge));
-		free_pages((unsigned long)virtio_bridge, 0);
-	}
+	// every mapping holds the file and so the module, none is left
+	hvisor_retire_bridge(cur_bridge);
     misc_deregister(&hvisor_misc_dev);
     pr_info("hvisor exit!!!\n");
 }
@@ -11,15 +11,19 @@
 #define RISCV64
 #endif
 
-#define MMAP_SIZE 4096
-#define MAX_REQ 32
-#define MAX_DEVS 4
-#define MAX_CPUS 16
+// Default geometry of the virtio bridge, negotiated at HVISOR_INIT_VIRTIO.
+#define DEFAULT_REQ_DEPTH 32
+#define DEFAULT_RES_DEPTH 32
+#define DEFAULT_DEVS 4
+#define DEFAULT_CPUS 16
+// Upper bounds of the geometry accepted by the kernel module.
+#define MAX_REQ_DEPTH 4096
+#define MAX_DEVS 1024
+#define MAX_CPUS 1024
 // #define NON_ROOT_PHYS_START 0x90000000
 // #define NON_ROOT_PHYS_SIZE 0x40000000
 #define NON_ROOT_PHYS_START 0x50000000
 #define NON_ROOT_PHYS_SIZE 0x30000000
-#define SIGHVI 10
 // used when start a zone.
 struct hvisor_zone_info {
 	__u64 zone_id;
@@ -39,6 +43,13 @@ struct device_req {
 	__u8 is_write;
 	__u8 need_interrupt;
 	__u16 padding;
+	__u64 enqueue_ts; // counter (cntvct_el0, time) when hvisor queued the request, 0 if unknown
+};
+
+// read from /dev/hvisor once it is readable
+struct hvisor_wakeup {
+	__u64 count;	// irqs raised since the last read on this file
+	__u64 irq_ns;	// CLOCK_MONOTONIC time of the latest irq
 };
 
 struct device_res {
@@ -46,26 +57,77 @@ struct device_res {
     __u32 irq_id;
 };
 
+// Requests trapped on one cpu. Each ring starts at a cache line so that
+// cpus enqueueing requests do not bounce each other's indexes.
+struct device_req_ring {
+	__u32 front;
+	__u32 rear;
+	__u8 need_wakeup;
+	__u8 padding[55];
+	struct device_req req_list[]; // req_depth entries
+};
+
+// Version of the bridge layout shared by hvisor, the kernel module and the daemon,
+// bumped on every change of it. hvisor checks magic and abi_version of the bridge
+// header at HVISOR_HC_INIT_VIRTIO and fails the hypercall on a mismatch.
+#define HVISOR_VIRTIO_MAGIC 0x48564252	// "HVBR"
+#define HVISOR_VIRTIO_ABI_VERSION 2		// 1 was the fixed one page bridge
+
+// The header of the virtio bridge. The arrays behind it are sized by the geometry
+// negotiated at HVISOR_INIT_VIRTIO, and located by the offsets below.
 struct virtio_bridge {
-	__u32 req_front;
-	__u32 req_rear;
+	__u32 magic;		// HVISOR_VIRTIO_MAGIC
+	__u32 abi_version;	// HVISOR_VIRTIO_ABI_VERSION
+	__u32 cpus;
+	__u32 req_depth;	// must be a power of 2
+	__u32 res_depth;	// must be a power of 2
+	__u32 max_devs;
     __u32 res_front;
     __u32 res_rear;
-	struct device_req req_list[MAX_REQ];
-    struct device_res res_list[MAX_REQ];
-	__u64 cfg_flags[MAX_CPUS]; // avoid false sharing, set cfg_flag to u64
-	__u64 cfg_values[MAX_CPUS];
+	__u32 res_list_off;		// struct device_res[res_depth]
+	__u32 cfg_flags_off;	// __u64[cpus], avoid false sharing, set cfg_flag to u64
+	__u32 cfg_values_off;	// __u64[cpus]
 	// When config is okay to use, remove these
-	__u64 mmio_addrs[MAX_DEVS];
+	__u32 mmio_addrs_off;	// __u64[max_devs]
+	__u32 req_rings_off;	// struct device_req_ring[cpus], indexed by device_req.src_cpu
+	__u32 req_ring_size;	// the stride between two request rings
+	__u32 req_size;			// sizeof(struct device_req) of the daemon and the kernel module
 	__u8 mmio_avail;
-	__u8 need_wakeup;
 };
 
-#define HVISOR_INIT_VIRTIO  _IO(1, 0) // virtio device init
+#define BRIDGE_ARRAY(b, off) ((void *)((char *)(b) + (b)->off))
+#define bridge_res_list(b) ((volatile struct device_res *)BRIDGE_ARRAY(b, res_list_off))
+#define bridge_cfg_flags(b) ((volatile __u64 *)BRIDGE_ARRAY(b, cfg_flags_off))
+#define bridge_cfg_values(b) ((volatile __u64 *)BRIDGE_ARRAY(b, cfg_values_off))
+#define bridge_mmio_addrs(b) ((volatile __u64 *)BRIDGE_ARRAY(b, mmio_addrs_off))
+#define bridge_req_ring(b, cpu) ((volatile struct device_req_ring *) \
+		((char *)BRIDGE_ARRAY(b, req_rings_off) + (unsigned long)(cpu) * (b)->req_ring_size))
+
+// used when init virtio, the kernel module writes back the size of the bridge.
+// abi_version and req_size are HVISOR_VIRTIO_ABI_VERSION and sizeof(struct device_req)
+// of the daemon, a module built with another layout rejects them.
+struct hvisor_virtio_init {
+	__u32 abi_version;
+	__u32 req_size;
+	__u32 cpus;
+	__u32 req_depth;
+	__u32 res_depth;
+	__u32 max_devs;
+	__u64 size;
+};
+
+// The request rings, by cpu, whose requests wake up a /dev/hvisor file. An irq wakes
+// only the files owning a non-empty ring, a file without rings is woken by every irq.
+struct hvisor_wakeup_rings {
+	__u64 cpus[MAX_CPUS / 64];
+};
+
+#define HVISOR_INIT_VIRTIO  _IOWR(1, 0, struct hvisor_virtio_init*) // virtio device init
 #define HVISOR_GET_TASK _IO(1, 1)	
 #define HVISOR_FINISH_REQ _IO(1, 2)		  // finish one virtio req	
 #define HVISOR_ZONE_START _IOW(1, 3, struct hvisor_zone_info*)
 #define HVISOR_ZONE_SHUTDOWN _IOW(1, 4, __u64)
+#define HVISOR_SET_WAKEUP_RINGS _IOW(1, 5, struct hvisor_wakeup_rings*)
 
 #define HVISOR_HC_INIT_VIRTIO 0
 #define HVISOR_HC_FINISH_REQ 1
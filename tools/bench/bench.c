@@ -0,0 +1,742 @@
+// Microbenchmarks of the virtqueue and mmio primitives of the daemon.
+// virtio.c is built into this file to reach its static functions, the Makefile
+// leaves it out of the other objects. Rings and guest memory come from the
+// simulated hvisor, see sim/sim.h, no device backend or thread is started.
+#define _GNU_SOURCE
+#include "../virtio.c"
+#include "sim.h"
+
+#define BENCH_MMIO_BASE 0xa000000
+#define BENCH_MMIO_LEN 0x200
+#define BENCH_QUEUE_NUM VIRTQUEUE_BLK_MAX_SIZE
+// ops of a round of the benchmarks that need no preparation
+#define BENCH_ROUND_OPS 1024
+// devices addressed by the lookup benchmarks, in a random but fixed order
+#define BENCH_ADDRS (1 << 12)
+#define BENCH_MAX_REPS 64
+#define BENCH_PUSH_BATCH 32
+
+static struct {
+    int reps;
+    uint64_t rep_ns;
+    char *filter;
+    bool json;
+    bool list;
+} conf = {
+    .reps = 5,
+    .rep_ns = 200000000ULL,
+};
+
+// Allocations are counted by interposing the allocator of glibc.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static uint64_t allocs;
+
+void *malloc(size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+// A round is prepared untimed, then its ops are timed together.
+struct bench {
+    const char *name;
+    int (*prepare)(void);   // returns the ops of the round, NULL runs BENCH_ROUND_OPS
+    void (*run)(int ops);
+};
+
+struct bench_rep {
+    double ns_per_op;
+    double cycles_per_op;
+};
+
+static bool bench_failed;
+static int failed_benches;
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool bench_selected(const char *name)
+{
+    char *filter, *tok, *saveptr = NULL;
+    bool selected = false;
+    if (conf.filter == NULL)
+        return true;
+    filter = strdup(conf.filter);
+    for (tok = strtok_r(filter, ",", &saveptr); tok != NULL && !selected; tok = strtok_r(NULL, ",", &saveptr))
+        selected = strstr(name, tok) != NULL;
+    free(filter);
+    return selected;
+}
+
+/// Run rounds for at least min_ns, adding up the ops, time, cycles and allocations of their timed parts.
+static void bench_rounds(struct bench *b, uint64_t min_ns, uint64_t *ops, uint64_t *ns,
+            uint64_t *cycles, uint64_t *nallocs)
+{
+    uint64_t t0, t1, c0, c1, a0;
+    int n;
+    *ops = *ns = *cycles = *nallocs = 0;
+    while (*ns < min_ns && !bench_failed) {
+        n = b->prepare ? b->prepare() : BENCH_ROUND_OPS;
+        a0 = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+        t0 = now_ns();
+        c0 = lat_ticks();
+        b->run(n);
+        c1 = lat_ticks();
+        t1 = now_ns();
+        *nallocs += __atomic_load_n(&allocs, __ATOMIC_RELAXED) - a0;
+        *ops += n;
+        *ns += t1 - t0;
+        *cycles += c1 - c0;
+    }
+}
+
+static void bench_run(struct bench *b)
+{
+    struct bench_rep reps[BENCH_MAX_REPS];
+    double ns[BENCH_MAX_REPS], cycles[BENCH_MAX_REPS];
+    uint64_t ops, t, c, a, total_ops = 0, total_allocs = 0;
+    int i;
+
+    if (!bench_selected(b->name))
+        return;
+    if (conf.list) {
+        printf("%s\n", b->name);
+        return;
+    }
+    bench_failed = false;
+    // warm up the caches, the branch predictors and the frequency
+    bench_rounds(b, conf.rep_ns / 4, &ops, &t, &c, &a);
+    for (i = 0; i < conf.reps && !bench_failed; i++) {
+        bench_rounds(b, conf.rep_ns, &ops, &t, &c, &a);
+        reps[i].ns_per_op = (double)t / ops;
+        reps[i].cycles_per_op = (double)c / ops;
+        total_ops += ops;
+        total_allocs += a;
+    }
+    if (bench_failed) {
+        failed_benches++;
+        if (conf.json)
+            printf("{\"bench\":\"%s\",\"result\":\"fail\"}\n", b->name);
+        else
+            printf("%-32s FAIL\n", b->name);
+        return;
+    }
+    for (i = 0; i < conf.reps; i++) {
+        ns[i] = reps[i].ns_per_op;
+        cycles[i] = reps[i].cycles_per_op;
+    }
+    qsort(ns, conf.reps, sizeof(double), cmp_double);
+    qsort(cycles, conf.reps, sizeof(double), cmp_double);
+    if (conf.json) {
+        printf("{\"bench\":\"%s\",\"reps\":%d,\"ops\":%lu,\"ns_per_op\":%.2f,\"ns_per_op_min\":%.2f,"
+                "\"ns_per_op_max\":%.2f,\"cycles_per_op\":%.2f,\"cycle_source\":\"%s\",\"allocs_per_op\":%.4f}\n",
+                b->name, conf.reps, total_ops, ns[conf.reps / 2], ns[0], ns[conf.reps - 1],
+                cycles[conf.reps / 2], LAT_TICKS_SOURCE, (double)total_allocs / total_ops);
+    } else {
+        printf("%-32s %9.1f ns/op (min %9.1f max %9.1f) %9.1f cycles/op %7.3f allocs/op\n",
+                b->name, ns[conf.reps / 2], ns[0], ns[conf.reps - 1], cycles[conf.reps / 2],
+                (double)total_allocs / total_ops);
+    }
+    fflush(stdout);
+}
+
+/// A blk device without backend, its config space is read from a zeroed BlkDev.
+static VirtIODevice *bench_vdev(uint64_t base_addr, bool queues)
+{
+    VirtIODevice *vdev = calloc(1, sizeof(VirtIODevice));
+    BlkDev *blk = calloc(1, sizeof(BlkDev));
+    init_mmio_regs(&vdev->regs, VirtioTBlock);
+    vdev->type = VirtioTBlock;
+    vdev->zone_id = SIM_ZONE_ID;
+    vdev->base_addr = base_addr;
+    vdev->len = BENCH_MMIO_LEN;
+    vdev->regs.dev_feature = BLK_SUPPORTED_FEATURES;
+    vdev->notify_fd = -1;
+    pthread_mutex_init(&vdev->mtx, NULL);
+    pthread_mutex_init(&vdev->notify_lock, NULL);
+    blk->config.capacity = 1 << 20;
+    blk->config.seg_max = BLK_SEG_MAX;
+    vdev->dev = blk;
+    if (queues && init_virtio_queue(vdev, VirtioTBlock)) {
+        log_error("bench: can't allocate virtqueues");
+        exit(1);
+    }
+    return vdev;
+}
+
+static void bench_vdev_free(VirtIODevice *vdev)
+{
+    free_virtio_queues(vdev);
+    free(vdev->dev);
+    free(vdev);
+}
+
+static void bench_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value)
+{
+    virtio_mmio_write(vdev, offset, value, 4);
+}
+
+/// Hand the rings to the device like a driver, through the mmio registers.
+static void bench_setup_queue(VirtIODevice *vdev, uint64_t desc, uint64_t driver, uint64_t device, bool packed)
+{
+    vdev->vqs[0].packed = packed;
+    bench_mmio_write(vdev, VIRTIO_MMIO_QUEUE_SEL, 0);
+    bench_mmio_write(vdev, VIRTIO_MMIO_QUEUE_NUM, BENCH_QUEUE_NUM);
+    bench_mmio_write(vdev, VIRTIO_MMIO_QUEUE_DESC_LOW, desc);
+    bench_mmio_write(vdev, VIRTIO_MMIO_QUEUE_DESC_HIGH, desc >> 32);
+    bench_mmio_write(vdev, VIRTIO_MMIO_QUEUE_AVAIL_LOW, driver);
+    bench_mmio_write(vdev, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, driver >> 32);
+    bench_mmio_write(vdev, VIRTIO_MMIO_QUEUE_USED_LOW, device);
+    bench_mmio_write(vdev, VIRTIO_MMIO_QUEUE_USED_HIGH, device >> 32);
+    bench_mmio_write(vdev, VIRTIO_MMIO_QUEUE_READY, 1);
+}
+
+// Rings filled with chains of the same length. A round makes every chain
+// available, the pop benchmarks time their pops, the push ones pop them untimed
+// and time putting them into the used ring.
+enum ring_layout {
+    RING_SPLIT,
+    RING_SPLIT_INDIRECT,
+    RING_PACKED,
+};
+
+static const char *ring_layout_names[] = {"split", "split-indirect", "packed"};
+
+static struct {
+    VirtIODevice *vdev;
+    VirtQueue *vq;
+    enum ring_layout layout;
+    int chain;          // descriptors of a chain
+    int chains;         // chains of a round
+    int batch;          // used elements put at once by the push benchmarks
+    struct vring vring;
+    struct vring_packed_desc *desc_packed;
+    VirtqUsedElem used[BENCH_QUEUE_NUM];
+} ring;
+
+// The last descriptor of a chain is written by the device, like the status of a blk request.
+static uint16_t chain_desc_flags(int i)
+{
+    return (i % ring.chain == ring.chain - 1) ? VRING_DESC_F_WRITE : VRING_DESC_F_NEXT;
+}
+
+static int ring_setup(enum ring_layout layout, int chain, int batch)
+{
+    uint64_t buf_gpa, desc_gpa, driver_gpa, device_gpa;
+    struct vring_desc *table;
+    void *mem;
+    int i, j, descs;
+
+    sim_guest_mem_reset();
+    memset(&ring, 0, sizeof(ring));
+    ring.layout = layout;
+    ring.chain = chain;
+    ring.batch = batch;
+    ring.chains = layout == RING_SPLIT_INDIRECT ? BENCH_QUEUE_NUM : BENCH_QUEUE_NUM / chain;
+    ring.vdev = bench_vdev(BENCH_MMIO_BASE, true);
+    ring.vq = &ring.vdev->vqs[0];
+    // every descriptor points to its own 512 bytes
+    descs = layout == RING_SPLIT_INDIRECT ? BENCH_QUEUE_NUM * chain : BENCH_QUEUE_NUM;
+    mem = sim_guest_alloc((uint64_t)descs * 512, 4096);
+    if (mem == NULL)
+        return -1;
+    buf_gpa = sim_guest_gpa(mem);
+
+    if (layout == RING_PACKED) {
+        ring.desc_packed = sim_guest_alloc(BENCH_QUEUE_NUM * sizeof(struct vring_packed_desc), 4096);
+        driver_gpa = sim_guest_gpa(sim_guest_alloc(sizeof(VirtqPackedEvent), 4));
+        device_gpa = sim_guest_gpa(sim_guest_alloc(sizeof(VirtqPackedEvent), 4));
+        for (i = 0; i < BENCH_QUEUE_NUM; i++) {
+            ring.desc_packed[i].addr = buf_gpa + i * 512;
+            ring.desc_packed[i].len = 512;
+            ring.desc_packed[i].id = i / chain;
+        }
+        bench_setup_queue(ring.vdev, sim_guest_gpa(ring.desc_packed), driver_gpa, device_gpa, true);
+        return ring.vq->ready ? 0 : -1;
+    }
+
+    mem = sim_guest_alloc(vring_size(BENCH_QUEUE_NUM, 4096), 4096);
+    if (mem == NULL)
+        return -1;
+    vring_init(&ring.vring, BENCH_QUEUE_NUM, mem, 4096);
+    for (i = 0; i < ring.chains; i++) {
+        if (layout == RING_SPLIT_INDIRECT) {
+            table = sim_guest_alloc(chain * sizeof(struct vring_desc), 16);
+            if (table == NULL)
+                return -1;
+            for (j = 0; j < chain; j++) {
+                table[j].addr = buf_gpa + (i * chain + j) * 512;
+                table[j].len = 512;
+                table[j].flags = chain_desc_flags(j);
+                table[j].next = j + 1;
+            }
+            ring.vring.desc[i].addr = sim_guest_gpa(table);
+            ring.vring.desc[i].len = chain * sizeof(struct vring_desc);
+            ring.vring.desc[i].flags = VRING_DESC_F_INDIRECT;
+        } else {
+            for (j = i * chain; j < (i + 1) * chain; j++) {
+                ring.vring.desc[j].addr = buf_gpa + j * 512;
+                ring.vring.desc[j].len = 512;
+                ring.vring.desc[j].flags = chain_desc_flags(j);
+                ring.vring.desc[j].next = j + 1;
+            }
+        }
+    }
+    // the chains are made available in the same order on every round
+    for (i = 0; i < BENCH_QUEUE_NUM; i++)
+        ring.vring.avail->ring[i] = (i % ring.chains) * (layout == RING_SPLIT_INDIRECT ? 1 : chain);
+    desc_gpa = sim_guest_gpa(ring.vring.desc);
+    driver_gpa = sim_guest_gpa(ring.vring.avail);
+    device_gpa = sim_guest_gpa(ring.vring.used);
+    bench_setup_queue(ring.vdev, desc_gpa, driver_gpa, device_gpa, false);
+    return ring.vq->ready ? 0 : -1;
+}
+
+static void ring_teardown(void)
+{
+    bench_vdev_free(ring.vdev);
+    ring.vdev = NULL;
+}
+
+/// Make every chain available once, a packed round is one lap of the ring.
+static int prepare_pop(void)
+{
+    uint16_t avail;
+    if (ring.layout != RING_PACKED) {
+        ring.vring.avail->idx += ring.chains;
+        return ring.chains;
+    }
+    avail = packed_wrap(ring.vq, ring.vq->last_avail_idx) ?
+            1 << VRING_PACKED_DESC_F_AVAIL : 1 << VRING_PACKED_DESC_F_USED;
+    for (int i = 0; i < BENCH_QUEUE_NUM; i++)
+        ring.desc_packed[i].flags = avail | chain_desc_flags(i);
+    return ring.chains;
+}
+
+static void run_pop(int ops)
+{
+    struct iovec *iov;
+    uint16_t idx;
+    for (int i = 0; i < ops; i++) {
+        if (process_descriptor_chain(ring.vq, &idx, &iov, NULL, 0) != ring.chain)
+            bench_failed = true;
+    }
+}
+
+static int prepare_push(void)
+{
+    struct iovec *iov;
+    uint16_t idx;
+    int ops = prepare_pop();
+    for (int i = 0; i < ops; i++) {
+        if (process_descriptor_chain(ring.vq, &idx, &iov, NULL, 0) != ring.chain)
+            bench_failed = true;
+        ring.used[i].id = idx;
+        ring.used[i].len = 512;
+    }
+    return ops;
+}
+
+static void run_push(int ops)
+{
+    for (int i = 0; i < ops; i++)
+        update_used_ring(ring.vq, ring.used[i].id, ring.used[i].len);
+}
+
+static void run_push_batch(int ops)
+{
+    for (int i = 0; i < ops; i += ring.batch)
+        update_used_ring_batch(ring.vq, &ring.used[i], ops - i < ring.batch ? ops - i : ring.batch);
+}
+
+static void bench_rings(void)
+{
+    static const int chains[] = {1, 2, 4, 16, 64};
+    static const int push_chains[] = {1, 16};
+    static const enum ring_layout push_layouts[] = {RING_SPLIT, RING_PACKED};
+    enum ring_layout layout;
+    struct bench b;
+    char name[64];
+    unsigned i, j;
+
+    for (layout = RING_SPLIT; layout <= RING_PACKED; layout++) {
+        for (i = 0; i < sizeof(chains) / sizeof(chains[0]); i++) {
+            // an indirect table of one descriptor only adds an indirection
+            if (layout == RING_SPLIT_INDIRECT && chains[i] == 1)
+                continue;
+            snprintf(name, sizeof(name), "pop/%s/chain=%d", ring_layout_names[layout], chains[i]);
+            b = (struct bench){ name, prepare_pop, run_pop };
+            if (!bench_selected(name))
+                continue;
+            if (ring_setup(layout, chains[i], 1) == 0)
+                bench_run(&b);
+            else
+                log_error("bench: can't set up the ring of %s", name);
+            ring_teardown();
+        }
+    }
+    for (j = 0; j < sizeof(push_layouts) / sizeof(push_layouts[0]); j++) {
+        layout = push_layouts[j];
+        for (i = 0; i < sizeof(push_chains) / sizeof(push_chains[0]); i++) {
+            snprintf(name, sizeof(name), "push/%s/chain=%d", ring_layout_names[layout], push_chains[i]);
+            b = (struct bench){ name, prepare_push, run_push };
+            if (bench_selected(name) && ring_setup(layout, push_chains[i], 1) == 0) {
+                bench_run(&b);
+                ring_teardown();
+            }
+            snprintf(name, sizeof(name), "push-batch%d/%s/chain=%d", BENCH_PUSH_BATCH,
+                    ring_layout_names[layout], push_chains[i]);
+            b = (struct bench){ name, prepare_push, run_push_batch };
+            if (bench_selected(name) && ring_setup(layout, push_chains[i], BENCH_PUSH_BATCH) == 0) {
+                bench_run(&b);
+                ring_teardown();
+            }
+        }
+    }
+}
+
+// Register accesses of one device, like the dispatcher makes them under the device lock.
+static struct {
+    VirtIODevice *vdev;
+    uint64_t offset;
+    uint64_t value;
+} mmio;
+
+static volatile uint64_t sink;
+
+static void run_mmio_read(int ops)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < ops; i++)
+        sum += virtio_mmio_read(mmio.vdev, mmio.offset, 4);
+    sink = sum;
+}
+
+static void run_mmio_write(int ops)
+{
+    for (int i = 0; i < ops; i++)
+        virtio_mmio_write(mmio.vdev, mmio.offset, mmio.value, 4);
+}
+
+static void bench_mmio(void)
+{
+    static const struct {
+        const char *name;
+        uint64_t offset;
+        uint64_t value;
+        bool write;
+    } regs[] = {
+        {"mmio-read/status", VIRTIO_MMIO_STATUS, 0, false},
+        {"mmio-read/device-features", VIRTIO_MMIO_DEVICE_FEATURES, 0, false},
+        {"mmio-read/queue-num-max", VIRTIO_MMIO_QUEUE_NUM_MAX, 0, false},
+        {"mmio-read/config", VIRTIO_MMIO_CONFIG, 0, false},
+        {"mmio-write/queue-sel", VIRTIO_MMIO_QUEUE_SEL, 0, true},
+        {"mmio-write/device-features-sel", VIRTIO_MMIO_DEVICE_FEATURES_SEL, 1, true},
+        {"mmio-write/queue-num", VIRTIO_MMIO_QUEUE_NUM, BENCH_QUEUE_NUM, true},
+    };
+    struct bench b;
+    mmio.vdev = bench_vdev(BENCH_MMIO_BASE, true);
+    for (unsigned i = 0; i < sizeof(regs) / sizeof(regs[0]); i++) {
+        mmio.offset = regs[i].offset;
+        mmio.value = regs[i].value;
+        b = (struct bench){ regs[i].name, NULL, regs[i].write ? run_mmio_write : run_mmio_read };
+        bench_run(&b);
+    }
+    bench_vdev_free(mmio.vdev);
+}
+
+// Requests to devices picked at random among many, the dispatcher's path
+// from a request of the bridge to the device's registers.
+static struct {
+    VirtIODevice **vdevs;
+    int num;
+    uint64_t addrs[BENCH_ADDRS];
+    struct device_req req;
+} lookup;
+
+static void run_lookup(int ops)
+{
+    uintptr_t sum = 0;
+    for (int i = 0; i < ops; i++)
+        sum += (uintptr_t)vdev_index_lookup(SIM_ZONE_ID, lookup.addrs[i & (BENCH_ADDRS - 1)]);
+    sink = sum;
+}
+
+static void run_handle_req(int ops)
+{
+    for (int i = 0; i < ops; i++) {
+        lookup.req.address = lookup.addrs[i & (BENCH_ADDRS - 1)];
+        if (virtio_handle_req(&lookup.req))
+            bench_failed = true;
+    }
+}
+
+static void lookup_setup(int num)
+{
+    uint64_t x = 88172645463325252ULL;
+    lookup.num = num;
+    lookup.vdevs = calloc(num, sizeof(VirtIODevice *));
+    for (int i = 0; i < num; i++) {
+        lookup.vdevs[i] = bench_vdev(BENCH_MMIO_BASE + (uint64_t)i * BENCH_MMIO_LEN, false);
+        vdev_index_insert(lookup.vdevs[i]);
+    }
+    // xorshift, the same devices in the same order on every run
+    for (int i = 0; i < BENCH_ADDRS; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        lookup.addrs[i] = BENCH_MMIO_BASE + (x % num) * BENCH_MMIO_LEN + VIRTIO_MMIO_STATUS;
+    }
+    memset(&lookup.req, 0, sizeof(lookup.req));
+    lookup.req.src_zone = SIM_ZONE_ID;
+    lookup.req.size = 4;
+}
+
+static void lookup_teardown(void)
+{
+    for (int i = 0; i < lookup.num; i++)
+        bench_vdev_free(lookup.vdevs[i]);
+    free(lookup.vdevs);
+    free(vdev_index);
+    vdev_index = NULL;
+    vdev_index_size = vdev_index_used = 0;
+}
+
+static void bench_lookup(void)
+{
+    static const int nums[] = {4, 64, 512};
+    struct bench b;
+    char name[64];
+    for (unsigned i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+        lookup_setup(nums[i]);
+        snprintf(name, sizeof(name), "vdev-lookup/devices=%d", nums[i]);
+        b = (struct bench){ name, NULL, run_lookup };
+        bench_run(&b);
+        snprintf(name, sizeof(name), "handle-req/devices=%d", nums[i]);
+        b = (struct bench){ name, NULL, run_handle_req };
+        bench_run(&b);
+        lookup_teardown();
+    }
+}
+
+// A log call under LOG_COMPILE_LEVEL, like the debug logs of the data path.
+static void run_log_compiled_out(int ops)
+{
+    for (int i = 0; i < ops; i++)
+        log_debug("virtio mmio read at %#x", i);
+}
+
+// A log call under the level of the daemon.
+static void run_log(int ops)
+{
+    for (int i = 0; i < ops; i++)
+        log_info("virtio mmio read at %#x", i);
+}
+
+static void bench_log(void)
+{
+    struct bench b = { "log/compiled-out", NULL, run_log_compiled_out };
+    bench_run(&b);
+    b = (struct bench){ "log/filtered", NULL, run_log };
+    bench_run(&b);
+}
+
+// A trace point of the data path.
+static void run_trace(int ops)
+{
+    for (int i = 0; i < ops; i++)
+        trace_event(TRACE_POP, 0, 0, i, 512, 1);
+}
+
+static void bench_trace(void)
+{
+    struct bench b = { "trace/off", NULL, run_trace };
+    bench_run(&b);
+    trace_start();
+    b = (struct bench){ "trace/on", NULL, run_trace };
+    bench_run(&b);
+    __atomic_store_n(&trace_on, false, __ATOMIC_SEQ_CST);
+}
+
+// Memory touched like the daemon does on large blk and net transfers, mapped with
+// 4 KiB pages or with 2 MiB ones like the kernel module maps aligned zone memory.
+// It is prefaulted, so only the TLB misses differ.
+#define BENCH_MEM_SIZE (512UL << 20)
+#define BENCH_MEM_HUGE (2UL << 20)
+#define BENCH_MEM_COPY (64 << 10)
+static struct {
+    char *map;
+    char *base;
+    uint64_t rng;
+    char buf[BENCH_MEM_COPY];
+} mem;
+
+static uint64_t mem_next(void)
+{
+    mem.rng ^= mem.rng << 13;
+    mem.rng ^= mem.rng >> 7;
+    mem.rng ^= mem.rng << 17;
+    return mem.rng;
+}
+
+/// Kilobytes of anonymous memory of the process backed by transparent huge pages.
+static unsigned long anon_huge_kb(void)
+{
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    char line[128];
+    unsigned long kb = 0;
+    if (fp == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+static int mem_setup(bool huge)
+{
+    mem.map = mmap(NULL, BENCH_MEM_SIZE + BENCH_MEM_HUGE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem.map == MAP_FAILED)
+        return -1;
+    mem.base = (char *)(((uintptr_t)mem.map + BENCH_MEM_HUGE - 1) & ~(BENCH_MEM_HUGE - 1));
+    madvise(mem.base, BENCH_MEM_SIZE, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    memset(mem.base, 1, BENCH_MEM_SIZE);
+    if (huge && anon_huge_kb() < (BENCH_MEM_SIZE >> 10) / 2)
+        log_warn("bench: transparent huge pages are unavailable, pages=2m runs on 4 KiB pages");
+    mem.rng = 88172645463325252ULL;
+    return 0;
+}
+
+// Read one cache line at a random address, the access pattern of the descriptor
+// and header reads of many requests. Each address depends on the previous read,
+// so the misses are not overlapped.
+static void run_mem_touch(int ops)
+{
+    uintptr_t sum = 0;
+    for (int i = 0; i < ops; i++)
+        sum += mem.base[((mem_next() ^ sum) % (BENCH_MEM_SIZE / 64)) * 64];
+    sink = sum;
+}
+
+// Copy a 64 KiB buffer at a random page, like a large blk or net payload.
+static void run_mem_copy(int ops)
+{
+    for (int i = 0; i < ops; i++)
+        memcpy(mem.buf, mem.base + (mem_next() % ((BENCH_MEM_SIZE - BENCH_MEM_COPY) / 4096)) * 4096,
+                BENCH_MEM_COPY);
+    sink = (uintptr_t)mem.buf[0];
+}
+
+static void bench_mem(void)
+{
+    static const char *names[][2] = {
+        {"guest-mem/touch/pages=4k", "guest-mem/copy-64k/pages=4k"},
+        {"guest-mem/touch/pages=2m", "guest-mem/copy-64k/pages=2m"},
+    };
+    struct bench b[2];
+    for (int huge = 0; huge < 2; huge++) {
+        b[0] = (struct bench){ names[huge][0], NULL, run_mem_touch };
+        b[1] = (struct bench){ names[huge][1], NULL, run_mem_copy };
+        // don't map the memory only to list or skip the benchmarks
+        if (!conf.list && (bench_selected(b[0].name) || bench_selected(b[1].name))) {
+            if (mem_setup(huge)) {
+                log_error("bench: can't map %lu MiB", BENCH_MEM_SIZE >> 20);
+                failed_benches++;
+                return;
+            }
+            bench_run(&b[0]);
+            bench_run(&b[1]);
+            munmap(mem.map, BENCH_MEM_SIZE + BENCH_MEM_HUGE);
+        } else {
+            bench_run(&b[0]);
+            bench_run(&b[1]);
+        }
+    }
+}
+
+static void __attribute__((noreturn)) help(int exit_status)
+{
+    printf("Usage: hvisor-bench [options]\n"
+            "Microbenchmarks of the virtqueue and mmio handling of the virtio daemon.\n"
+            "  -f list   only run the benchmarks whose name contains one of the comma separated strings\n"
+            "  -r reps   repetitions of each benchmark, default %d, the median is reported\n"
+            "  -t msecs  duration of a repetition, default %lu\n"
+            "  -l        list the benchmarks\n"
+            "  -j        print results as json lines\n",
+            conf.reps, conf.rep_ns / 1000000);
+    exit(exit_status);
+}
+
+int main(int argc, char *argv[])
+{
+    struct hvisor_virtio_init init = bridge_geometry;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:r:t:ljh")) != -1) {
+        switch (opt) {
+        case 'f': conf.filter = optarg; break;
+        case 'r': conf.reps = strtol(optarg, NULL, 10); break;
+        case 't': conf.rep_ns = strtoull(optarg, NULL, 10) * 1000000; break;
+        case 'l': conf.list = true; break;
+        case 'j': conf.json = true; break;
+        case 'h': help(0);
+        default: help(1);
+        }
+    }
+    if (conf.reps < 1 || conf.reps > BENCH_MAX_REPS || conf.rep_ns == 0)
+        help(1);
+
+    // the level the daemon runs at by default
+    log_set_level(LOG_WARN);
+    if (sim_hv_init()) {
+        log_error("bench: can't allocate guest memory");
+        return 1;
+    }
+    hvisor_platform = &sim_platform;
+    if (hvisor_platform->init_virtio(-1, &init)) {
+        log_error("bench: can't create the bridge, errno is %d", errno);
+        return 1;
+    }
+    virtio_bridge = sim_hv_bridge();
+    // counters as the daemon keeps them, in memory not seen by hvisor stat
+    if (metrics_init(NULL))
+        return 1;
+    lat_init();
+    if (guest_mem_add_region(SIM_ZONE_ID, SIM_RAM_GPA, SIM_RAM_GPA, SIM_RAM_SIZE) ||
+            guest_mem_map(-1)) {
+        log_error("bench: can't map guest memory");
+        return 1;
+    }
+
+    bench_rings();
+    bench_mmio();
+    bench_lookup();
+    bench_log();
+    bench_trace();
+    bench_mem();
+
+    guest_mem_unmap();
+    metrics_exit();
+    sim_hv_exit();
+    return failed_benches ? 1 : 0;
+}
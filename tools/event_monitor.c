@@ -1,32 +1,43 @@
 #include "event_monitor.h"
 #include "log.h"
+#include "thread_conf.h"
 #include <pthread.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 static int epoll_fd;
-static int events_num;
+static int events_num, events_cap;
+static void (*after_batch)(void);
 pthread_t emonitor_tid;
 int closing;
-#define	MAX_EVENTS	16
-struct hvisor_event *events[MAX_EVENTS];
+// ready events taken by one epoll_wait
+#define	EPOLL_BATCH	64
+struct hvisor_event **events;
 static void *epoll_loop()
 {
-    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event events[EPOLL_BATCH];
     struct hvisor_event *hevent;
-    int ret, i;
+    int ret, i, timeout;
+    thread_conf_apply(ThreadEvent);
     for (;;) {
-        ret = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-		log_debug("ret is %d, errno is %d", ret, errno);
-        if (ret < 0 && errno != EINTR)
-            log_error("epoll_wait failed, errno is %d", errno);
-        for (i = 0; i < ret; ++i) {
-            // handle active hvisor_event
-            hevent = events[i].data.ptr;
-            if (hevent == NULL) 
-                log_error("hevent shouldn't be null");
-			hevent->handler(hevent->fd, hevent->epoll_type, hevent->param);
-        }
+        timeout = -1;
+        do {
+            ret = epoll_wait(epoll_fd, events, EPOLL_BATCH, timeout);
+            log_debug("ret is %d, errno is %d", ret, errno);
+            if (ret < 0 && errno != EINTR)
+                log_error("epoll_wait failed, errno is %d", errno);
+            for (i = 0; i < ret; ++i) {
+                // handle active hvisor_event
+                hevent = events[i].data.ptr;
+                if (hevent == NULL) 
+                    log_error("hevent shouldn't be null");
+                hevent->handler(hevent->fd, hevent->epoll_type, hevent->param);
+            }
+            // a full batch may leave ready events behind, take them before flushing
+            timeout = 0;
+        } while (ret == EPOLL_BATCH);
+        if (after_batch != NULL)
+            after_batch();
     }
 	pthread_exit(NULL);
 	return NULL;
@@ -35,18 +46,27 @@ static void *epoll_loop()
 struct hvisor_event *add_event(int fd, int epoll_type,
         void (*handler)(int, int, void *), void *param)
 {
-    struct hvisor_event *hevent;
+    struct hvisor_event *hevent, **new_events;
     struct epoll_event eevent;
     int ret;
-	if (events_num >= MAX_EVENTS) {
-		log_error("events are full");
-		return NULL;
-	}
     if (fd < 0 || handler == NULL) {
 		log_error("invalid fd or handler");
         return NULL;
 	}
+	if (events_num == events_cap) {
+		new_events = realloc(events, (events_cap ? 2 * events_cap : 16) * sizeof(*events));
+		if (new_events == NULL) {
+			log_error("no memory for events");
+			return NULL;
+		}
+		events = new_events;
+		events_cap = events_cap ? 2 * events_cap : 16;
+	}
     hevent = calloc(1, sizeof(struct hvisor_event));
+	if (hevent == NULL) {
+		log_error("no memory for event");
+		return NULL;
+	}
 	hevent->handler = handler;
     hevent->param = param;
     hevent->fd = fd;
@@ -68,8 +88,9 @@ struct hvisor_event *add_event(int fd, int epoll_type,
 }
 
 // Create a thread monitoring events.
-int initialize_event_monitor()
+int initialize_event_monitor(void (*after_batch_fn)(void))
 {
+    after_batch = after_batch_fn;
     epoll_fd = epoll_create1(0);
     log_debug("create epoll_fd is %d", epoll_fd);
     pthread_create(&emonitor_tid, NULL, epoll_loop, NULL);
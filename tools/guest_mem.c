@@ -0,0 +1,274 @@
+#include "guest_mem.h"
+#include "hvisor.h"
+#include "platform.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// The regions of one zone, sorted by gpa.
+struct zone_mem {
+    uint32_t zone_id;
+    int regions_num;
+    struct guest_mem_region *regions;
+};
+
+static struct zone_mem *zones;
+static int zones_num;
+/// Touch every region after mapping it.
+static int prefault;
+
+// The kernel module maps 2MiB at once if the address in the daemon is aligned like the physical one.
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define SMALL_PAGE_SIZE 4096UL
+/// The region hit by the last translation of this thread, and the zone it was for.
+static __thread struct guest_mem_region *last_region;
+static __thread uint32_t last_zone_id;
+
+static struct zone_mem *find_zone(uint32_t zone_id)
+{
+    for (int i = 0; i < zones_num; i++) {
+        if (zones[i].zone_id == zone_id)
+            return &zones[i];
+    }
+    return NULL;
+}
+
+static int cmp_region(const void *a, const void *b)
+{
+    const struct guest_mem_region *ra = a, *rb = b;
+    return ra->gpa < rb->gpa ? -1 : ra->gpa > rb->gpa;
+}
+
+/// Record a region of zone_id, it is mapped by guest_mem_map.
+/// \return 0, -1 if the region is invalid or overlaps another one, or -ENOMEM.
+int guest_mem_add_region(uint32_t zone_id, uint64_t gpa, uint64_t hpa, uint64_t size)
+{
+    struct zone_mem *zone, *new_zones;
+    struct guest_mem_region *r, *regions;
+    if (size == 0 || gpa + size < gpa) {
+        log_error("invalid memory region %#lx, size %#lx", gpa, size);
+        return -1;
+    }
+    zone = find_zone(zone_id);
+    if (zone == NULL) {
+        new_zones = realloc(zones, sizeof(struct zone_mem) * (zones_num + 1));
+        if (new_zones == NULL)
+            goto nomem;
+        zones = new_zones;
+        zone = &zones[zones_num++];
+        zone->zone_id = zone_id;
+        zone->regions_num = 0;
+        zone->regions = NULL;
+    }
+    for (int i = 0; i < zone->regions_num; i++) {
+        r = &zone->regions[i];
+        if (gpa < r->gpa + r->size && r->gpa < gpa + size) {
+            log_error("memory region %#lx of zone %d overlaps with %#lx", gpa, zone_id, r->gpa);
+            return -1;
+        }
+    }
+    regions = realloc(zone->regions, sizeof(struct guest_mem_region) * (zone->regions_num + 1));
+    if (regions == NULL)
+        goto nomem;
+    zone->regions = regions;
+    zone->regions[zone->regions_num++] = (struct guest_mem_region) {
+        .zone_id = zone_id, .gpa = gpa, .hpa = hpa, .size = size, .hva = NULL,
+    };
+    qsort(zone->regions, zone->regions_num, sizeof(struct guest_mem_region), cmp_region);
+    return 0;
+nomem:
+    log_error("no memory for memory region %#lx of zone %d", gpa, zone_id);
+    return -ENOMEM;
+}
+
+// parse "zone_id=1,addr=0x50000000,size=0x30000000[,phys=0x50000000]"
+int guest_mem_parse_region(char *arg)
+{
+    uint64_t gpa = 0, hpa = 0, size = 0;
+    uint32_t zone_id = 0;
+    int has_hpa = 0;
+    char *now, *key;
+    for (now = strtok(arg, "="); now != NULL; now = strtok(NULL, "=")) {
+        key = now;
+        now = strtok(NULL, ",");
+        if (now == NULL) {
+            log_error("missing value of %s", key);
+            return -1;
+        }
+        if (strcmp(key, "zone_id") == 0) {
+            zone_id = strtoul(now, NULL, 10);
+        } else if (strcmp(key, "addr") == 0) {
+            gpa = strtoull(now, NULL, 16);
+        } else if (strcmp(key, "size") == 0) {
+            size = strtoull(now, NULL, 16);
+        } else if (strcmp(key, "phys") == 0) {
+            hpa = strtoull(now, NULL, 16);
+            has_hpa = 1;
+        } else {
+            log_error("unknown memory option %s", key);
+            return -1;
+        }
+    }
+    if (zone_id == 0 || size == 0) {
+        log_error("memory region needs zone_id and size");
+        return -1;
+    }
+    // zones' memory is identity mapped unless told otherwise.
+    return guest_mem_add_region(zone_id, gpa, has_hpa ? hpa : gpa, size);
+}
+
+void guest_mem_set_prefault(int enable)
+{
+    prefault = enable;
+}
+
+/// mmap [hpa, hpa + size) at an address congruent to hpa modulo 2MiB.
+static void *map_region(int ko_fd, uint64_t hpa, uint64_t size)
+{
+    uint64_t reserve_size = size + HUGE_PAGE_SIZE;
+    char *reserve, *addr;
+    reserve = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserve == MAP_FAILED)
+        return MAP_FAILED;
+    addr = (char *)(((uintptr_t)reserve + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    addr += hpa & (HUGE_PAGE_SIZE - 1);
+    if (addr >= reserve + HUGE_PAGE_SIZE)
+        addr -= HUGE_PAGE_SIZE;
+    if (hvisor_platform->map(ko_fd, addr, size, hpa) == MAP_FAILED) {
+        munmap(reserve, reserve_size);
+        return MAP_FAILED;
+    }
+    // give back the unused head and tail of the reservation
+    if (addr > reserve)
+        munmap(reserve, addr - reserve);
+    if (addr + size < reserve + reserve_size)
+        munmap(addr + size, reserve + reserve_size - (addr + size));
+    return addr;
+}
+
+/// Fault in the whole region now instead of on the data path. The pages of the kernel
+/// module are pinned physical memory, mlock has nothing to add to them.
+static void prefault_region(struct guest_mem_region *r)
+{
+    volatile char *p = r->hva;
+    for (uint64_t off = 0; off < r->size; off += SMALL_PAGE_SIZE)
+        (void)p[off];
+}
+
+/// mmap every region through the hvisor platform.
+int guest_mem_map(int ko_fd)
+{
+    struct guest_mem_region *r;
+    if (zones_num == 0 && guest_mem_add_region(GUEST_MEM_ANY_ZONE, NON_ROOT_PHYS_START,
+                NON_ROOT_PHYS_START, NON_ROOT_PHYS_SIZE))
+        return -1;
+    for (int i = 0; i < zones_num; i++) {
+        for (int j = 0; j < zones[i].regions_num; j++) {
+            r = &zones[i].regions[j];
+            r->hva = map_region(ko_fd, r->hpa, r->size);
+            if (r->hva == MAP_FAILED) {
+                log_error("mmap memory region %#lx of zone %d failed", r->gpa, r->zone_id);
+                r->hva = NULL;
+                return -1;
+            }
+            if (prefault)
+                prefault_region(r);
+            log_info("zone %d: ipa %#lx, size %#lx mapped at %p", r->zone_id, r->gpa, r->size, r->hva);
+        }
+    }
+    return 0;
+}
+
+void guest_mem_unmap(void)
+{
+    for (int i = 0; i < zones_num; i++) {
+        for (int j = 0; j < zones[i].regions_num; j++) {
+            if (zones[i].regions[j].hva != NULL)
+                munmap(zones[i].regions[j].hva, zones[i].regions[j].size);
+        }
+        free(zones[i].regions);
+    }
+    free(zones);
+    zones = NULL;
+    zones_num = 0;
+    last_region = NULL;
+}
+
+/// The regions backing the memory of zone_id, sorted by gpa.
+/// \return their number, 0 if the zone has none.
+int guest_mem_regions(uint32_t zone_id, struct guest_mem_region **regions)
+{
+    struct zone_mem *zone = find_zone(zone_id);
+    if (zone == NULL)
+        zone = find_zone(GUEST_MEM_ANY_ZONE);
+    if (zone == NULL)
+        return 0;
+    *regions = zone->regions;
+    return zone->regions_num;
+}
+
+/// Whether the kernel can pin the pages of [hva, hva + size), which direct I/O needs.
+/// The kernel module maps physical memory with VM_PFNMAP | VM_IO, those pages can't be pinned.
+/// \return 1 if every mapping of the range is pinnable, 0 if one isn't, -1 if it's unknown.
+int guest_mem_pinnable(void *hva, uint64_t size)
+{
+    uintptr_t start = (uintptr_t)hva, end = start + size, lo = 0, hi = 0, vma_lo, vma_hi;
+    int found = 0, ret = 1;
+    char line[256];
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL)
+        return -1;
+    while (ret == 1 && fgets(line, sizeof(line), smaps) != NULL) {
+        if (sscanf(line, "%lx-%lx ", &vma_lo, &vma_hi) == 2) {
+            lo = vma_lo, hi = vma_hi;
+            continue;
+        }
+        if (strncmp(line, "VmFlags:", 8) != 0 || hi <= start || lo >= end)
+            continue;
+        found = 1;
+        if (strstr(line, " pf") != NULL || strstr(line, " io") != NULL)
+            ret = 0;
+    }
+    fclose(smaps);
+    return found ? ret : -1;
+}
+
+static inline int region_contains(struct guest_mem_region *r, uint64_t gpa, uint64_t len)
+{
+    return gpa >= r->gpa && len <= r->size && gpa - r->gpa <= r->size - len;
+}
+
+/// Translate [gpa, gpa + len) of zone_id to the daemon's address.
+/// \return NULL if the range is not inside one mapped region.
+void *guest_mem_translate(uint32_t zone_id, uint64_t gpa, uint64_t len)
+{
+    struct guest_mem_region *r = last_region;
+    struct zone_mem *zone;
+    int lo, hi, mid;
+    if (r != NULL && last_zone_id == zone_id && region_contains(r, gpa, len))
+        return (char *)r->hva + (gpa - r->gpa);
+
+    zone = find_zone(zone_id);
+    if (zone == NULL)
+        zone = find_zone(GUEST_MEM_ANY_ZONE);
+    if (zone == NULL)
+        return NULL;
+    // find the last region starting at or below gpa
+    lo = 0, hi = zone->regions_num - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (zone->regions[mid].gpa <= gpa)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    r = &zone->regions[lo];
+    if (r->hva == NULL || !region_contains(r, gpa, len))
+        return NULL;
+    last_region = r;
+    last_zone_id = zone_id;
+    return (char *)r->hva + (gpa - r->gpa);
+}
@@ -13,8 +13,13 @@
 #include "virtio.h"
 #include "log.h"
 #include "event_monitor.h"
+#include "metrics.h"
+#include "trace.h"
+#include "latency.h"
 #include <errno.h>
+#include <inttypes.h>
 #include <getopt.h>
+#include <time.h>
 
 static void __attribute__((noreturn)) help(int exit_status) {
     printf("Invalid Parameters!\n");
@@ -165,6 +170,408 @@ static int zone_shutdown(int argc, char *argv[]) {
 	return err;
 }
 
+// Counters of the daemon summed over the thread slots.
+struct stat_sample {
+    uint64_t ns;
+    int32_t pid;
+    uint64_t start_ns;
+    uint32_t devs_num;
+    uint32_t devs_uncounted;
+    uint64_t global[METRICS_GLOBAL_COUNTERS];
+    struct metrics_dev devs[METRICS_MAX_DEVS];
+};
+
+static void stat_read(const struct metrics_shm *shm, struct stat_sample *sample)
+{
+    const struct metrics_slot *slot;
+    struct timespec ts;
+    uint32_t slots = __atomic_load_n(&shm->slots_used, __ATOMIC_RELAXED);
+    uint32_t i, j, q, c;
+
+    memset(sample, 0, sizeof(*sample));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    sample->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    sample->pid = shm->pid;
+    sample->start_ns = shm->start_ns;
+    sample->devs_num = __atomic_load_n(&shm->devs_num, __ATOMIC_ACQUIRE);
+    sample->devs_uncounted = __atomic_load_n(&shm->devs_uncounted, __ATOMIC_RELAXED);
+    if (slots > METRICS_SLOTS)
+        slots = METRICS_SLOTS;
+    for (i = 0; i < slots; i++) {
+        slot = &shm->slots[i];
+        for (c = 0; c < METRICS_GLOBAL_COUNTERS; c++)
+            sample->global[c] += __atomic_load_n(&slot->global[c], __ATOMIC_RELAXED);
+        for (j = 0; j < sample->devs_num; j++) {
+            sample->devs[j].mmio += __atomic_load_n(&slot->devs[j].mmio, __ATOMIC_RELAXED);
+            for (q = 0; q < METRICS_MAX_QUEUES; q++) {
+                for (c = 0; c < METRICS_QUEUE_COUNTERS; c++)
+                    sample->devs[j].queues[q][c] +=
+                            __atomic_load_n(&slot->devs[j].queues[q][c], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+static const char *stat_dev_type(uint32_t type)
+{
+    switch (type) {
+    case VirtioTNet:
+        return "net";
+    case VirtioTBlock:
+        return "blk";
+    case VirtioTConsole:
+        return "console";
+    default:
+        return "unknown";
+    }
+}
+
+static void stat_print(const struct metrics_shm *shm, struct stat_sample *old, struct stat_sample *new, long zone_id)
+{
+    const struct metrics_dev_info *info;
+    const uint64_t *o, *n;
+    double secs = (new->ns - old->ns) / 1e9;
+    char name[32];
+
+    printf("\n%-5s %-20s %5s %10s %10s %10s %10s %9s %9s %9s %9s %8s %10s\n", "zone", "device", "queue",
+            "req/s", "notify/s", "irq/s", "mmio/s", "MiB/s out", "MiB/s in", "drops/s", "full/s",
+            "inflight", "avg bytes");
+    for (uint32_t i = 0; i < new->devs_num; i++) {
+        info = &shm->devs[i];
+        if (zone_id >= 0 && info->zone_id != zone_id)
+            continue;
+        snprintf(name, sizeof(name), "%s@%#" PRIx64, stat_dev_type(info->type), info->base_addr);
+        for (uint32_t q = 0; q < info->queues; q++) {
+            o = old->devs[i].queues[q];
+            n = new->devs[i].queues[q];
+            printf("%-5u %-20s %5u %10.0f %10.0f %10.0f %10.0f %9.2f %9.2f %9.0f %9.0f %8" PRId64 " %10.0f\n",
+                    info->zone_id, name, q,
+                    (n[METRIC_REQS] - o[METRIC_REQS]) / secs,
+                    (n[METRIC_NOTIFIES] - o[METRIC_NOTIFIES]) / secs,
+                    (n[METRIC_IRQS] - o[METRIC_IRQS]) / secs,
+                    q == 0 ? (new->devs[i].mmio - old->devs[i].mmio) / secs : 0,
+                    (n[METRIC_BYTES_OUT] - o[METRIC_BYTES_OUT]) / secs / (1 << 20),
+                    (n[METRIC_BYTES_IN] - o[METRIC_BYTES_IN]) / secs / (1 << 20),
+                    (n[METRIC_DROPS] - o[METRIC_DROPS]) / secs,
+                    (n[METRIC_RING_FULL] - o[METRIC_RING_FULL]) / secs,
+                    (int64_t)(n[METRIC_REQS] - n[METRIC_COMPLETIONS]),
+                    n[METRIC_REQS] == o[METRIC_REQS] ? 0 :
+                    (double)(n[METRIC_BYTES_OUT] - o[METRIC_BYTES_OUT] + n[METRIC_BYTES_IN] - o[METRIC_BYTES_IN]) /
+                    (n[METRIC_REQS] - o[METRIC_REQS]));
+        }
+    }
+    printf("hypercalls/s %.0f, res list full/s %.0f\n",
+            (new->global[METRIC_HYPERCALLS] - old->global[METRIC_HYPERCALLS]) / secs,
+            (new->global[METRIC_RES_FULL] - old->global[METRIC_RES_FULL]) / secs);
+    if (new->devs_uncounted)
+        printf("%u devices past the first %d are not counted\n", new->devs_uncounted, METRICS_MAX_DEVS);
+    fflush(stdout);
+}
+
+// ./hvisor stat [-i secs] [-n count] [-z zone_id]
+// The first report is the average since the daemon started, the next ones are over the interval.
+static int virtio_stat(int argc, char *argv[]) {
+    struct stat_sample *old, *new, *tmp;
+    struct metrics_shm *shm;
+    double interval = 1;
+    long count = -1, zone_id = -1;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "i:n:z:")) != -1) {
+        switch (opt) {
+        case 'i': interval = strtod(optarg, NULL); break;
+        case 'n': count = strtol(optarg, NULL, 10); break;
+        case 'z': zone_id = strtol(optarg, NULL, 10); break;
+        default: help(1);
+        }
+    }
+    if (interval <= 0)
+        help(1);
+    fd = shm_open(METRICS_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "no virtio daemon is running, can't open %s\n", METRICS_SHM_NAME);
+        return -1;
+    }
+    shm = mmap(NULL, sizeof(struct metrics_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("virtio_stat: mmap failed");
+        return -1;
+    }
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC || shm->version != METRICS_VERSION) {
+        fprintf(stderr, "%s is not a metrics segment of this version\n", METRICS_SHM_NAME);
+        munmap(shm, sizeof(struct metrics_shm));
+        return -1;
+    }
+    old = calloc(1, sizeof(struct stat_sample));
+    new = calloc(1, sizeof(struct stat_sample));
+    if (old == NULL || new == NULL) {
+        fprintf(stderr, "virtio_stat: no memory for the samples\n");
+        free(old);
+        free(new);
+        munmap(shm, sizeof(struct metrics_shm));
+        return -1;
+    }
+    stat_read(shm, new);
+    // all counters start at 0 with the daemon
+    old->ns = new->start_ns;
+    old->pid = new->pid;
+    old->start_ns = new->start_ns;
+    for (; count != 0; count--) {
+        if (new->pid != old->pid || new->start_ns != old->start_ns) {
+            printf("\nvirtio daemon restarted\n");
+            memset(old, 0, sizeof(*old));
+            old->ns = new->start_ns;
+        }
+        if (new->ns > old->ns)
+            stat_print(shm, old, new, zone_id);
+        if (count == 1)
+            break;
+        tmp = old;
+        old = new;
+        new = tmp;
+        usleep(interval * 1000000);
+        stat_read(shm, new);
+    }
+    free(old);
+    free(new);
+    munmap(shm, sizeof(struct metrics_shm));
+    return 0;
+}
+
+// A record of a trace and the thread that wrote it.
+struct trace_entry {
+    struct trace_rec rec;
+    uint32_t tid;
+};
+
+// Counters of a queue in the summary of a trace.
+struct trace_queue_sum {
+    uint64_t events[TRACE_EVENTS];
+    uint64_t bytes_out, bytes_in;
+    uint64_t served, serve_ns, serve_max_ns;
+    uint64_t *pop_ts;   // ts of the pop of each idx still in flight
+};
+
+static const char *trace_event_names[TRACE_EVENTS] = {
+    [TRACE_POP] = "pop", [TRACE_PUSH] = "push", [TRACE_NOTIFY] = "notify", [TRACE_IRQ] = "irq",
+    [TRACE_FLUSH] = "flush", [TRACE_MMIO_READ] = "read", [TRACE_MMIO_WRITE] = "write",
+};
+
+static int trace_entry_cmp(const void *a, const void *b)
+{
+    const struct trace_entry *x = a, *y = b;
+    return x->rec.ts < y->rec.ts ? -1 : x->rec.ts > y->rec.ts;
+}
+
+static uint64_t trace_ns(const struct trace_file_hdr *hdr, uint64_t ticks)
+{
+    return (unsigned __int128)ticks * hdr->ns_mult >> 32;
+}
+
+static void trace_dev_name(const struct trace_file_hdr *hdr, uint16_t dev, char *name, size_t size)
+{
+    if (dev < hdr->devs_num)
+        snprintf(name, size, "%s@%#" PRIx64, stat_dev_type(hdr->devs[dev].type), hdr->devs[dev].base_addr);
+    else
+        snprintf(name, size, "-");
+}
+
+static void trace_print(const struct trace_file_hdr *hdr, const struct trace_entry *entries, uint64_t n)
+{
+    const struct trace_rec *r;
+    char name[32];
+
+    printf("%14s %7s %-6s %-20s %s\n", "time us", "thread", "event", "device", "details");
+    for (uint64_t i = 0; i < n; i++) {
+        r = &entries[i].rec;
+        trace_dev_name(hdr, r->dev, name, sizeof(name));
+        printf("%14.3f %7u %-6s %-20s ", trace_ns(hdr, r->ts - entries[0].rec.ts) / 1000.0, entries[i].tid,
+                r->event < TRACE_EVENTS && trace_event_names[r->event] ? trace_event_names[r->event] : "?", name);
+        switch (r->event) {
+        case TRACE_POP:
+            printf("queue %u idx %u len %u descs %d\n", r->queue, r->idx, r->len, (int32_t)r->arg);
+            break;
+        case TRACE_PUSH:
+            printf("queue %u idx %u len %u\n", r->queue, r->idx, r->len);
+            break;
+        case TRACE_NOTIFY:
+        case TRACE_IRQ:
+            printf("queue %u\n", r->queue);
+            break;
+        case TRACE_FLUSH:
+            printf("irqs %u\n", r->len);
+            break;
+        case TRACE_MMIO_READ:
+        case TRACE_MMIO_WRITE:
+            printf("%s(%#x) %s %#x vcpu %u\n", lat_reg_name(r->idx), r->idx,
+                    r->event == TRACE_MMIO_READ ? "->" : "<-", r->len, r->arg);
+            break;
+        default:
+            printf("\n");
+        }
+    }
+}
+
+static void trace_summary(const struct trace_file_hdr *hdr, const struct trace_entry *entries, uint64_t n)
+{
+    struct trace_queue_sum *sums, *q;
+    uint64_t mmio[METRICS_MAX_DEVS][LAT_REGS] = {{0}};
+    uint64_t flushes = 0, flushed = 0, ns, secs_ns;
+    const struct trace_rec *r;
+    char name[32];
+
+    sums = calloc(METRICS_MAX_DEVS * METRICS_MAX_QUEUES, sizeof(*sums));
+    if (sums == NULL) {
+        fprintf(stderr, "virtio_trace: no memory for the summary\n");
+        return;
+    }
+    secs_ns = n ? trace_ns(hdr, entries[n - 1].rec.ts - entries[0].rec.ts) : 0;
+    for (uint64_t i = 0; i < n; i++) {
+        r = &entries[i].rec;
+        if (r->event == TRACE_FLUSH) {
+            flushes++;
+            flushed += r->len;
+            continue;
+        }
+        if (r->dev >= METRICS_MAX_DEVS || r->event >= TRACE_EVENTS)
+            continue;
+        if (r->event == TRACE_MMIO_READ || r->event == TRACE_MMIO_WRITE) {
+            mmio[r->dev][r->idx >= VIRTIO_MMIO_CONFIG ? LAT_REGS - 1 : r->idx / 4]++;
+            continue;
+        }
+        if (r->queue >= METRICS_MAX_QUEUES)
+            continue;
+        q = &sums[r->dev * METRICS_MAX_QUEUES + r->queue];
+        q->events[r->event]++;
+        if (r->event == TRACE_POP) {
+            q->bytes_out += r->len;
+            if (q->pop_ts == NULL)
+                q->pop_ts = calloc(1 << 16, sizeof(uint64_t));
+            // without memory, the pop-push times of the queue are left out
+            if (q->pop_ts != NULL)
+                q->pop_ts[r->idx] = r->ts;
+        } else if (r->event == TRACE_PUSH) {
+            q->bytes_in += r->len;
+            // a push without its pop in the trace is skipped
+            if (q->pop_ts != NULL && q->pop_ts[r->idx] != 0) {
+                ns = trace_ns(hdr, r->ts - q->pop_ts[r->idx]);
+                q->pop_ts[r->idx] = 0;
+                q->served++;
+                q->serve_ns += ns;
+                if (ns > q->serve_max_ns)
+                    q->serve_max_ns = ns;
+            }
+        }
+    }
+
+    printf("%" PRIu64 " records over %.3f ms\n", n, secs_ns / 1e6);
+    printf("\n%-5s %-20s %5s %9s %9s %9s %9s %10s %10s %11s %11s\n", "zone", "device", "queue",
+            "pops", "pushes", "notifies", "irqs", "MiB out", "MiB in", "avg pop-push", "max pop-push");
+    for (uint32_t d = 0; d < hdr->devs_num && d < METRICS_MAX_DEVS; d++) {
+        trace_dev_name(hdr, d, name, sizeof(name));
+        for (uint32_t j = 0; j < METRICS_MAX_QUEUES; j++) {
+            q = &sums[d * METRICS_MAX_QUEUES + j];
+            if (q->events[TRACE_POP] + q->events[TRACE_PUSH] + q->events[TRACE_NOTIFY] + q->events[TRACE_IRQ] != 0)
+                printf("%-5u %-20s %5u %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %10.2f %10.2f %9.1fus %9.1fus\n",
+                        hdr->devs[d].zone_id, name, j, q->events[TRACE_POP], q->events[TRACE_PUSH],
+                        q->events[TRACE_NOTIFY], q->events[TRACE_IRQ], q->bytes_out / 1048576.0,
+                        q->bytes_in / 1048576.0, q->served ? q->serve_ns / 1000.0 / q->served : 0,
+                        q->serve_max_ns / 1000.0);
+            free(q->pop_ts);
+        }
+    }
+    printf("\n%-5s %-20s %-20s %9s\n", "zone", "device", "register", "exits");
+    for (uint32_t d = 0; d < hdr->devs_num && d < METRICS_MAX_DEVS; d++) {
+        trace_dev_name(hdr, d, name, sizeof(name));
+        for (uint32_t j = 0; j < LAT_REGS; j++) {
+            if (mmio[d][j])
+                printf("%-5u %-20s %-20s %9" PRIu64 "\n", hdr->devs[d].zone_id, name, lat_reg_name(j * 4), mmio[d][j]);
+        }
+    }
+    if (flushes)
+        printf("\n%" PRIu64 " irq hypercalls, average batch %.2f\n", flushes, (double)flushed / flushes);
+    free(sums);
+}
+
+// ./hvisor trace [-s] file
+// Print the records of a trace written by the virtio daemon in time order, or with -s their summary.
+static int virtio_trace(int argc, char *argv[]) {
+    const struct trace_file_hdr *hdr;
+    const struct trace_thread_hdr *thread;
+    struct trace_entry *entries;
+    const struct trace_rec *recs;
+    const char *p, *end;
+    bool summary = false;
+    uint64_t n = 0;
+    struct stat st;
+    void *file;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+        case 's': summary = true; break;
+        default: help(1);
+        }
+    }
+    if (optind != argc - 1)
+        help(1);
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("virtio_trace: open trace failed");
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "%s is not a virtio trace\n", argv[optind]);
+        close(fd);
+        return -1;
+    }
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        perror("virtio_trace: mmap failed");
+        return -1;
+    }
+    hdr = file;
+    end = (const char *)file + st.st_size;
+    if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION ||
+            hdr->rec_size != sizeof(struct trace_rec) || hdr->devs_num > METRICS_MAX_DEVS) {
+        fprintf(stderr, "%s is not a virtio trace of this version\n", argv[optind]);
+        munmap(file, st.st_size);
+        return -1;
+    }
+    entries = malloc((st.st_size / sizeof(struct trace_rec) + 1) * sizeof(*entries));
+    if (entries == NULL) {
+        perror("virtio_trace: malloc failed");
+        munmap(file, st.st_size);
+        return -1;
+    }
+    p = (const char *)(hdr + 1);
+    for (uint32_t t = 0; t < hdr->threads; t++) {
+        thread = (const struct trace_thread_hdr *)p;
+        recs = (const struct trace_rec *)(thread + 1);
+        if ((const char *)recs > end || (uint64_t)(end - (const char *)recs) / sizeof(*recs) < thread->records) {
+            fprintf(stderr, "%s is truncated\n", argv[optind]);
+            break;
+        }
+        if (thread->lost)
+            fprintf(stderr, "thread %u: the oldest %" PRIu64 " records were overwritten\n", thread->tid, thread->lost);
+        for (uint32_t i = 0; i < thread->records; i++) {
+            entries[n].rec = recs[i];
+            entries[n++].tid = thread->tid;
+        }
+        p = (const char *)(recs + thread->records);
+    }
+    qsort(entries, n, sizeof(*entries), trace_entry_cmp);
+    if (summary)
+        trace_summary(hdr, entries, n);
+    else
+        trace_print(hdr, entries, n);
+    free(entries);
+    munmap(file, st.st_size);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int err;
@@ -172,7 +579,13 @@ int main(int argc, char *argv[])
     if (argc < 2)
         help(1);
 
-    if (strcmp(argv[1], "zone") == 0 && strcmp(argv[2], "start") == 0) {
+    if (strcmp(argv[1], "stat") == 0) {
+        err = virtio_stat(argc - 1, &argv[1]);
+    } else if (strcmp(argv[1], "trace") == 0) {
+        err = virtio_trace(argc - 1, &argv[1]);
+    } else if (argc < 3) {
+        help(1);
+    } else if (strcmp(argv[1], "zone") == 0 && strcmp(argv[2], "start") == 0) {
         err = zone_start(argc, argv);
     } else if (strcmp(argv[1], "zone") == 0 && strcmp(argv[2], "shutdown") == 0){
 		err = zone_shutdown(argc - 3, &argv[3]);
@@ -9,7 +9,8 @@ struct hvisor_event {
     int 		epoll_type;
 };
 
-int initialize_event_monitor(void);
+// after_batch, if not NULL, runs after the handlers of each batch of ready events.
+int initialize_event_monitor(void (*after_batch)(void));
 void destroy_event_monitor();
 struct hvisor_event *add_event(int fd, int epoll_type,
                           void (*handler)(int, int, void *), void *param);
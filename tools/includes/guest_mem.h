@@ -0,0 +1,26 @@
+#ifndef _HVISOR_GUEST_MEM_H
+#define _HVISOR_GUEST_MEM_H
+#include <stdint.h>
+
+/// Regions of this zone are used by the zones that have no region of their own.
+#define GUEST_MEM_ANY_ZONE UINT32_MAX
+
+// A range of a zone's physical memory mapped into the daemon.
+struct guest_mem_region {
+    uint32_t zone_id;
+    uint64_t gpa;       // start of the range in zone's ipa
+    uint64_t hpa;       // physical address backing gpa
+    uint64_t size;
+    void *hva;          // address of gpa in the daemon
+};
+
+int guest_mem_add_region(uint32_t zone_id, uint64_t gpa, uint64_t hpa, uint64_t size);
+int guest_mem_parse_region(char *arg);
+void guest_mem_set_prefault(int enable);
+int guest_mem_map(int ko_fd);
+void guest_mem_unmap(void);
+int guest_mem_regions(uint32_t zone_id, struct guest_mem_region **regions);
+int guest_mem_pinnable(void *hva, uint64_t size);
+void *guest_mem_translate(uint32_t zone_id, uint64_t gpa, uint64_t len);
+
+#endif /* _HVISOR_GUEST_MEM_H */
@@ -0,0 +1,76 @@
+#ifndef _HVISOR_LATENCY_H
+#define _HVISOR_LATENCY_H
+#include <stdint.h>
+#include <linux/virtio_mmio.h>
+
+// Latency histograms of the mmio exits handled by the daemon, per device and
+// register: the queueing delay from hvisor queueing a request to a dispatcher
+// taking it, the handling time up to the answer in cfg_flags, and their sum,
+// the time the vcpu is stalled. Timestamps are in ticks of the counter hvisor
+// writes to device_req.enqueue_ts. Every thread records into its own histograms.
+
+#if defined(__aarch64__)
+#define LAT_TICKS_SOURCE "cntvct_el0"
+#elif defined(__riscv)
+#define LAT_TICKS_SOURCE "time"
+#elif defined(__x86_64__)
+#define LAT_TICKS_SOURCE "tsc"
+#else
+#define LAT_TICKS_SOURCE "none"
+#endif
+
+// Log-linear buckets: values under LAT_SUB are exact, then every power of 2
+// is split into LAT_SUB buckets, an error under 1/LAT_SUB up to 2^LAT_MAX_BITS ns.
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS 36
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB)
+// one per 32 bit register under the config space, and the config space
+#define LAT_REGS (VIRTIO_MMIO_CONFIG / 4 + 1)
+
+enum {
+    LatQueue,   // enqueue_ts to the dispatcher taking the request
+    LatHandle,  // the dispatcher taking the request to its answer
+    LatTotal,   // enqueue_ts to the answer
+    LatKinds
+};
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+/// The counter hvisor timestamps requests with.
+static inline uint64_t lat_ticks(void)
+{
+#if defined(__aarch64__)
+    uint64_t v;
+    asm volatile ("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+#elif defined(__riscv)
+    uint64_t v;
+    asm volatile ("rdtime %0" : "=r"(v));
+    return v;
+#elif defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// ns = ticks * lat_mult >> 32, 0 until lat_init finds the frequency of the counter
+extern uint64_t lat_mult;
+
+static inline uint64_t lat_ticks_to_ns(uint64_t ticks)
+{
+    return (unsigned __int128)ticks * lat_mult >> 32;
+}
+
+void lat_init(void);
+void lat_record(uint32_t dev, uint64_t offset, uint64_t enqueue_ts, uint64_t start, uint64_t end);
+int lat_dump(const char *path);
+const char *lat_reg_name(uint32_t offset);
+
+#endif /* _HVISOR_LATENCY_H */
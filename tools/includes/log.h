@@ -39,14 +39,52 @@ enum
 	LOG_FATAL
 };
 
-#define log_trace(...) log_log(1, LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(1, LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...) log_log(1, LOG_INFO, __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...) log_log(1, LOG_WARN, __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(1, LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(1, LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+// Log calls under LOG_COMPILE_LEVEL are compiled out, e.g. -DLOG_COMPILE_LEVEL=LOG_INFO.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_TRACE
+#endif
+
+// the level set by log_set_level, checked before the arguments are evaluated
+extern int log_min_level;
+
+#define log_at(with_enter, level, ...) \
+	do { \
+		if ((level) >= LOG_COMPILE_LEVEL && (level) >= log_min_level) \
+			log_log(with_enter, level, __FILE__, __LINE__, __VA_ARGS__); \
+	} while (0)
+
+#define log_trace(...) log_at(1, LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(1, LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(1, LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(1, LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_at(1, LOG_ERROR, __VA_ARGS__)
+#define log_fatal(...) log_at(1, LOG_FATAL, __VA_ARGS__)
 // log_printf can be used like printf
-#define log_printf(...) log_log(0, LOG_INFO, __FILE__, __LINE__, __VA_ARGS__)
+#define log_printf(...) log_at(0, LOG_INFO, __VA_ARGS__)
+
+// A call site logs at most LOG_RATELIMIT_BURST messages every LOG_RATELIMIT_NS,
+// the number of the others is logged with the first message of the next period.
+#define LOG_RATELIMIT_BURST 10
+#define LOG_RATELIMIT_NS 5000000000ULL
+
+struct log_ratelimit
+{
+	unsigned long long start_ns;
+	unsigned int count;
+	unsigned int suppressed;
+};
+
+#define log_ratelimited(level, ...) \
+	do { \
+		static struct log_ratelimit _log_rl; \
+		if ((level) >= LOG_COMPILE_LEVEL && (level) >= log_min_level && \
+				log_ratelimit(&_log_rl, level, __FILE__, __LINE__)) \
+			log_log(1, level, __FILE__, __LINE__, __VA_ARGS__); \
+	} while (0)
+
+// for errors the guest can cause on every request
+#define log_warn_ratelimited(...) log_ratelimited(LOG_WARN, __VA_ARGS__)
+#define log_error_ratelimited(...) log_ratelimited(LOG_ERROR, __VA_ARGS__)
 
 const char *log_level_string(int level);
 void log_set_lock(log_LockFn fn, void *udata);
@@ -56,6 +94,7 @@ int log_add_callback(log_LogFn fn, void *udata, int level);
 int log_add_fp(FILE *fp, int level);
 
 void log_log(int with_enter, int level, const char *file, int line, const char *fmt, ...);
+bool log_ratelimit(struct log_ratelimit *rl, int level, const char *file, int line);
 void multithread_log_init();
 void mutithread_log_exit();
 #endif
@@ -0,0 +1,122 @@
+#ifndef _HVISOR_METRICS_H
+#define _HVISOR_METRICS_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Counters of the virtio daemon, published in a shared memory segment read by
+// `hvisor stat`. Every daemon thread adds to its own slot without atomics, the
+// reader sums the slots. Slots are claimed on the first update of a thread, the
+// threads beyond METRICS_SLOTS - 1 share the last slot with atomic adds.
+
+#define METRICS_SHM_NAME "/hvisor-virtio-metrics"
+#define METRICS_MAGIC 0x6876697374617473ULL
+#define METRICS_VERSION 2
+#define METRICS_SLOTS 64
+#define METRICS_MAX_DEVS 64
+#define METRICS_MAX_QUEUES 2
+
+// Counters of a virtqueue.
+enum {
+    METRIC_REQS,        // chains popped from the avail ring
+    METRIC_COMPLETIONS, // chains put into the used ring, the difference with REQS is in flight
+    METRIC_NOTIFIES,    // queue notifies written by the driver
+    METRIC_IRQS,        // irqs injected
+    METRIC_BYTES_OUT,   // bytes of the driver's buffers read by the device
+    METRIC_BYTES_IN,    // bytes written to the driver's buffers
+    METRIC_DROPS,       // packets or data discarded by the device
+    METRIC_RING_FULL,   // the device had data but no buffer was available
+    METRICS_QUEUE_COUNTERS
+};
+
+// Counters of the whole daemon.
+enum {
+    METRIC_HYPERCALLS,  // HVISOR_FINISH_REQ calls injecting the queued irqs
+    METRIC_RES_FULL,    // stalls on a full res list
+    METRICS_GLOBAL_COUNTERS
+};
+
+struct metrics_dev {
+    uint64_t mmio;      // config requests handled
+    uint64_t queues[METRICS_MAX_QUEUES][METRICS_QUEUE_COUNTERS];
+};
+
+struct metrics_slot {
+    uint64_t global[METRICS_GLOBAL_COUNTERS];
+    struct metrics_dev devs[METRICS_MAX_DEVS];
+} __attribute__((aligned(64)));
+
+struct metrics_dev_info {
+    uint32_t zone_id;
+    uint32_t type;          // VirtioDeviceType
+    uint64_t base_addr;
+    uint32_t irq_id;
+    uint32_t queues;
+};
+
+struct metrics_shm {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slots_used;    // slots claimed by the daemon threads
+    uint32_t devs_num;      // written after the info of the new device
+    int32_t pid;
+    uint64_t start_ns;      // CLOCK_MONOTONIC time of the daemon start
+    uint32_t devs_uncounted; // devices created past METRICS_MAX_DEVS, they have no counters
+    struct metrics_dev_info devs[METRICS_MAX_DEVS];
+    struct metrics_slot slots[METRICS_SLOTS];
+};
+
+extern struct metrics_shm *metrics;
+extern __thread struct metrics_slot *metrics_thread_slot;
+extern __thread bool metrics_thread_shared;
+extern struct metrics_slot metrics_discard;
+
+int metrics_init(const char *name);
+void metrics_exit(void);
+int metrics_add_dev(uint32_t zone_id, uint32_t type, uint64_t base_addr, uint32_t irq_id, uint32_t queues);
+struct metrics_slot *metrics_claim_slot(void);
+uint64_t metrics_sum_global(int counter);
+uint64_t metrics_sum_queue(uint32_t dev, uint32_t queue, int counter);
+
+static inline void metrics_inc(uint64_t *counter, uint64_t n)
+{
+    if (__builtin_expect(metrics_thread_shared, 0))
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline struct metrics_slot *metrics_slot(void)
+{
+    struct metrics_slot *slot = metrics_thread_slot;
+    if (__builtin_expect(slot == NULL, 0))
+        slot = metrics_claim_slot();
+    return slot;
+}
+
+/// The counters of queue of device dev in the slot of this thread, dev is the id given by
+/// metrics_add_dev. A device beyond METRICS_MAX_DEVS gets counters nobody reads.
+static inline uint64_t *metrics_queue(uint32_t dev, uint32_t queue)
+{
+    if (__builtin_expect(dev >= METRICS_MAX_DEVS || queue >= METRICS_MAX_QUEUES, 0))
+        return metrics_discard.devs[0].queues[0];
+    return metrics_slot()->devs[dev].queues[queue];
+}
+
+static inline void metrics_queue_add(uint32_t dev, uint32_t queue, int counter, uint64_t n)
+{
+    metrics_inc(&metrics_queue(dev, queue)[counter], n);
+}
+
+static inline void metrics_mmio_add(uint32_t dev)
+{
+    if (dev < METRICS_MAX_DEVS)
+        metrics_inc(&metrics_slot()->devs[dev].mmio, 1);
+}
+
+static inline void metrics_global_add(int counter, uint64_t n)
+{
+    metrics_inc(&metrics_slot()->global[counter], n);
+}
+
+#endif /* _HVISOR_METRICS_H */
@@ -0,0 +1,29 @@
+#ifndef _HVISOR_PLATFORM_H
+#define _HVISOR_PLATFORM_H
+#include <stddef.h>
+#include <stdint.h>
+#include "hvisor.h"
+
+// The calls the daemon makes into hvisor. On a real machine they go through the
+// hvisor kernel module, the simulator in sim/ provides its own.
+struct hvisor_platform {
+    const char *name;
+    /// Open a handle on hvisor, it becomes readable as a struct hvisor_wakeup
+    /// when hvisor raises an irq to the daemon.
+    int (*open)(void);
+    /// Allocate the virtio bridge of the geometry in init, its size is written back to init->size.
+    int (*init_virtio)(int fd, struct hvisor_virtio_init *init);
+    /// Map the bridge at offset 0, or zones' memory at its physical address.
+    /// addr is fixed unless it is NULL. \return MAP_FAILED on failure.
+    void *(*map)(int fd, void *addr, size_t len, uint64_t offset);
+    /// Ask hvisor to inject the irqs queued in the res list.
+    int (*finish_req)(int fd);
+    /// Make fd readable only for irqs raised while one of the rings has requests.
+    int (*set_wakeup_rings)(int fd, const struct hvisor_wakeup_rings *rings);
+};
+
+extern const struct hvisor_platform hvisor_ko_platform;
+/// The platform used by the daemon, hvisor_ko_platform by default.
+extern const struct hvisor_platform *hvisor_platform;
+
+#endif /* _HVISOR_PLATFORM_H */
@@ -0,0 +1,18 @@
+#ifndef _HVISOR_THREAD_CONF_H
+#define _HVISOR_THREAD_CONF_H
+
+// Threads of the daemon that can be pinned and scheduled separately.
+typedef enum {
+    ThreadDispatcher,   // handle the request rings of the virtio bridge
+    ThreadEvent,        // event monitor, net/console rx and irq timers
+    ThreadBlk,          // blk workers doing the disk io
+    ThreadNotify,       // per-device queue notify workers
+    ThreadClassNum
+} ThreadClass;
+
+int thread_conf_parse_affinity(char *arg);
+int thread_conf_parse_sched(char *arg);
+int thread_conf_mlock(void);
+void thread_conf_apply(ThreadClass cls);
+
+#endif /* _HVISOR_THREAD_CONF_H */
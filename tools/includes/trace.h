@@ -0,0 +1,76 @@
+#ifndef _HVISOR_TRACE_H
+#define _HVISOR_TRACE_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "metrics.h"
+
+// Binary trace of the virtio data path. Every daemon thread appends fixed-size
+// records to its own ring, overwriting the oldest ones, without locks or
+// syscalls. While tracing is off a trace point costs a load and a branch.
+// SIGUSR2 starts a new trace or stops it and writes it to the trace file,
+// `hvisor trace` decodes the file.
+
+#define TRACE_MAGIC 0x6876747261636531ULL
+#define TRACE_VERSION 1
+// records kept per thread, a power of 2
+#define TRACE_RECORDS (1 << 16)
+// dev of the events that aren't about a device
+#define TRACE_NO_DEV 0xffff
+
+// The meaning of idx, len and arg depends on the event.
+enum {
+    TRACE_POP = 1,      // idx: chain head or buffer id, len: bytes to read, arg: descriptors
+    TRACE_PUSH,         // idx: chain head or buffer id, len: bytes written
+    TRACE_NOTIFY,       // queue notify written by the driver
+    TRACE_IRQ,          // irq queued for injection
+    TRACE_FLUSH,        // hypercall injecting the queued irqs, len: irqs
+    TRACE_MMIO_READ,    // idx: register offset, len: value, arg: vcpu
+    TRACE_MMIO_WRITE,   // idx: register offset, len: value, arg: vcpu
+    TRACE_EVENTS
+};
+
+struct trace_rec {
+    uint64_t ts;        // lat_ticks()
+    uint16_t event;
+    uint16_t dev;       // metrics id of the device
+    uint16_t queue;
+    uint16_t idx;
+    uint32_t len;
+    uint32_t arg;
+};
+
+// The file is this header, then for each thread a trace_thread_hdr and its records, oldest first.
+struct trace_file_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t rec_size;
+    uint64_t ns_mult;   // ns = ts * ns_mult >> 32
+    uint32_t threads;
+    uint32_t devs_num;
+    struct metrics_dev_info devs[METRICS_MAX_DEVS];
+};
+
+struct trace_thread_hdr {
+    uint32_t tid;
+    uint32_t records;
+    uint64_t lost;      // records overwritten before the dump
+};
+
+extern bool trace_on;
+
+void trace_record(uint16_t event, uint32_t dev, uint32_t queue, uint32_t idx, uint32_t len, uint32_t arg);
+void trace_start(void);
+int trace_stop(const char *path);
+
+static inline bool trace_enabled(void)
+{
+    return __builtin_expect(__atomic_load_n(&trace_on, __ATOMIC_RELAXED), 0);
+}
+
+static inline void trace_event(uint16_t event, uint32_t dev, uint32_t queue, uint32_t idx, uint32_t len, uint32_t arg)
+{
+    if (trace_enabled())
+        trace_record(event, dev, queue, idx, len, arg);
+}
+
+#endif /* _HVISOR_TRACE_H */
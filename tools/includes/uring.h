@@ -0,0 +1,47 @@
+#ifndef _HVISOR_URING_H
+#define _HVISOR_URING_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring on the raw syscalls, there is no liburing on the targets.
+// One thread fills the submission queue and one thread reaps the completion
+// queue, callers serialize the rest.
+
+struct uring {
+    int fd;
+    // submission queue, sqe_tail counts the sqes got but not submitted yet
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries, sqe_tail;
+    struct io_uring_sqe *sqes;
+    // completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring);
+int uring_wait(struct uring *ring);
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned n);
+
+/// The oldest completion not seen yet, NULL if there is none.
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/// Give the completion returned by uring_peek_cqe back to the kernel.
+static inline void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* _HVISOR_URING_H */
@@ -2,6 +2,7 @@
 #define __HVISOR_VIRTIO_H
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <sys/uio.h>
 #include <linux/virtio_ring.h>
 #include <linux/virtio_mmio.h>
@@ -37,6 +38,14 @@ typedef struct vring_desc VirtqDesc;
 typedef struct vring_avail VirtqAvail;
 typedef struct vring_used_elem VirtqUsedElem;
 typedef struct vring_used VirtqUsed;
+typedef struct vring_packed_desc VirtqPackedDesc;
+typedef struct vring_packed_desc_event VirtqPackedEvent;
+
+// Interrupt coalescing of a queue: inject after count completions or usec microseconds.
+struct irq_coalesce {
+    uint32_t count;     // 0 waits for the timer only, 1 doesn't coalesce
+    uint32_t usec;      // 0 disables the timer
+};
 
 struct VirtIODevice;
 typedef struct VirtIODevice VirtIODevice;
@@ -53,23 +62,52 @@ struct VirtQueue {
     uint64_t avail_addr;
     uint64_t used_addr;
 
-    volatile VirtqDesc *desc_table;
-    volatile VirtqAvail *avail_ring;
-    volatile VirtqUsed *used_ring;
+    // A packed queue uses the same three areas for its descriptor ring
+    // and the driver and device event suppression structures.
+    union {
+        volatile VirtqDesc *desc_table;
+        volatile VirtqPackedDesc *desc_packed;
+    };
+    union {
+        volatile VirtqAvail *avail_ring;
+        volatile VirtqPackedEvent *driver_event;
+    };
+    union {
+        volatile VirtqUsed *used_ring;
+        volatile VirtqPackedEvent *device_event;
+    };
     int (*notify_handler)(VirtIODevice *vdev, VirtQueue *vq);
 
+    // Indexes are free running. For a packed queue, the position in the ring
+    // is idx & (num - 1) and the wrap counter is flipped every num descriptors.
     uint16_t last_avail_idx;
-    uint16_t last_used_idx;
+    uint16_t last_used_idx; // used idx when the last irq was checked
+    uint16_t next_used_idx; // packed only, the split one is used_ring->idx
     uint16_t used_flags;
 
     uint8_t ready;
 	uint8_t event_idx_enabled;
+    uint8_t packed;
 	pthread_mutex_t used_ring_lock;
+    // iovs and flags of in-flight chains, iov_slot_len entries per head descriptor
+    struct iovec *iov_arena;
+    uint16_t *flags_arena;
+    uint32_t iov_slot_len;
+    // packed only, the number of ring descriptors used by each buffer id, then
+    // by the stand-in ids of chains with an invalid one
+    uint16_t *packed_desc_num;
+    uint16_t packed_bad_ids;    // stand-in ids given so far
+
+    // irq coalescing, last_used_idx is protected by irq_lock
+    struct irq_coalesce coalesce;
+    int irq_timer_fd;
+    bool irq_timer_armed;
+    pthread_mutex_t irq_lock;
 };
 // The highest representations of virtio device
 struct VirtIODevice
 {
-    uint32_t id;
+    uint32_t id;        // of the metrics of the device
     uint32_t vqs_len;
     uint32_t zone_id;
     uint32_t irq_id;
@@ -81,17 +119,28 @@ struct VirtIODevice
     void *dev;          // according to device type, blk is BlkDev, net is NetDev, console is ConsoleDev
     void (*virtio_close)(VirtIODevice *vdev);
     bool activated;
+    // serializes mmio accesses coming from different dispatcher threads
+    pthread_mutex_t mtx;
+    // Queue notifies are handled by a worker thread, so that config accesses
+    // are answered while the data path is busy. One doorbell bit per queue.
+    uint32_t doorbell;
+    int notify_fd;
+    pthread_t notify_tid;
+    // held by the worker while it runs notify handlers, and by device reset
+    pthread_mutex_t notify_lock;
+    bool notify_stop;
 };
 // used event idx for driver telling device when to notify driver.
 #define VQ_USED_EVENT(vq) ((vq)->avail_ring->ring[(vq)->num])
 // avail event idx for device telling driver when to notify device.
-#define VQ_AVAIL_EVENT(vq) (*(__uint16_t *)&(vq)->used_ring->ring[(vq)->num])
+#define VQ_AVAIL_EVENT(vq) (*(volatile __uint16_t *)&(vq)->used_ring->ring[(vq)->num])
 
 #define VIRT_MAGIC 0x74726976 /* 'virt' */
 #define VIRT_VERSION 2
 #define VIRT_VENDOR 0x48564953 /* 'HVIS' */
 
-void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type);
+int init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type);
+void free_virtio_queues(VirtIODevice *vdev);
 
 void init_mmio_regs(VirtMmioRegs *regs, VirtioDeviceType type);
 
@@ -108,13 +157,46 @@ void virtqueue_disable_notify(VirtQueue *vq);
 void virtqueue_enable_notify(VirtQueue *vq);
 
 bool desc_is_writable(volatile VirtqDesc *desc_table, uint16_t idx);
-void* get_virt_addr(void *addr);
-void* get_phys_addr(void *addr);
+// A chain popped by virtqueue_pop_batch.
+typedef struct VirtqElem {
+    struct iovec *iov;
+    uint16_t *flags;
+    int n;          // number of iovs, or a negative errno if the chain is malformed
+    uint16_t idx;   // head descriptor, or buffer id of a packed queue
+} VirtqElem;
+
+// Pop, push and unpop work with both split and packed queues.
 int process_descriptor_chain(VirtQueue *vq, uint16_t *desc_idx,
                 struct iovec **iov, uint16_t **flags, int append_len);
+int virtqueue_pop_batch(VirtQueue *vq, VirtqElem *elems, int max, bool want_flags, int append_len);
 void update_used_ring(VirtQueue *vq, uint16_t idx, uint32_t iolen);
+void update_used_ring_batch(VirtQueue *vq, const VirtqUsedElem *elems, int num);
+void virtqueue_unpop(VirtQueue *vq, uint16_t idx);
 void virtio_inject_irq(VirtQueue *vq);
-void handle_virtio_requests();
+int virtqueue_set_coalesce(VirtQueue *vq, struct irq_coalesce *coalesce);
+void virtio_flush_irqs(void);
+
+// Policies of a dispatcher thread when its request rings are empty.
+typedef enum {
+    PollAlways,     // never park, keep spinning on the request rings
+    PollAdaptive,   // spin for an adaptive budget, wait in low power, then park
+    PollIrq         // park as soon as the request rings are empty
+} PollPolicy;
+
+// Time spent by a dispatcher thread in each state, in nanoseconds.
+struct poll_stats {
+    uint64_t spin_ns;
+    uint64_t wait_ns;   // low-power wait (wfe/pause) before parking
+    uint64_t sleep_ns;  // parked, waiting for hvisor to wake us up
+    uint64_t handle_ns;
+    uint64_t wakeups;
+    uint64_t reqs;
+    // latency from hvisor's irq to the daemon waking up
+    uint64_t wakeup_lat_ns;
+    uint64_t wakeup_lat_max_ns;
+};
+
+int handle_virtio_requests();
 int virtio_init();
 int virtio_start(int argc, char *argv[]);
 
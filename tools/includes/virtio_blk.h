@@ -5,19 +5,42 @@
 #include <sys/queue.h>
 #include <linux/virtio_blk.h>
 #include "virtio.h"
+#include "uring.h"
 
 /// Maximum number of segments in a request.
 #define BLK_SEG_MAX 512
 #define VIRTQUEUE_BLK_MAX_SIZE 512
 // A blk sector size
 #define SECTOR_BSIZE 512
+// Maximum number of requests popped or completed at once.
+#define BLK_BATCH 64
 
-// VIRTIO_RING_F_INDIRECT_DESC and VIRTIO_RING_F_EVENT_IDX are also supported, for some reason we disable them for now.
-#define BLK_SUPPORTED_FEATURES ( (1ULL << VIRTIO_BLK_F_SEG_MAX) | (1ULL << VIRTIO_BLK_F_SIZE_MAX) | (1ULL << VIRTIO_F_VERSION_1))
+#define BLK_SUPPORTED_FEATURES ( (1ULL << VIRTIO_BLK_F_SEG_MAX) | (1ULL << VIRTIO_BLK_F_SIZE_MAX) | (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_F_RING_PACKED) | \
+                                 (1ULL << VIRTIO_RING_F_INDIRECT_DESC) | (1ULL << VIRTIO_RING_F_EVENT_IDX) | (1ULL << VIRTIO_BLK_F_FLUSH))
 
 typedef struct virtio_blk_config BlkConfig;
 typedef struct virtio_blk_outhdr BlkReqHead;
 
+// How a blk device does its disk io, engine= of --device.
+enum blk_engine {
+    BlkEngineThread,    // a worker thread doing one blocking preadv or pwritev at a time
+    BlkEngineIoUring,   // the notify handler submits the requests to an io_uring at once
+};
+
+// How the image uses the page cache of the root zone, cache= of --device.
+enum blk_cache {
+    BlkCacheWriteback,      // through the page cache
+    BlkCacheWritethrough,   // through the page cache, written with O_DSYNC
+    BlkCacheNone,           // O_DIRECT, past the page cache
+};
+
+// The options of a blk device.
+struct blk_conf {
+    const char *img;
+    enum blk_engine engine;
+    enum blk_cache cache;
+};
+
 // A request needed to process by blk thread.
 struct blkp_req {
 	TAILQ_ENTRY(blkp_req) link;
@@ -26,6 +49,14 @@ struct blkp_req {
 	uint64_t offset;
 	uint32_t type;
 	uint16_t idx;
+	// cache=none: the iovs given to the kernel when some segments are bounced,
+	// and the bounce buffer they point into. Both are kept for the next request of the head.
+	struct iovec *dio_iov;
+	int dio_iovcnt;
+	char *bounce;
+	size_t bounce_size;
+	// io_uring engine: given to the ring and not completed yet, protected by mtx
+	bool in_uring;
 };
 
 typedef struct virtio_blk_dev {
@@ -37,10 +68,30 @@ typedef struct virtio_blk_dev {
 	pthread_cond_t cond;
 	TAILQ_HEAD(, blkp_req) procq;
 	int close;
+	// request objects, indexed by the head descriptor of their chain
+	struct blkp_req *reqs;
+	enum blk_engine engine;
+	enum blk_cache cache;
+	// cache=none: the alignment O_DIRECT needs for memory, and for file offsets and
+	// lengths, and the image opened without O_DIRECT for the requests at unaligned offsets.
+	uint32_t dio_mem_align;
+	uint32_t dio_align;
+	int buffered_fd;
+	// the kernel can't do direct I/O into guest memory, every data segment is bounced
+	bool dio_bounce_all;
+	// io_uring engine: the thread of tid reaps the completions of ring
+	struct uring ring;
+	// requests given to ring and not completed yet
+	unsigned int inflight;
+	// waiting for completions failed, the requests complete with an error without ring
+	bool uring_failed;
+	// the guest memory registered as fixed buffers, in order
+	struct iovec *bufs;
+	int bufs_num;
 } BlkDev;
 
 BlkDev *init_blk_dev(VirtIODevice *vdev);
-int virtio_blk_init(VirtIODevice *vdev, const char *img_path);
+int virtio_blk_init(VirtIODevice *vdev, const struct blk_conf *conf);
 int virtio_blk_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
 void virtio_blk_close(VirtIODevice *vdev);
 
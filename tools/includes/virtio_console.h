@@ -4,9 +4,13 @@
 #include "event_monitor.h"
 #include "virtio.h"
 
-#define CONSOLE_SUPPORTED_FEATURES ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_CONSOLE_F_SIZE))
+#define CONSOLE_SUPPORTED_FEATURES ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_CONSOLE_F_SIZE) | (1ULL << VIRTIO_F_RING_PACKED))
 #define CONSOLE_MAX_QUEUES 2
 #define VIRTQUEUE_CONSOLE_MAX_SIZE 64
+// Maximum number of descriptors in a chain.
+#define CONSOLE_SEG_MAX 16
+// Maximum number of chains popped or completed at once.
+#define CONSOLE_BATCH 16
 #define CONSOLE_QUEUE_RX 0
 #define CONSOLE_QUEUE_TX 1
 
@@ -12,8 +12,12 @@
 #define NET_MAX_QUEUES  2
 
 #define VIRTQUEUE_NET_MAX_SIZE 256
-// VIRTIO_RING_F_INDIRECT_DESC and VIRTIO_RING_F_EVENT_IDX are supported, for some reason we cancel them.
-#define NET_SUPPORTED_FEATURES ( (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_NET_F_MAC) | (1ULL << VIRTIO_NET_F_STATUS) )
+// Maximum number of descriptors in a packet's chain, header included.
+#define NET_SEG_MAX 64
+// Maximum number of packets popped or completed at once.
+#define NET_BATCH 32
+#define NET_SUPPORTED_FEATURES ( (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_NET_F_MAC) | (1ULL << VIRTIO_NET_F_STATUS) | (1ULL << VIRTIO_F_RING_PACKED) | \
+                                 (1ULL << VIRTIO_RING_F_INDIRECT_DESC) | (1ULL << VIRTIO_RING_F_EVENT_IDX) )
 
 typedef struct virtio_net_config NetConfig;
 typedef struct virtio_net_hdr_v1 NetHdr;
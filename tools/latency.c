@@ -0,0 +1,262 @@
+#include "latency.h"
+#include "metrics.h"
+#include "virtio.h"
+#include "log.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Histograms of the registers of a device, allocated on the first exit.
+struct lat_reg {
+    struct lat_hist hists[LatKinds];
+};
+
+// Histograms of one thread, indexed by the metrics id of the device.
+struct lat_table {
+    struct lat_reg *regs[METRICS_MAX_DEVS][LAT_REGS];
+    struct lat_table *next;
+};
+
+static __thread struct lat_table *lat_table;
+static struct lat_table *lat_tables;
+static pthread_mutex_t lat_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t lat_mult;
+
+static const char *lat_kind_names[] = {"queue", "handle", "total"};
+
+static uint64_t lat_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/// Find the frequency of the counter, measured against CLOCK_MONOTONIC if it isn't readable.
+void lat_init(void)
+{
+    uint64_t t0, c0, t1, c1;
+#if defined(__aarch64__)
+    uint64_t freq;
+    asm volatile ("mrs %0, cntfrq_el0" : "=r"(freq));
+    if (freq) {
+        lat_mult = (1000000000ULL << 32) / freq;
+        return;
+    }
+#endif
+    t0 = lat_clock_ns();
+    c0 = lat_ticks();
+    usleep(10000);
+    t1 = lat_clock_ns();
+    c1 = lat_ticks();
+    if (c1 == c0) {
+        log_warn("no counter to time mmio exits");
+        return;
+    }
+    lat_mult = ((t1 - t0) << 32) / (c1 - c0);
+}
+
+static inline int lat_bucket(uint64_t ns)
+{
+    int msb, shift;
+    if (ns < LAT_SUB)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    if (msb >= LAT_MAX_BITS)
+        return LAT_BUCKETS - 1;
+    shift = msb - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB + ((ns >> shift) & (LAT_SUB - 1));
+}
+
+/// The lowest value of a bucket.
+static uint64_t lat_bucket_ns(int i)
+{
+    if (i < LAT_SUB)
+        return i;
+    return (uint64_t)(LAT_SUB + i % LAT_SUB) << (i / LAT_SUB - 1);
+}
+
+// Only the owner thread writes a histogram, lat_dump reads it concurrently.
+static inline void lat_hist_add(struct lat_hist *h, uint64_t ns)
+{
+    uint64_t *bucket = &h->buckets[lat_bucket(ns)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum_ns, h->sum_ns + ns, __ATOMIC_RELAXED);
+    if (ns > h->max_ns)
+        __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+static struct lat_table *lat_new_table(void)
+{
+    struct lat_table *table = calloc(1, sizeof(struct lat_table));
+    if (table == NULL)
+        return NULL;
+    pthread_mutex_lock(&lat_tables_lock);
+    table->next = lat_tables;
+    __atomic_store_n(&lat_tables, table, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lat_tables_lock);
+    return table;
+}
+
+/// Record an exit of register offset of device dev, its timestamps are in ticks.
+/// enqueue_ts is 0 if hvisor didn't provide it.
+void lat_record(uint32_t dev, uint64_t offset, uint64_t enqueue_ts, uint64_t start, uint64_t end)
+{
+    struct lat_table *table = lat_table;
+    struct lat_reg *reg;
+    uint32_t r = offset >= VIRTIO_MMIO_CONFIG ? LAT_REGS - 1 : offset / 4;
+
+    if (dev >= METRICS_MAX_DEVS || lat_mult == 0)
+        return;
+    if (table == NULL) {
+        table = lat_table = lat_new_table();
+        if (table == NULL)
+            return;
+    }
+    reg = table->regs[dev][r];
+    if (reg == NULL) {
+        reg = calloc(1, sizeof(struct lat_reg));
+        if (reg == NULL)
+            return;
+        __atomic_store_n(&table->regs[dev][r], reg, __ATOMIC_RELEASE);
+    }
+    lat_hist_add(&reg->hists[LatHandle], lat_ticks_to_ns(end - start));
+    // a timestamp from the future is from another counter
+    if (enqueue_ts != 0 && enqueue_ts <= start) {
+        lat_hist_add(&reg->hists[LatQueue], lat_ticks_to_ns(start - enqueue_ts));
+        lat_hist_add(&reg->hists[LatTotal], lat_ticks_to_ns(end - enqueue_ts));
+    }
+}
+
+/// The name of the register at offset of a virtio mmio device.
+const char *lat_reg_name(uint32_t offset)
+{
+    if (offset >= VIRTIO_MMIO_CONFIG)
+        return "CONFIG";
+    switch (offset) {
+    case VIRTIO_MMIO_MAGIC_VALUE: return "MAGIC_VALUE";
+    case VIRTIO_MMIO_VERSION: return "VERSION";
+    case VIRTIO_MMIO_DEVICE_ID: return "DEVICE_ID";
+    case VIRTIO_MMIO_VENDOR_ID: return "VENDOR_ID";
+    case VIRTIO_MMIO_DEVICE_FEATURES: return "DEVICE_FEATURES";
+    case VIRTIO_MMIO_DEVICE_FEATURES_SEL: return "DEVICE_FEATURES_SEL";
+    case VIRTIO_MMIO_DRIVER_FEATURES: return "DRIVER_FEATURES";
+    case VIRTIO_MMIO_DRIVER_FEATURES_SEL: return "DRIVER_FEATURES_SEL";
+    case VIRTIO_MMIO_QUEUE_SEL: return "QUEUE_SEL";
+    case VIRTIO_MMIO_QUEUE_NUM_MAX: return "QUEUE_NUM_MAX";
+    case VIRTIO_MMIO_QUEUE_NUM: return "QUEUE_NUM";
+    case VIRTIO_MMIO_QUEUE_READY: return "QUEUE_READY";
+    case VIRTIO_MMIO_QUEUE_NOTIFY: return "QUEUE_NOTIFY";
+    case VIRTIO_MMIO_INTERRUPT_STATUS: return "INTERRUPT_STATUS";
+    case VIRTIO_MMIO_INTERRUPT_ACK: return "INTERRUPT_ACK";
+    case VIRTIO_MMIO_STATUS: return "STATUS";
+    case VIRTIO_MMIO_QUEUE_DESC_LOW: return "QUEUE_DESC_LOW";
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH: return "QUEUE_DESC_HIGH";
+    case VIRTIO_MMIO_QUEUE_AVAIL_LOW: return "QUEUE_AVAIL_LOW";
+    case VIRTIO_MMIO_QUEUE_AVAIL_HIGH: return "QUEUE_AVAIL_HIGH";
+    case VIRTIO_MMIO_QUEUE_USED_LOW: return "QUEUE_USED_LOW";
+    case VIRTIO_MMIO_QUEUE_USED_HIGH: return "QUEUE_USED_HIGH";
+    case VIRTIO_MMIO_CONFIG_GENERATION: return "CONFIG_GENERATION";
+    default: return "UNKNOWN";
+    }
+}
+
+static uint64_t lat_percentile(const struct lat_hist *h, double p)
+{
+    uint64_t rank = h->count * p, seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return lat_bucket_ns(i);
+    }
+    return h->max_ns;
+}
+
+static void lat_dump_hist(FILE *fp, uint32_t dev, uint32_t r, int kind, const struct lat_hist *h)
+{
+    const struct metrics_dev_info *info = &metrics->devs[dev];
+    bool first = true;
+    fprintf(fp, "{\"zone\":%u,\"device\":%u,\"type\":%u,\"base_addr\":%" PRIu64 ",\"reg\":\"%s\","
+            "\"offset\":%u,\"kind\":\"%s\",\"count\":%" PRIu64 ",\"sum_ns\":%" PRIu64 ",\"avg_ns\":%" PRIu64 ","
+            "\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64 ","
+            "\"max_ns\":%" PRIu64 ",\"buckets\":[",
+            info->zone_id, dev, info->type, info->base_addr, lat_reg_name(r * 4), r * 4,
+            lat_kind_names[kind], h->count, h->sum_ns, h->sum_ns / h->count,
+            lat_percentile(h, 0.5), lat_percentile(h, 0.9), lat_percentile(h, 0.99),
+            lat_percentile(h, 0.999), h->max_ns);
+    // [lowest ns of the bucket, count] of the buckets in use
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        if (h->buckets[i] == 0)
+            continue;
+        fprintf(fp, "%s[%" PRIu64 ",%" PRIu64 "]", first ? "" : ",", lat_bucket_ns(i), h->buckets[i]);
+        first = false;
+    }
+    fprintf(fp, "]}\n");
+}
+
+/// Write the histograms of every thread merged, one json object per device, register and kind.
+/// The file is replaced at once, it can be read while a new dump is written.
+int lat_dump(const char *path)
+{
+    struct lat_table *table;
+    struct lat_reg *reg;
+    struct lat_hist *merged, *h;
+    char tmp[PATH_MAX];
+    uint32_t devs, dev, r;
+    int kind, i, found;
+    FILE *fp;
+
+    if (metrics == NULL)
+        return -1;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        log_error("can't write mmio latency to %s, errno is %d", tmp, errno);
+        return -1;
+    }
+    merged = malloc(sizeof(struct lat_hist));
+    if (merged == NULL) {
+        log_error("no memory to dump mmio latency");
+        fclose(fp);
+        unlink(tmp);
+        return -1;
+    }
+    devs = __atomic_load_n(&metrics->devs_num, __ATOMIC_ACQUIRE);
+    for (dev = 0; dev < devs; dev++) {
+        for (r = 0; r < LAT_REGS; r++) {
+            for (kind = 0; kind < LatKinds; kind++) {
+                memset(merged, 0, sizeof(*merged));
+                found = 0;
+                for (table = __atomic_load_n(&lat_tables, __ATOMIC_ACQUIRE); table != NULL; table = table->next) {
+                    reg = __atomic_load_n(&table->regs[dev][r], __ATOMIC_ACQUIRE);
+                    if (reg == NULL)
+                        continue;
+                    h = &reg->hists[kind];
+                    merged->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+                    merged->sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+                    if (h->max_ns > merged->max_ns)
+                        merged->max_ns = h->max_ns;
+                    for (i = 0; i < LAT_BUCKETS; i++)
+                        merged->buckets[i] += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+                    found = 1;
+                }
+                if (found && merged->count)
+                    lat_dump_hist(fp, dev, r, kind, merged);
+            }
+        }
+    }
+    free(merged);
+    if (fclose(fp) || rename(tmp, path)) {
+        log_error("can't write mmio latency to %s, errno is %d", path, errno);
+        unlink(tmp);
+        return -1;
+    }
+    log_warn("mmio exit latency written to %s", path);
+    return 0;
+}
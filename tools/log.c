@@ -21,9 +21,21 @@
  */
 
 #include "log.h"
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #define MAX_CALLBACKS 32
+// bytes of a queued message, longer ones are truncated
+#define LOG_MSG_SIZE 232
+// messages queued per thread, a thread drops its messages while its ring is full
+#define LOG_RING_SIZE 64
+// the writer thread looks at the rings at least this often
+#define LOG_WRITER_POLL_MS 100
 
 typedef struct
 {
@@ -36,11 +48,48 @@ static struct
 {
 	void *udata;
 	log_LockFn lock;
-	int level;
 	bool quiet;
 	Callback callbacks[MAX_CALLBACKS];
 } L;
 
+int log_min_level;
+
+// A message formatted by its thread, written by the writer thread.
+typedef struct
+{
+	uint64_t ts_ns;		// CLOCK_REALTIME_COARSE
+	const char *file;
+	int line;
+	short level;
+	short with_enter;
+	char msg[LOG_MSG_SIZE];
+} LogRecord;
+
+// The messages of one thread. Only the thread moves head, only the writer moves tail.
+typedef struct LogRing
+{
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+	uint64_t dropped_reported;
+	struct LogRing *next;
+	LogRecord recs[LOG_RING_SIZE];
+} LogRing;
+
+// The asynchronous mode, between multithread_log_init and mutithread_log_exit.
+static struct
+{
+	bool running;
+	bool stopping;
+	int sleeping;		// the writer waits on wake_fd
+	int wake_fd;
+	pthread_t writer;
+	LogRing *rings;
+	pthread_mutex_t rings_lock;
+} A = {.wake_fd = -1, .rings_lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread LogRing *thread_ring;
+
 static const char *level_strings[] = {
 	"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
 
@@ -115,7 +164,7 @@ void log_set_lock(log_LockFn fn, void *udata)
 
 void log_set_level(int level)
 {
-	L.level = level;
+	log_min_level = level;
 }
 
 void log_set_quiet(bool enable)
@@ -141,23 +190,214 @@ int log_add_fp(FILE *fp, int level)
 	return log_add_callback(file_callback, fp, level);
 }
 
+// localtime is only called when the second changes.
+static struct tm *log_time(time_t sec)
+{
+	static __thread time_t cached_sec = -1;
+	static __thread struct tm cached_tm;
+	if (sec != cached_sec)
+	{
+		localtime_r(&sec, &cached_tm);
+		cached_sec = sec;
+	}
+	return &cached_tm;
+}
+
 static void init_event(log_Event *ev, void *udata)
 {
 	if (!ev->time)
 	{
-		time_t t = time(NULL);
-		ev->time = localtime(&t);
+		ev->time = log_time(time(NULL));
 	}
 	ev->udata = udata;
 }
 
+static void call_stdout(log_Event *ev, int with_enter, const char *fmt, ...)
+{
+	ev->fmt = fmt;
+	va_start(ev->ap, fmt);
+	stdout_callback(ev, with_enter);
+	va_end(ev->ap);
+}
+
+static void call_callback(Callback *cb, log_Event *ev, const char *fmt, ...)
+{
+	ev->fmt = fmt;
+	va_start(ev->ap, fmt);
+	cb->fn(ev);
+	va_end(ev->ap);
+}
+
+// Write a queued message like log_log writes the others, in the writer thread.
+static void write_record(LogRecord *rec)
+{
+	log_Event ev = {
+		.file = rec->file,
+		.line = rec->line,
+		.level = rec->level,
+		.time = log_time(rec->ts_ns / 1000000000),
+	};
+
+	if (!L.quiet)
+	{
+		ev.udata = stderr;
+		call_stdout(&ev, rec->with_enter, "%s", rec->msg);
+	}
+	for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++)
+	{
+		Callback *cb = &L.callbacks[i];
+		if (rec->level >= cb->level)
+		{
+			ev.udata = cb->udata;
+			call_callback(cb, &ev, "%s", rec->msg);
+		}
+	}
+}
+
+static LogRing *new_ring(void)
+{
+	LogRing *ring = calloc(1, sizeof(LogRing));
+	if (!ring)
+		return NULL;
+	pthread_mutex_lock(&A.rings_lock);
+	ring->next = A.rings;
+	__atomic_store_n(&A.rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&A.rings_lock);
+	return ring;
+}
+
+static void wake_writer(void)
+{
+	uint64_t one = 1;
+	if (__atomic_exchange_n(&A.sleeping, 0, __ATOMIC_ACQ_REL))
+		write(A.wake_fd, &one, sizeof(one));
+}
+
+// Queue a message without blocking. A message that doesn't fit is counted and dropped.
+// \return false if the thread has no ring and the message must be written now.
+static bool enqueue(int with_enter, int level, const char *file, int line, const char *fmt, va_list ap)
+{
+	LogRing *ring = thread_ring;
+	LogRecord *rec;
+	struct timespec ts;
+	uint32_t head;
+
+	if (!ring)
+	{
+		ring = thread_ring = new_ring();
+		if (!ring)
+			return false;
+	}
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+	{
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		wake_writer();
+		return true;
+	}
+	rec = &ring->recs[head % LOG_RING_SIZE];
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	rec->ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->file = file;
+	rec->line = line;
+	rec->level = level;
+	rec->with_enter = with_enter;
+	vsnprintf(rec->msg, LOG_MSG_SIZE, fmt, ap);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&A.sleeping, __ATOMIC_RELAXED))
+		wake_writer();
+	return true;
+}
+
+// Write the queued messages of every thread, oldest first.
+// \return the number of messages written.
+static int drain_rings(void)
+{
+	LogRing *ring, *oldest;
+	LogRecord *rec;
+	uint64_t dropped;
+	int n = 0;
+
+	lock();
+	for (;;)
+	{
+		oldest = NULL;
+		for (ring = __atomic_load_n(&A.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+		{
+			if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+				continue;
+			if (!oldest || ring->recs[ring->tail % LOG_RING_SIZE].ts_ns <
+					oldest->recs[oldest->tail % LOG_RING_SIZE].ts_ns)
+				oldest = ring;
+		}
+		if (!oldest)
+			break;
+		rec = &oldest->recs[oldest->tail % LOG_RING_SIZE];
+		write_record(rec);
+		__atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+		n++;
+	}
+	for (ring = __atomic_load_n(&A.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+	{
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->dropped_reported)
+		{
+			LogRecord note = {.file = __FILE__, .line = __LINE__, .level = LOG_WARN, .with_enter = 1};
+			note.ts_ns = time(NULL) * 1000000000ULL;
+			snprintf(note.msg, LOG_MSG_SIZE, "%lu log messages dropped, the writer can't keep up",
+					(unsigned long)(dropped - ring->dropped_reported));
+			write_record(&note);
+			ring->dropped_reported = dropped;
+		}
+	}
+	unlock();
+	return n;
+}
+
+static void *log_writer(void *arg)
+{
+	struct pollfd pfd = {.fd = A.wake_fd, .events = POLLIN};
+	uint64_t val;
+	(void)arg;
+
+	for (;;)
+	{
+		if (drain_rings())
+			continue;
+		if (__atomic_load_n(&A.stopping, __ATOMIC_ACQUIRE))
+			break;
+		// A thread seeing sleeping set wakes us up, the timeout catches the others.
+		__atomic_store_n(&A.sleeping, 1, __ATOMIC_SEQ_CST);
+		if (drain_rings() == 0)
+			poll(&pfd, 1, LOG_WRITER_POLL_MS);
+		if (pfd.revents & POLLIN)
+			read(A.wake_fd, &val, sizeof(val));
+		__atomic_store_n(&A.sleeping, 0, __ATOMIC_RELAXED);
+	}
+	drain_rings();
+	return NULL;
+}
+
 void log_log(int with_enter, int level, const char *file, int line, const char *fmt, ...)
 {
-	if (L.quiet || level < L.level)
+	va_list ap;
+	bool queued;
+
+	if (L.quiet || level < log_min_level)
 	{
 		return;
 	}
 
+	// fatal messages are written before the program goes down
+	if (level < LOG_FATAL && __atomic_load_n(&A.running, __ATOMIC_ACQUIRE))
+	{
+		va_start(ap, fmt);
+		queued = enqueue(with_enter, level, file, line, fmt, ap);
+		va_end(ap);
+		if (queued)
+			return;
+	}
+
 	log_Event ev = {
 		.fmt = fmt,
 		.file = file,
@@ -167,7 +407,7 @@ void log_log(int with_enter, int level, const char *file, int line, const char *
 
 	lock();
 
-	if (!L.quiet && level >= L.level)
+	if (!L.quiet && level >= log_min_level)
 	{
 		init_event(&ev, stderr);
 		va_start(ev.ap, fmt);
@@ -190,17 +430,65 @@ void log_log(int with_enter, int level, const char *file, int line, const char *
 	unlock();
 }
 
+/// Whether a message of a call site may be logged, see log_ratelimited.
+bool log_ratelimit(struct log_ratelimit *rl, int level, const char *file, int line)
+{
+	struct timespec ts;
+	unsigned long long now, start;
+	unsigned int suppressed;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	start = __atomic_load_n(&rl->start_ns, __ATOMIC_RELAXED);
+	if ((start == 0 || now - start >= LOG_RATELIMIT_NS) &&
+			__atomic_compare_exchange_n(&rl->start_ns, &start, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+		suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+		if (suppressed)
+			log_log(1, level, file, line, "%u similar messages suppressed", suppressed);
+	}
+	if (__atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED) < LOG_RATELIMIT_BURST)
+		return true;
+	__atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
 pthread_mutex_t MUTEX_LOG;
 void log_lock(bool lock, void *udata);
 
+/// Log from several threads. Messages under LOG_FATAL are queued and written by a thread.
 void multithread_log_init()
 {
 	pthread_mutex_init(&MUTEX_LOG, NULL);
 	log_set_lock(log_lock, &MUTEX_LOG);
+	A.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (A.wake_fd < 0)
+		return;
+	A.stopping = false;
+	if (pthread_create(&A.writer, NULL, log_writer, NULL))
+	{
+		close(A.wake_fd);
+		A.wake_fd = -1;
+		return;
+	}
+	__atomic_store_n(&A.running, true, __ATOMIC_RELEASE);
 }
 
+/// Write the queued messages, the next ones are written synchronously.
 void mutithread_log_exit()
 {
+	if (__atomic_load_n(&A.running, __ATOMIC_ACQUIRE))
+	{
+		__atomic_store_n(&A.running, false, __ATOMIC_RELEASE);
+		__atomic_store_n(&A.stopping, true, __ATOMIC_RELEASE);
+		__atomic_store_n(&A.sleeping, 1, __ATOMIC_RELAXED);
+		wake_writer();
+		pthread_join(A.writer, NULL);
+		close(A.wake_fd);
+		A.wake_fd = -1;
+	}
+	log_set_lock(NULL, NULL);
 	pthread_mutex_destroy(&MUTEX_LOG);
 }
 
@@ -0,0 +1,131 @@
+#include "metrics.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+struct metrics_shm *metrics;
+__thread struct metrics_slot *metrics_thread_slot;
+__thread bool metrics_thread_shared;
+static const char *metrics_name;
+// Counters of the threads running before metrics_init, or without it.
+struct metrics_slot metrics_discard;
+
+/// Create the segment, or anonymous memory if name is NULL or the segment can't be created.
+int metrics_init(const char *name)
+{
+    struct timespec ts;
+    int fd = -1;
+
+    if (name != NULL) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(struct metrics_shm))) {
+            log_warn("can't create metrics segment %s, errno is %d, hvisor stat won't see this daemon",
+                    name, errno);
+            if (fd >= 0) {
+                close(fd);
+                shm_unlink(name);
+            }
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        metrics = mmap(NULL, sizeof(struct metrics_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    else
+        metrics = mmap(NULL, sizeof(struct metrics_shm), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fd >= 0)
+        close(fd);
+    if (metrics == MAP_FAILED) {
+        log_error("can't map metrics, errno is %d", errno);
+        metrics = NULL;
+        if (fd >= 0)
+            shm_unlink(name);
+        return -1;
+    }
+    metrics_name = fd >= 0 ? name : NULL;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    metrics->version = METRICS_VERSION;
+    metrics->pid = getpid();
+    metrics->start_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    // the reader checks the magic before anything else
+    __atomic_store_n(&metrics->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void metrics_exit(void)
+{
+    if (metrics == NULL)
+        return;
+    if (metrics_name != NULL)
+        shm_unlink(metrics_name);
+    munmap(metrics, sizeof(struct metrics_shm));
+    metrics = NULL;
+}
+
+/// Publish a device, its counters are at the returned id.
+int metrics_add_dev(uint32_t zone_id, uint32_t type, uint64_t base_addr, uint32_t irq_id, uint32_t queues)
+{
+    struct metrics_dev_info *info;
+    uint32_t id;
+    if (metrics == NULL)
+        return -1;
+    id = metrics->devs_num;
+    if (id >= METRICS_MAX_DEVS) {
+        __atomic_fetch_add(&metrics->devs_uncounted, 1, __ATOMIC_RELAXED);
+        log_warn("no metrics for device %#lx of zone %d, only %d devices are counted",
+                base_addr, zone_id, METRICS_MAX_DEVS);
+        return -1;
+    }
+    info = &metrics->devs[id];
+    info->zone_id = zone_id;
+    info->type = type;
+    info->base_addr = base_addr;
+    info->irq_id = irq_id;
+    info->queues = queues < METRICS_MAX_QUEUES ? queues : METRICS_MAX_QUEUES;
+    __atomic_store_n(&metrics->devs_num, id + 1, __ATOMIC_RELEASE);
+    return id;
+}
+
+struct metrics_slot *metrics_claim_slot(void)
+{
+    uint32_t i;
+    if (metrics == NULL) {
+        // not cached, the thread claims a slot once metrics are up
+        metrics_thread_shared = true;
+        return &metrics_discard;
+    }
+    i = __atomic_fetch_add(&metrics->slots_used, 1, __ATOMIC_RELAXED);
+    if (i >= METRICS_SLOTS - 1) {
+        i = METRICS_SLOTS - 1;
+        metrics_thread_shared = true;
+    } else {
+        metrics_thread_shared = false;
+    }
+    metrics_thread_slot = &metrics->slots[i];
+    return metrics_thread_slot;
+}
+
+uint64_t metrics_sum_global(int counter)
+{
+    uint64_t sum = 0;
+    if (metrics == NULL)
+        return 0;
+    for (int i = 0; i < METRICS_SLOTS; i++)
+        sum += __atomic_load_n(&metrics->slots[i].global[counter], __ATOMIC_RELAXED);
+    return sum;
+}
+
+uint64_t metrics_sum_queue(uint32_t dev, uint32_t queue, int counter)
+{
+    uint64_t sum = 0;
+    if (metrics == NULL || dev >= METRICS_MAX_DEVS || queue >= METRICS_MAX_QUEUES)
+        return 0;
+    for (int i = 0; i < METRICS_SLOTS; i++)
+        sum += __atomic_load_n(&metrics->slots[i].devs[dev].queues[queue][counter], __ATOMIC_RELAXED);
+    return sum;
+}
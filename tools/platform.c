@@ -0,0 +1,41 @@
+#include "platform.h"
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+static int ko_open(void)
+{
+    return open("/dev/hvisor", O_RDWR);
+}
+
+static int ko_init_virtio(int fd, struct hvisor_virtio_init *init)
+{
+    return ioctl(fd, HVISOR_INIT_VIRTIO, init);
+}
+
+static void *ko_map(int fd, void *addr, size_t len, uint64_t offset)
+{
+    return mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED | (addr ? MAP_FIXED : 0),
+                fd, (off_t)offset);
+}
+
+static int ko_finish_req(int fd)
+{
+    return ioctl(fd, HVISOR_FINISH_REQ);
+}
+
+static int ko_set_wakeup_rings(int fd, const struct hvisor_wakeup_rings *rings)
+{
+    return ioctl(fd, HVISOR_SET_WAKEUP_RINGS, rings);
+}
+
+const struct hvisor_platform hvisor_ko_platform = {
+    .name = "hvisor",
+    .open = ko_open,
+    .init_virtio = ko_init_virtio,
+    .map = ko_map,
+    .finish_req = ko_finish_req,
+    .set_wakeup_rings = ko_set_wakeup_rings,
+};
+
+const struct hvisor_platform *hvisor_platform = &hvisor_ko_platform;
@@ -0,0 +1,108 @@
+#ifndef _HVISOR_SIM_H
+#define _HVISOR_SIM_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/virtio_ring.h>
+#include "platform.h"
+
+// The simulator runs the daemon against a simulated hvisor in the same process.
+// A guest virtio-mmio driver plays the non-root zone: its mmio accesses are queued
+// in the request rings of the bridge like hvisor does, and the irqs the daemon
+// queues in the res list are delivered to it through eventfds.
+
+#define SIM_ZONE_ID 1
+// guest memory, the ipa is identity mapped to the simulated physical address
+#define SIM_RAM_GPA NON_ROOT_PHYS_START
+#define SIM_RAM_SIZE (64UL << 20)
+// irq lines known to the simulated interrupt controller
+#define SIM_MAX_IRQS 8
+
+extern const struct hvisor_platform sim_platform;
+
+int sim_hv_init(void);
+void sim_hv_exit(void);
+volatile struct virtio_bridge *sim_hv_bridge(void);
+int sim_hv_register_irq(uint32_t irq_id);
+uint64_t sim_hv_mmio(int cpu, uint64_t base, uint64_t offset, uint64_t value, bool is_write);
+void *sim_hv_ram(void);
+
+// Hypervisor side counters.
+struct sim_hv_stats {
+    uint64_t reqs;          // mmio requests queued in the request rings
+    uint64_t wakeups;       // irqs raised to the daemon
+    uint64_t file_wakeups;  // files woken up by them
+    uint64_t finish_reqs;   // HVISOR_FINISH_REQ calls
+    uint64_t irqs;          // irqs injected to the guest
+};
+void sim_hv_get_stats(struct sim_hv_stats *st);
+
+// A split or packed virtqueue driven by the guest. The indexes of a packed queue
+// are free running descriptor counts, like in the daemon, the ring position is
+// idx & (num - 1) and the wrap counter flips every num descriptors.
+struct sim_vq {
+    struct sim_dev *dev;
+    int idx;
+    uint16_t num;
+    bool packed;
+    struct vring vring;
+    // packed only, the descriptor ring and the event suppression structures
+    struct vring_packed_desc *desc_packed;
+    struct vring_packed_desc_event *driver_event;
+    struct vring_packed_desc_event *device_event;
+    uint16_t *id_next;      // free list of buffer ids
+    uint16_t *id_ndesc;     // descriptors of each buffer id in flight
+    uint16_t bad_id;        // buffer id of the chain added with an invalid one, or num
+    uint64_t gpa;
+    uint16_t free_head;     // head descriptor, or buffer id of a packed queue
+    uint16_t num_free;
+    uint16_t avail_idx;     // next avail idx, published to the device at once
+    uint16_t kicked_idx;    // avail idx at the last notify check
+    uint16_t last_used;
+    bool cb_enabled;
+    void **cookies;         // per head descriptor or buffer id
+};
+
+// A virtio-mmio device as seen by the guest.
+struct sim_dev {
+    int cpu;                // vcpu issuing the mmio accesses of this device
+    uint64_t base;
+    uint32_t irq_id;
+    int irq_fd;
+    uint32_t device_id;
+    uint64_t features;      // negotiated
+    bool event_idx;
+    int vqs_num;
+    struct sim_vq vqs[2];
+    uint64_t kicks;
+    uint64_t irqs;
+};
+
+// One buffer of a chain, out is read by the device, in is written by it.
+struct sim_sg {
+    void *addr;
+    uint32_t len;
+};
+
+void sim_guest_mem_reset(void);
+void *sim_guest_alloc(uint64_t size, uint64_t align);
+uint64_t sim_guest_gpa(const void *addr);
+
+int sim_dev_init(struct sim_dev *dev, int cpu, uint64_t base, uint32_t irq_id);
+uint32_t sim_dev_read(struct sim_dev *dev, uint64_t offset);
+void sim_dev_write(struct sim_dev *dev, uint64_t offset, uint32_t value);
+int sim_dev_probe(struct sim_dev *dev, uint64_t features, int vqs_num, uint16_t queue_num);
+void sim_dev_reset(struct sim_dev *dev);
+int sim_dev_wait_irq(struct sim_dev *dev, int timeout_ms);
+uint64_t sim_dev_pending_irqs(struct sim_dev *dev);
+
+int sim_vq_add(struct sim_vq *vq, struct sim_sg *sg, int out, int in, void *cookie);
+int sim_vq_add_bad_id(struct sim_vq *vq, struct sim_sg *sg, int out, int in, void *cookie);
+bool sim_vq_kick(struct sim_vq *vq);
+void *sim_vq_get_used(struct sim_vq *vq, uint32_t *len);
+bool sim_vq_enable_cb(struct sim_vq *vq);
+void sim_vq_disable_cb(struct sim_vq *vq);
+void sim_vq_set_used_event(struct sim_vq *vq, uint16_t idx);
+
+uint64_t sim_now_ns(void);
+
+#endif /* _HVISOR_SIM_H */
@@ -0,0 +1,506 @@
+#include "sim.h"
+#include "log.h"
+#include <errno.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_mmio.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The guest driver of the simulator, it drives virtio-mmio devices with split or
+// packed rings the way the Linux virtio-mmio and virtio-ring drivers do.
+
+static uint64_t guest_brk;
+
+static inline void guest_mb(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void guest_wmb(void)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void guest_rmb(void)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+/// Forget every allocation, the devices using them must have been reset.
+void sim_guest_mem_reset(void)
+{
+    guest_brk = 0;
+}
+
+void *sim_guest_alloc(uint64_t size, uint64_t align)
+{
+    uint64_t start = (guest_brk + align - 1) & ~(align - 1);
+    if (start + size > SIM_RAM_SIZE) {
+        log_error("sim: out of guest memory");
+        return NULL;
+    }
+    guest_brk = start + size;
+    memset((char *)sim_hv_ram() + start, 0, size);
+    return (char *)sim_hv_ram() + start;
+}
+
+uint64_t sim_guest_gpa(const void *addr)
+{
+    return SIM_RAM_GPA + ((const char *)addr - (const char *)sim_hv_ram());
+}
+
+uint32_t sim_dev_read(struct sim_dev *dev, uint64_t offset)
+{
+    return sim_hv_mmio(dev->cpu, dev->base, offset, 0, false);
+}
+
+void sim_dev_write(struct sim_dev *dev, uint64_t offset, uint32_t value)
+{
+    sim_hv_mmio(dev->cpu, dev->base, offset, value, true);
+}
+
+int sim_dev_init(struct sim_dev *dev, int cpu, uint64_t base, uint32_t irq_id)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->cpu = cpu;
+    dev->base = base;
+    dev->irq_id = irq_id;
+    dev->irq_fd = sim_hv_register_irq(irq_id);
+    return dev->irq_fd < 0 ? -1 : 0;
+}
+
+static void sim_vq_free(struct sim_vq *vq)
+{
+    free(vq->cookies);
+    free(vq->id_next);
+    free(vq->id_ndesc);
+    vq->cookies = NULL;
+    vq->id_next = vq->id_ndesc = NULL;
+}
+
+/// Lay out a packed queue: the descriptor ring, then the driver and device events.
+static int sim_vq_setup_packed(struct sim_vq *vq)
+{
+    uint64_t ring_size = vq->num * sizeof(struct vring_packed_desc);
+    char *ring = sim_guest_alloc(ring_size + 2 * sizeof(struct vring_packed_desc_event), 4096);
+    if (ring == NULL)
+        return -1;
+    vq->desc_packed = (struct vring_packed_desc *)ring;
+    vq->driver_event = (struct vring_packed_desc_event *)(ring + ring_size);
+    vq->device_event = vq->driver_event + 1;
+    vq->id_next = calloc(vq->num, sizeof(uint16_t));
+    vq->id_ndesc = calloc(vq->num, sizeof(uint16_t));
+    if (vq->id_next == NULL || vq->id_ndesc == NULL)
+        return -1;
+    for (uint16_t i = 0; i + 1 < vq->num; i++)
+        vq->id_next[i] = i + 1;
+    vq->bad_id = vq->num;
+    vq->gpa = sim_guest_gpa(ring);
+    return 0;
+}
+
+static int sim_vq_setup(struct sim_dev *dev, int idx, uint16_t num)
+{
+    struct sim_vq *vq = &dev->vqs[idx];
+    uint64_t desc, driver, device;
+    uint32_t num_max;
+    void *ring;
+
+    sim_dev_write(dev, VIRTIO_MMIO_QUEUE_SEL, idx);
+    num_max = sim_dev_read(dev, VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if (num_max == 0) {
+        log_error("sim: device %u has no queue %d", dev->device_id, idx);
+        return -1;
+    }
+    if (num > num_max)
+        num = num_max;
+    sim_vq_free(vq);
+    memset(vq, 0, sizeof(*vq));
+    vq->dev = dev;
+    vq->idx = idx;
+    vq->num = num;
+    vq->packed = dev->features & (1ULL << VIRTIO_F_RING_PACKED);
+    vq->cookies = calloc(num, sizeof(void *));
+    vq->num_free = num;
+    vq->cb_enabled = true;
+    if (vq->cookies == NULL)
+        return -1;
+    if (vq->packed) {
+        if (sim_vq_setup_packed(vq))
+            return -1;
+        desc = sim_guest_gpa(vq->desc_packed);
+        driver = sim_guest_gpa(vq->driver_event);
+        device = sim_guest_gpa(vq->device_event);
+    } else {
+        ring = sim_guest_alloc(vring_size(num, 4096), 4096);
+        if (ring == NULL)
+            return -1;
+        vq->gpa = sim_guest_gpa(ring);
+        vring_init(&vq->vring, num, ring, 4096);
+        for (uint16_t i = 0; i + 1 < num; i++)
+            vq->vring.desc[i].next = i + 1;
+        desc = sim_guest_gpa(vq->vring.desc);
+        driver = sim_guest_gpa(vq->vring.avail);
+        device = sim_guest_gpa(vq->vring.used);
+    }
+
+    sim_dev_write(dev, VIRTIO_MMIO_QUEUE_NUM, num);
+    sim_dev_write(dev, VIRTIO_MMIO_QUEUE_DESC_LOW, desc);
+    sim_dev_write(dev, VIRTIO_MMIO_QUEUE_DESC_HIGH, desc >> 32);
+    sim_dev_write(dev, VIRTIO_MMIO_QUEUE_AVAIL_LOW, driver);
+    sim_dev_write(dev, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, driver >> 32);
+    sim_dev_write(dev, VIRTIO_MMIO_QUEUE_USED_LOW, device);
+    sim_dev_write(dev, VIRTIO_MMIO_QUEUE_USED_HIGH, device >> 32);
+    sim_dev_write(dev, VIRTIO_MMIO_QUEUE_READY, 1);
+    if (sim_dev_read(dev, VIRTIO_MMIO_QUEUE_READY) != 1) {
+        log_error("sim: queue %d of device %u is not ready", idx, dev->device_id);
+        return -1;
+    }
+    return 0;
+}
+
+/// Initialize the device with the features it offers among features.
+/// \return 0, or -1 if the device refused.
+int sim_dev_probe(struct sim_dev *dev, uint64_t features, int vqs_num, uint16_t queue_num)
+{
+    uint32_t status;
+    uint64_t offered;
+
+    if (sim_dev_read(dev, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+            sim_dev_read(dev, VIRTIO_MMIO_VERSION) != 2) {
+        log_error("sim: no virtio-mmio device at %#lx", dev->base);
+        return -1;
+    }
+    dev->device_id = sim_dev_read(dev, VIRTIO_MMIO_DEVICE_ID);
+    sim_dev_write(dev, VIRTIO_MMIO_STATUS, 0);
+    status = VIRTIO_CONFIG_S_ACKNOWLEDGE;
+    sim_dev_write(dev, VIRTIO_MMIO_STATUS, status);
+    status |= VIRTIO_CONFIG_S_DRIVER;
+    sim_dev_write(dev, VIRTIO_MMIO_STATUS, status);
+
+    sim_dev_write(dev, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 1);
+    offered = (uint64_t)sim_dev_read(dev, VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+    sim_dev_write(dev, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 0);
+    offered |= sim_dev_read(dev, VIRTIO_MMIO_DEVICE_FEATURES);
+    dev->features = offered & features;
+    dev->event_idx = dev->features & (1ULL << VIRTIO_RING_F_EVENT_IDX);
+    sim_dev_write(dev, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
+    sim_dev_write(dev, VIRTIO_MMIO_DRIVER_FEATURES, dev->features >> 32);
+    sim_dev_write(dev, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+    sim_dev_write(dev, VIRTIO_MMIO_DRIVER_FEATURES, (uint32_t)dev->features);
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    sim_dev_write(dev, VIRTIO_MMIO_STATUS, status);
+    if (!(sim_dev_read(dev, VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+        log_error("sim: device %u refused features %#lx", dev->device_id, dev->features);
+        return -1;
+    }
+
+    dev->vqs_num = vqs_num;
+    for (int i = 0; i < vqs_num; i++) {
+        if (sim_vq_setup(dev, i, queue_num))
+            return -1;
+    }
+    status |= VIRTIO_CONFIG_S_DRIVER_OK;
+    sim_dev_write(dev, VIRTIO_MMIO_STATUS, status);
+    dev->kicks = dev->irqs = 0;
+    return 0;
+}
+
+void sim_dev_reset(struct sim_dev *dev)
+{
+    uint64_t count;
+    sim_dev_write(dev, VIRTIO_MMIO_STATUS, 0);
+    // drop the irqs raised before the reset
+    while (read(dev->irq_fd, &count, sizeof(count)) == sizeof(count))
+        ;
+    for (int i = 0; i < dev->vqs_num; i++)
+        sim_vq_free(&dev->vqs[i]);
+}
+
+/// \return the irqs injected to dev and not handled yet, without handling them.
+uint64_t sim_dev_pending_irqs(struct sim_dev *dev)
+{
+    uint64_t count;
+    if (read(dev->irq_fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    // put them back
+    if (write(dev->irq_fd, &count, sizeof(count)) != sizeof(count))
+        log_error("sim: eventfd write failed, errno is %d", errno);
+    return count;
+}
+
+/// Wait for an irq of dev and acknowledge it like the virtio-mmio irq handler.
+/// \return 0, or -1 on timeout.
+int sim_dev_wait_irq(struct sim_dev *dev, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = dev->irq_fd, .events = POLLIN };
+    uint64_t count;
+    uint32_t status;
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0 || read(dev->irq_fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    dev->irqs += count;
+    status = sim_dev_read(dev, VIRTIO_MMIO_INTERRUPT_STATUS);
+    if (status)
+        sim_dev_write(dev, VIRTIO_MMIO_INTERRUPT_ACK, status);
+    return 0;
+}
+
+// The wrap counter of a free running packed index.
+static inline bool packed_wrap(struct sim_vq *vq, uint16_t idx)
+{
+    return (idx & vq->num) == 0;
+}
+
+/// Whether the device has used the packed descriptor at idx.
+static bool packed_is_used(struct sim_vq *vq, uint16_t idx)
+{
+    uint16_t flags = __atomic_load_n(&vq->desc_packed[idx & (vq->num - 1)].flags, __ATOMIC_RELAXED);
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+    return avail == used && used == packed_wrap(vq, idx);
+}
+
+/// Turn the ring offset and wrap counter of a packed event into the free running idx closest to idx.
+static uint16_t packed_event_idx(struct sim_vq *vq, uint16_t off_wrap, uint16_t idx)
+{
+    uint16_t lap = 2 * vq->num, event_idx;
+    int16_t dist;
+    event_idx = (idx & ~(lap - 1)) | (off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR));
+    if (!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR))
+        event_idx += vq->num;
+    dist = (int16_t)(event_idx - idx);
+    if (dist > (int16_t)vq->num)
+        event_idx -= lap;
+    else if (dist < -(int16_t)vq->num)
+        event_idx += lap;
+    return event_idx;
+}
+
+/// Write a chain under buffer id into the packed ring, the flags of its head last.
+static void packed_add(struct sim_vq *vq, struct sim_sg *sg, int out, int in, uint16_t id)
+{
+    struct vring_packed_desc *d;
+    uint16_t idx, flags, head_flags = 0;
+    int n = out + in;
+    for (int k = 0; k < n; k++) {
+        idx = vq->avail_idx + k;
+        d = &vq->desc_packed[idx & (vq->num - 1)];
+        d->addr = sim_guest_gpa(sg[k].addr);
+        d->len = sg[k].len;
+        d->id = id;
+        flags = (k >= out ? VRING_DESC_F_WRITE : 0) | (k + 1 < n ? VRING_DESC_F_NEXT : 0) |
+                (packed_wrap(vq, idx) ? 1 << VRING_PACKED_DESC_F_AVAIL : 1 << VRING_PACKED_DESC_F_USED);
+        if (k == 0)
+            head_flags = flags;
+        else
+            d->flags = flags;
+    }
+    // the chain must be visible before the device sees its head available
+    guest_wmb();
+    __atomic_store_n(&vq->desc_packed[vq->avail_idx & (vq->num - 1)].flags, head_flags, __ATOMIC_RELAXED);
+    vq->avail_idx += n;
+    vq->num_free -= n;
+}
+
+/// Take a buffer id off the free list of a packed queue for a chain of n descriptors.
+static uint16_t packed_get_id(struct sim_vq *vq, int n, void *cookie)
+{
+    uint16_t id = vq->free_head;
+    vq->free_head = vq->id_next[id];
+    vq->id_ndesc[id] = n;
+    vq->cookies[id] = cookie;
+    return id;
+}
+
+/// Add a chain of out device readable buffers followed by in writable ones.
+/// \return 0, or -1 if the ring has not enough free descriptors.
+int sim_vq_add(struct sim_vq *vq, struct sim_sg *sg, int out, int in, void *cookie)
+{
+    struct vring *vr = &vq->vring;
+    uint16_t head = vq->free_head, i = head;
+    int n = out + in;
+    if (n == 0 || vq->num_free < n)
+        return -1;
+    if (vq->packed) {
+        packed_add(vq, sg, out, in, packed_get_id(vq, n, cookie));
+        return 0;
+    }
+    for (int k = 0; k < n; k++) {
+        vr->desc[i].addr = sim_guest_gpa(sg[k].addr);
+        vr->desc[i].len = sg[k].len;
+        vr->desc[i].flags = (k >= out ? VRING_DESC_F_WRITE : 0) | (k + 1 < n ? VRING_DESC_F_NEXT : 0);
+        i = vr->desc[i].next;
+    }
+    vq->free_head = i;
+    vq->num_free -= n;
+    vq->cookies[head] = cookie;
+    vr->avail->ring[vq->avail_idx & (vq->num - 1)] = head;
+    vq->avail_idx++;
+    // the chain must be visible before the device sees it in avail idx
+    guest_wmb();
+    __atomic_store_n(&vr->avail->idx, vq->avail_idx, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/// Add a chain to a packed queue like sim_vq_add, but with a buffer id past the
+/// ring. The device must still use as many descriptors as the chain has.
+/// A split queue gets an avail entry with a head past the ring and no chain,
+/// the device never uses it, sg and cookie are ignored.
+/// \return 0, or -1 if the ring is full.
+int sim_vq_add_bad_id(struct sim_vq *vq, struct sim_sg *sg, int out, int in, void *cookie)
+{
+    int n = out + in;
+    if (!vq->packed) {
+        vq->vring.avail->ring[vq->avail_idx & (vq->num - 1)] = vq->num;
+        vq->avail_idx++;
+        guest_wmb();
+        __atomic_store_n(&vq->vring.avail->idx, vq->avail_idx, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (n == 0 || vq->num_free < n || vq->bad_id != vq->num)
+        return -1;
+    // the device only echoes the bad id, remember which chain it stands for
+    vq->bad_id = packed_get_id(vq, n, cookie);
+    packed_add(vq, sg, out, in, 0xffff);
+    return 0;
+}
+
+/// Whether the device wants a notify for the chains added between old and new.
+static bool packed_need_kick(struct sim_vq *vq, uint16_t new, uint16_t old)
+{
+    uint16_t flags = __atomic_load_n(&vq->device_event->flags, __ATOMIC_RELAXED);
+    uint16_t off_wrap = __atomic_load_n(&vq->device_event->off_wrap, __ATOMIC_RELAXED);
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC)
+        return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    return vring_need_event(packed_event_idx(vq, off_wrap, new), new, old);
+}
+
+/// Notify the device of the chains added since the last kick unless it suppressed notifications.
+/// \return true if the device was notified.
+bool sim_vq_kick(struct sim_vq *vq)
+{
+    uint16_t old = vq->kicked_idx, new = vq->avail_idx;
+    bool need;
+    // avail idx must be visible before the device's suppression is read
+    guest_mb();
+    vq->kicked_idx = new;
+    if (vq->packed)
+        need = packed_need_kick(vq, new, old);
+    else if (vq->dev->event_idx)
+        need = vring_need_event(*(volatile uint16_t *)&vring_avail_event(&vq->vring), new, old);
+    else
+        need = !(*(volatile uint16_t *)&vq->vring.used->flags & VRING_USED_F_NO_NOTIFY);
+    if (need && old != new) {
+        sim_dev_write(vq->dev, VIRTIO_MMIO_QUEUE_NOTIFY, vq->idx);
+        vq->dev->kicks++;
+    }
+    return need;
+}
+
+static void *packed_get_used(struct sim_vq *vq, uint32_t *len)
+{
+    struct vring_packed_desc *d;
+    uint16_t id;
+    void *cookie;
+    if (!packed_is_used(vq, vq->last_used))
+        return NULL;
+    guest_rmb();
+    d = &vq->desc_packed[vq->last_used & (vq->num - 1)];
+    id = d->id;
+    *len = d->len;
+    if (id >= vq->num && vq->bad_id != vq->num) {
+        id = vq->bad_id;
+        vq->bad_id = vq->num;
+    }
+    if (id >= vq->num || vq->cookies[id] == NULL) {
+        log_error("sim: device used bad id %u", d->id);
+        abort();
+    }
+    cookie = vq->cookies[id];
+    vq->cookies[id] = NULL;
+    // the other descriptors of the chain are skipped
+    vq->last_used += vq->id_ndesc[id];
+    vq->num_free += vq->id_ndesc[id];
+    vq->id_next[id] = vq->free_head;
+    vq->free_head = id;
+    return cookie;
+}
+
+/// Take a completed chain back, its used len in len.
+/// \return the cookie given to sim_vq_add, or NULL if nothing has completed.
+void *sim_vq_get_used(struct sim_vq *vq, uint32_t *len)
+{
+    struct vring *vr = &vq->vring;
+    struct vring_used_elem elem;
+    uint16_t i, n = 1;
+    void *cookie;
+    if (vq->packed)
+        return packed_get_used(vq, len);
+    if (__atomic_load_n(&vr->used->idx, __ATOMIC_RELAXED) == vq->last_used)
+        return NULL;
+    guest_rmb();
+    elem = vr->used->ring[vq->last_used & (vq->num - 1)];
+    vq->last_used++;
+    if (elem.id >= vq->num || vq->cookies[elem.id] == NULL) {
+        log_error("sim: device used bad id %u", elem.id);
+        abort();
+    }
+    cookie = vq->cookies[elem.id];
+    vq->cookies[elem.id] = NULL;
+    for (i = elem.id; vr->desc[i].flags & VRING_DESC_F_NEXT; i = vr->desc[i].next)
+        n++;
+    vr->desc[i].next = vq->free_head;
+    vq->free_head = elem.id;
+    vq->num_free += n;
+    *len = elem.len;
+    return cookie;
+}
+
+/// Ask for an irq when the next chain completes.
+/// \return false if a chain has completed meanwhile, it must be taken without waiting.
+bool sim_vq_enable_cb(struct sim_vq *vq)
+{
+    vq->cb_enabled = true;
+    if (vq->packed) {
+        if (vq->dev->event_idx) {
+            vq->driver_event->off_wrap = (vq->last_used & (vq->num - 1)) |
+                    packed_wrap(vq, vq->last_used) << VRING_PACKED_EVENT_F_WRAP_CTR;
+            guest_wmb();
+            vq->driver_event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+        } else {
+            vq->driver_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+        }
+        guest_mb();
+        return !packed_is_used(vq, vq->last_used);
+    }
+    if (vq->dev->event_idx)
+        vring_used_event(&vq->vring) = vq->last_used;
+    else
+        vq->vring.avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    guest_mb();
+    return __atomic_load_n(&vq->vring.used->idx, __ATOMIC_RELAXED) == vq->last_used;
+}
+
+/// Stop irqs of vq. With event idx the used event of a split queue is left behind
+/// and the device doesn't interrupt until the used idx wraps around to it.
+void sim_vq_disable_cb(struct sim_vq *vq)
+{
+    vq->cb_enabled = false;
+    if (vq->packed)
+        vq->driver_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    else if (!vq->dev->event_idx)
+        vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+/// Set the used event of a split vq, the device interrupts when the used idx moves past idx.
+void sim_vq_set_used_event(struct sim_vq *vq, uint16_t idx)
+{
+    vring_used_event(&vq->vring) = idx;
+    guest_mb();
+}
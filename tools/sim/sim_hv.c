@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include "sim.h"
+#include "log.h"
+#include "latency.h"
+#include <errno.h>
+#include <linux/virtio_mmio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_CACHE_BYTES 64
+#define SIM_PAGE_SIZE 4096UL
+#define SIM_ALIGN(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+// /dev/hvisor files opened by the daemon, one per dispatcher and one for the bridge
+#define SIM_MAX_FILES (MAX_CPUS + 1)
+// a vcpu waiting longer than this for a config request means the daemon is stuck
+#define SIM_CFG_TIMEOUT_NS (5ULL * 1000000000)
+
+// A /dev/hvisor file of the daemon, a pipe written on wakeups.
+struct sim_file {
+    int rfd;
+    int wfd;
+    bool has_rings;     // woken up only for requests in rings
+    struct hvisor_wakeup_rings rings;
+};
+
+struct sim_irq {
+    uint32_t irq_id;
+    int fd;             // eventfd of the guest's irq handler
+};
+
+static struct {
+    int bridge_fd;
+    uint64_t bridge_size;
+    volatile struct virtio_bridge *bridge;
+    int ram_fd;
+    void *ram;
+    // Lock of the res list, hvisor consumes it on behalf of any daemon thread.
+    pthread_mutex_t res_lock;
+    // files opened by the daemon, raised on wakeups like the kernel module does
+    pthread_mutex_t files_lock;
+    struct sim_file files[SIM_MAX_FILES];
+    int files_num;
+    struct sim_irq irqs[SIM_MAX_IRQS];
+    int irqs_num;
+    struct sim_hv_stats stats;
+} hv = {
+    .bridge_fd = -1,
+    .ram_fd = -1,
+    .res_lock = PTHREAD_MUTEX_INITIALIZER,
+    .files_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+uint64_t sim_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void sim_relax(void)
+{
+#if defined(__x86_64__)
+    asm volatile ("pause":: : "memory");
+#elif defined(__aarch64__)
+    asm volatile ("yield":: : "memory");
+#endif
+}
+
+/// The file is readable once an irq is raised to the daemon, like /dev/hvisor.
+static int sim_open(void)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK))
+        return -1;
+    pthread_mutex_lock(&hv.files_lock);
+    if (hv.files_num == SIM_MAX_FILES) {
+        pthread_mutex_unlock(&hv.files_lock);
+        close(fds[0]);
+        close(fds[1]);
+        errno = EMFILE;
+        return -1;
+    }
+    hv.files[hv.files_num++] = (struct sim_file) { .rfd = fds[0], .wfd = fds[1] };
+    pthread_mutex_unlock(&hv.files_lock);
+    return fds[0];
+}
+
+static int sim_set_wakeup_rings(int fd, const struct hvisor_wakeup_rings *rings)
+{
+    int i;
+    pthread_mutex_lock(&hv.files_lock);
+    for (i = 0; i < hv.files_num && hv.files[i].rfd != fd; i++)
+        ;
+    if (i < hv.files_num) {
+        hv.files[i].rings = *rings;
+        hv.files[i].has_rings = true;
+    }
+    pthread_mutex_unlock(&hv.files_lock);
+    if (i == hv.files_num) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+/// Lay out the bridge like the kernel module does.
+static int sim_init_virtio(int fd, struct hvisor_virtio_init *init)
+{
+    struct virtio_bridge hdr;
+    uint64_t size;
+    (void)fd;
+    if (hv.bridge != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (init->abi_version != HVISOR_VIRTIO_ABI_VERSION) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (init->req_size != sizeof(struct device_req)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = HVISOR_VIRTIO_MAGIC;
+    hdr.abi_version = HVISOR_VIRTIO_ABI_VERSION;
+    hdr.cpus = init->cpus;
+    hdr.req_depth = init->req_depth;
+    hdr.res_depth = init->res_depth;
+    hdr.max_devs = init->max_devs;
+    size = SIM_ALIGN(sizeof(struct virtio_bridge), SIM_CACHE_BYTES);
+    hdr.res_list_off = size;
+    size += SIM_ALIGN(init->res_depth * sizeof(struct device_res), SIM_CACHE_BYTES);
+    hdr.cfg_flags_off = size;
+    size += SIM_ALIGN(init->cpus * sizeof(__u64), SIM_CACHE_BYTES);
+    hdr.cfg_values_off = size;
+    size += SIM_ALIGN(init->cpus * sizeof(__u64), SIM_CACHE_BYTES);
+    hdr.mmio_addrs_off = size;
+    size += SIM_ALIGN(init->max_devs * sizeof(__u64), SIM_CACHE_BYTES);
+    hdr.req_ring_size = SIM_ALIGN(sizeof(struct device_req_ring) +
+                init->req_depth * sizeof(struct device_req), SIM_CACHE_BYTES);
+    hdr.req_size = sizeof(struct device_req);
+    hdr.req_rings_off = size;
+    size += (uint64_t)init->cpus * hdr.req_ring_size;
+    size = SIM_ALIGN(size, SIM_PAGE_SIZE);
+
+    hv.bridge_fd = memfd_create("hvisor-bridge", MFD_CLOEXEC);
+    if (hv.bridge_fd < 0)
+        return -1;
+    if (ftruncate(hv.bridge_fd, size))
+        goto err;
+    hv.bridge = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, hv.bridge_fd, 0);
+    if (hv.bridge == MAP_FAILED)
+        goto err;
+    memcpy((void *)hv.bridge, &hdr, sizeof(hdr));
+    hv.bridge_size = size;
+    init->size = size;
+    return 0;
+err:
+    hv.bridge = NULL;
+    close(hv.bridge_fd);
+    hv.bridge_fd = -1;
+    return -1;
+}
+
+static void *sim_map(int fd, void *addr, size_t len, uint64_t offset)
+{
+    int flags = MAP_SHARED | (addr ? MAP_FIXED : 0);
+    (void)fd;
+    if (offset == 0 && hv.bridge != NULL && len <= hv.bridge_size)
+        return mmap(addr, len, PROT_READ | PROT_WRITE, flags, hv.bridge_fd, 0);
+    if (offset >= SIM_RAM_GPA && len <= SIM_RAM_SIZE && offset - SIM_RAM_GPA <= SIM_RAM_SIZE - len)
+        return mmap(addr, len, PROT_READ | PROT_WRITE, flags, hv.ram_fd, offset - SIM_RAM_GPA);
+    errno = EINVAL;
+    return MAP_FAILED;
+}
+
+/// Inject every irq queued in the res list, like the HVISOR_FINISH_REQ hypercall.
+static int sim_finish_req(int fd)
+{
+    volatile struct device_res *res_list = bridge_res_list(hv.bridge);
+    uint32_t front, rear, mask = hv.bridge->res_depth - 1;
+    uint64_t one = 1;
+    int i;
+    (void)fd;
+    pthread_mutex_lock(&hv.res_lock);
+    hv.stats.finish_reqs++;
+    front = hv.bridge->res_front;
+    rear = __atomic_load_n(&hv.bridge->res_rear, __ATOMIC_ACQUIRE);
+    while (front != rear) {
+        for (i = 0; i < hv.irqs_num; i++) {
+            if (hv.irqs[i].irq_id == res_list[front].irq_id)
+                break;
+        }
+        if (i < hv.irqs_num && res_list[front].target_zone == SIM_ZONE_ID) {
+            hv.stats.irqs++;
+            if (write(hv.irqs[i].fd, &one, sizeof(one)) != sizeof(one))
+                log_error("sim: inject irq %u failed, errno is %d", hv.irqs[i].irq_id, errno);
+        } else {
+            log_error("sim: irq %u of zone %u is not registered",
+                    res_list[front].irq_id, res_list[front].target_zone);
+        }
+        front = (front + 1) & mask;
+    }
+    // the daemon claims slots of the res list against res_front
+    __atomic_store_n(&hv.bridge->res_front, front, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&hv.res_lock);
+    return 0;
+}
+
+const struct hvisor_platform sim_platform = {
+    .name = "hvisor simulator",
+    .open = sim_open,
+    .init_virtio = sim_init_virtio,
+    .map = sim_map,
+    .finish_req = sim_finish_req,
+    .set_wakeup_rings = sim_set_wakeup_rings,
+};
+
+int sim_hv_init(void)
+{
+    hv.ram_fd = memfd_create("hvisor-guest-ram", MFD_CLOEXEC);
+    if (hv.ram_fd < 0 || ftruncate(hv.ram_fd, SIM_RAM_SIZE))
+        return -1;
+    hv.ram = mmap(NULL, SIM_RAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, hv.ram_fd, 0);
+    if (hv.ram == MAP_FAILED)
+        return -1;
+    return 0;
+}
+
+void sim_hv_exit(void)
+{
+    for (int i = 0; i < hv.files_num; i++)
+        close(hv.files[i].wfd);
+    for (int i = 0; i < hv.irqs_num; i++)
+        close(hv.irqs[i].fd);
+    if (hv.bridge != NULL)
+        munmap((void *)hv.bridge, hv.bridge_size);
+    munmap(hv.ram, SIM_RAM_SIZE);
+    close(hv.bridge_fd);
+    close(hv.ram_fd);
+}
+
+volatile struct virtio_bridge *sim_hv_bridge(void)
+{
+    return hv.bridge;
+}
+
+void *sim_hv_ram(void)
+{
+    return hv.ram;
+}
+
+/// \return an eventfd counting the irqs injected to irq_id.
+int sim_hv_register_irq(uint32_t irq_id)
+{
+    int fd;
+    if (hv.irqs_num == SIM_MAX_IRQS)
+        return -1;
+    fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0)
+        return -1;
+    pthread_mutex_lock(&hv.res_lock);
+    hv.irqs[hv.irqs_num++] = (struct sim_irq) { .irq_id = irq_id, .fd = fd };
+    pthread_mutex_unlock(&hv.res_lock);
+    return fd;
+}
+
+// Whether a request ring of the file has requests, like the irq handler of the kernel module.
+static bool sim_file_has_reqs(struct sim_file *f)
+{
+    volatile struct device_req_ring *ring;
+    if (!f->has_rings)
+        return true;
+    for (uint32_t cpu = 0; cpu < hv.bridge->cpus; cpu++) {
+        if (!(f->rings.cpus[cpu / 64] & (1ULL << (cpu % 64))))
+            continue;
+        ring = bridge_req_ring(hv.bridge, cpu);
+        if (__atomic_load_n(&ring->front, __ATOMIC_ACQUIRE) != ring->rear)
+            return true;
+    }
+    return false;
+}
+
+// Raise an irq to the daemon, like the ipi hvisor sends to the root zone.
+static void sim_hv_wakeup(void)
+{
+    struct hvisor_wakeup wakeup = { .count = 1, .irq_ns = sim_now_ns() };
+    pthread_mutex_lock(&hv.files_lock);
+    hv.stats.wakeups++;
+    // a full pipe already wakes its reader up
+    for (int i = 0; i < hv.files_num; i++) {
+        if (!sim_file_has_reqs(&hv.files[i]))
+            continue;
+        hv.stats.file_wakeups++;
+        if (write(hv.files[i].wfd, &wakeup, sizeof(wakeup)) < 0 && errno != EAGAIN && errno != EPIPE)
+            log_error("sim: wakeup failed, errno is %d", errno);
+    }
+    pthread_mutex_unlock(&hv.files_lock);
+}
+
+/// Trap an mmio access of the guest vcpu cpu. Like hvisor, the vcpu waits for the
+/// daemon's answer except for queue notifies.
+uint64_t sim_hv_mmio(int cpu, uint64_t base, uint64_t offset, uint64_t value, bool is_write)
+{
+    volatile struct virtio_bridge *b = hv.bridge;
+    volatile struct device_req_ring *ring = bridge_req_ring(b, cpu);
+    volatile struct device_req *req;
+    volatile __u64 *cfg_flag = &bridge_cfg_flags(b)[cpu];
+    uint32_t rear, mask = b->req_depth - 1;
+    bool need_interrupt = is_write && offset == VIRTIO_MMIO_QUEUE_NOTIFY;
+    uint64_t old_flag = *cfg_flag, start;
+
+    rear = ring->rear;
+    while (((rear + 1) & mask) == __atomic_load_n(&ring->front, __ATOMIC_ACQUIRE))
+        sim_relax();
+    req = &ring->req_list[rear];
+    req->src_cpu = cpu;
+    req->address = base + offset;
+    req->size = 4;
+    req->value = value;
+    req->src_zone = SIM_ZONE_ID;
+    req->is_write = is_write;
+    req->need_interrupt = need_interrupt;
+    req->enqueue_ts = lat_ticks();
+    __atomic_store_n(&ring->rear, (rear + 1) & mask, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&hv.stats.reqs, 1, __ATOMIC_RELAXED);
+    // need_wakeup is read after the request is visible, the dispatcher does the opposite.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ring->need_wakeup)
+        sim_hv_wakeup();
+    if (need_interrupt)
+        return 0;
+
+    start = sim_now_ns();
+    for (unsigned int i = 1; *cfg_flag == old_flag; i++) {
+        sim_relax();
+        if (i % 4096 == 0 && sim_now_ns() - start > SIM_CFG_TIMEOUT_NS) {
+            log_error("sim: cpu %d waited too long for mmio %#lx", cpu, base + offset);
+            abort();
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return bridge_cfg_values(b)[cpu];
+}
+
+void sim_hv_get_stats(struct sim_hv_stats *st)
+{
+    pthread_mutex_lock(&hv.res_lock);
+    pthread_mutex_lock(&hv.files_lock);
+    *st = hv.stats;
+    st->reqs = __atomic_load_n(&hv.stats.reqs, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&hv.files_lock);
+    pthread_mutex_unlock(&hv.res_lock);
+}
@@ -0,0 +1,1051 @@
+#define _GNU_SOURCE
+#include "sim.h"
+#include "virtio.h"
+#include "virtio_blk.h"
+#include "virtio_console.h"
+#include "virtio_net.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Devices created in the daemon, each one is driven by its own guest vcpu.
+#define SIM_BLK_ADDR 0xa003e00
+#define SIM_NET_ADDR 0xa003c00
+#define SIM_CONSOLE_ADDR 0xa003a00
+#define SIM_MMIO_LEN 0x200
+#define SIM_BLK_IRQ 78
+#define SIM_NET_IRQ 79
+#define SIM_CONSOLE_IRQ 80
+#define SIM_IMG_SIZE (64UL << 20)
+// an irq not coming within this time is lost
+#define SIM_IRQ_TIMEOUT_MS 2000
+// latency samples kept per run
+#define SIM_LAT_SAMPLES (1 << 20)
+#define SIM_NET_BUF_SIZE 2048
+
+extern VirtIODevice **vdevs;
+extern int vdevs_num;
+
+static struct {
+    uint64_t duration_ns;
+    int depth;
+    uint32_t blk_size;
+    uint32_t net_size;
+    uint32_t console_size;
+    bool event_idx;
+    bool packed;
+    bool json;
+    char *workloads;
+    char *img;
+    char *blk_opts;
+} conf = {
+    .duration_ns = 2000000000ULL,
+    .depth = 32,
+    .blk_size = 4096,
+    .net_size = 1514,
+    .console_size = 256,
+    .event_idx = true,
+    .workloads = "blk-read,blk-write,blk-flush,net-tx,net-tx-config,net-rx,console-tx,event-idx,packed,bad-head",
+};
+
+static struct sim_dev blk_dev, net_dev, console_dev;
+static int net_peer_fd = -1, console_peer_fd = -1;
+static volatile int daemon_exited;
+static int checks_failed;
+
+struct sim_result {
+    const char *name;
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t ns;
+    uint64_t kicks;
+    uint64_t irqs;
+    uint64_t drops;
+    uint64_t errors;
+    uint64_t *lat;
+    uint64_t lat_num;
+    struct sim_hv_stats hv;
+};
+
+// One request of a closed loop run.
+struct sim_slot {
+    uint64_t start_ns;
+    void *buf;
+    void *data;
+};
+
+struct sim_job {
+    struct sim_vq *vq;
+    int depth;
+    struct sim_result *res;
+    uint64_t rng;
+    // add the chain of slot to vq, and check the completed one
+    int (*submit)(struct sim_job *job, struct sim_slot *slot);
+    void (*complete)(struct sim_job *job, struct sim_slot *slot, uint32_t len);
+};
+
+static uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void record_latency(struct sim_result *res, uint64_t ns)
+{
+    if (res->lat_num < SIM_LAT_SAMPLES)
+        res->lat[res->lat_num++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_result(struct sim_result *res)
+{
+    uint64_t avg = 0, p50 = 0, p99 = 0, max = 0, sum = 0;
+    double secs = res->ns / 1e9, ops = res->ops ? res->ops : 1;
+    if (res->lat_num) {
+        qsort(res->lat, res->lat_num, sizeof(uint64_t), cmp_u64);
+        for (uint64_t i = 0; i < res->lat_num; i++)
+            sum += res->lat[i];
+        avg = sum / res->lat_num;
+        p50 = res->lat[res->lat_num / 2];
+        p99 = res->lat[res->lat_num * 99 / 100];
+        max = res->lat[res->lat_num - 1];
+    }
+    if (conf.json) {
+        printf("{\"workload\":\"%s\",\"event_idx\":%s,\"depth\":%d,\"ops\":%lu,\"ops_per_sec\":%.0f,"
+                "\"mib_per_sec\":%.1f,\"lat_avg_ns\":%lu,\"lat_p50_ns\":%lu,\"lat_p99_ns\":%lu,"
+                "\"lat_max_ns\":%lu,\"kicks_per_op\":%.3f,\"irqs_per_op\":%.3f,"
+                "\"mmio_reqs_per_op\":%.3f,\"wakeups_per_op\":%.3f,\"file_wakeups_per_op\":%.3f,"
+                "\"hypercalls_per_op\":%.3f,"
+                "\"drops\":%lu,\"errors\":%lu}\n",
+                res->name, conf.event_idx ? "true" : "false", conf.depth, res->ops, res->ops / secs,
+                res->bytes / secs / (1 << 20), avg, p50, p99, max, res->kicks / ops, res->irqs / ops,
+                res->hv.reqs / ops, res->hv.wakeups / ops, res->hv.file_wakeups / ops,
+                res->hv.finish_reqs / ops, res->drops, res->errors);
+    } else {
+        printf("%-13s %9lu ops %9.0f ops/s %8.1f MiB/s  lat avg %6luns p50 %6luns p99 %7luns max %8luns"
+                "  kicks/op %.3f irqs/op %.3f mmio/op %.3f wakeups/op %.3f (%.3f files) hypercalls/op %.3f",
+                res->name, res->ops, res->ops / secs, res->bytes / secs / (1 << 20),
+                avg, p50, p99, max, res->kicks / ops, res->irqs / ops,
+                res->hv.reqs / ops, res->hv.wakeups / ops, res->hv.file_wakeups / ops,
+                res->hv.finish_reqs / ops);
+        if (res->drops || res->errors)
+            printf("  drops %lu errors %lu", res->drops, res->errors);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static void check(const char *name, bool ok)
+{
+    if (!ok)
+        checks_failed++;
+    if (conf.json)
+        printf("{\"check\":\"%s\",\"result\":\"%s\"}\n", name, ok ? "pass" : "fail");
+    else
+        printf("%-60s %s\n", name, ok ? "pass" : "FAIL");
+    fflush(stdout);
+}
+
+static void hv_stats_diff(struct sim_hv_stats *st, struct sim_hv_stats *start)
+{
+    sim_hv_get_stats(st);
+    st->reqs -= start->reqs;
+    st->wakeups -= start->wakeups;
+    st->file_wakeups -= start->file_wakeups;
+    st->finish_reqs -= start->finish_reqs;
+    st->irqs -= start->irqs;
+}
+
+/// Take every completed chain of job.
+/// \return the number of completions.
+static int reap(struct sim_job *job, struct sim_slot **free_slots, int *free_num)
+{
+    struct sim_slot *slot;
+    uint32_t len;
+    int n = 0;
+    while ((slot = sim_vq_get_used(job->vq, &len)) != NULL) {
+        record_latency(job->res, sim_now_ns() - slot->start_ns);
+        job->complete(job, slot, len);
+        job->res->ops++;
+        free_slots[(*free_num)++] = slot;
+        n++;
+    }
+    return n;
+}
+
+/// Keep depth requests in flight for the configured duration, then drain them.
+static int run_closed_loop(struct sim_job *job, struct sim_slot *slots)
+{
+    struct sim_vq *vq = job->vq;
+    struct sim_dev *dev = vq->dev;
+    struct sim_slot **free_slots = calloc(job->depth, sizeof(*free_slots));
+    struct sim_hv_stats hv_start;
+    int free_num = 0, inflight = 0, err = 0;
+    uint64_t start, end, now;
+    bool stop = false;
+
+    for (int i = 0; i < job->depth; i++)
+        free_slots[free_num++] = &slots[i];
+    sim_vq_disable_cb(vq);
+    sim_hv_get_stats(&hv_start);
+    start = sim_now_ns();
+    end = start + conf.duration_ns;
+    for (;;) {
+        now = sim_now_ns();
+        stop = stop || now >= end;
+        while (!stop && free_num > 0) {
+            struct sim_slot *slot = free_slots[--free_num];
+            slot->start_ns = now;
+            if (job->submit(job, slot)) {
+                free_slots[free_num++] = slot;
+                break;
+            }
+            inflight++;
+        }
+        sim_vq_kick(vq);
+        inflight = job->depth - free_num;
+        if (inflight == 0 && stop)
+            break;
+        if (reap(job, free_slots, &free_num))
+            continue;
+        // completed meanwhile
+        if (!sim_vq_enable_cb(vq))
+            continue;
+        if (sim_dev_wait_irq(dev, SIM_IRQ_TIMEOUT_MS)) {
+            log_error("sim: %s: no irq in %dms with %d requests in flight",
+                    job->res->name, SIM_IRQ_TIMEOUT_MS, inflight);
+            err = -1;
+            break;
+        }
+        sim_vq_disable_cb(vq);
+    }
+    job->res->ns = sim_now_ns() - start;
+    job->res->kicks = dev->kicks;
+    job->res->irqs = dev->irqs;
+    hv_stats_diff(&job->res->hv, &hv_start);
+    free(free_slots);
+    return err;
+}
+
+static struct sim_result *new_result(const char *name)
+{
+    struct sim_result *res = calloc(1, sizeof(*res));
+    res->name = name;
+    res->lat = malloc(SIM_LAT_SAMPLES * sizeof(uint64_t));
+    return res;
+}
+
+static void free_result(struct sim_result *res)
+{
+    free(res->lat);
+    free(res);
+}
+
+static uint64_t sim_features(void)
+{
+    return (1ULL << VIRTIO_F_VERSION_1) | (conf.event_idx ? 1ULL << VIRTIO_RING_F_EVENT_IDX : 0) |
+            (conf.packed ? 1ULL << VIRTIO_F_RING_PACKED : 0);
+}
+
+// blk: a request header and status around the data buffer of the slot, a flush has no data.
+struct blk_buf {
+    struct virtio_blk_outhdr hdr;
+    uint8_t status;
+};
+
+static uint32_t blk_type;
+
+static int blk_submit(struct sim_job *job, struct sim_slot *slot)
+{
+    struct blk_buf *b = slot->buf;
+    uint64_t blocks = SIM_IMG_SIZE / conf.blk_size;
+    struct sim_sg sg[3] = {
+        { &b->hdr, sizeof(b->hdr) },
+        { slot->data, conf.blk_size },
+        { &b->status, 1 },
+    };
+    b->hdr.type = blk_type;
+    b->hdr.sector = blk_type == VIRTIO_BLK_T_FLUSH ? 0 : xorshift(&job->rng) % blocks * (conf.blk_size / 512);
+    b->status = 0xff;
+    if (blk_type == VIRTIO_BLK_T_FLUSH) {
+        sg[1] = sg[2];
+        return sim_vq_add(job->vq, sg, 1, 1, slot);
+    }
+    return sim_vq_add(job->vq, sg, blk_type == VIRTIO_BLK_T_OUT ? 2 : 1,
+            blk_type == VIRTIO_BLK_T_OUT ? 1 : 2, slot);
+}
+
+static void blk_complete(struct sim_job *job, struct sim_slot *slot, uint32_t len)
+{
+    struct blk_buf *b = slot->buf;
+    (void)len;
+    if (b->status != VIRTIO_BLK_S_OK)
+        job->res->errors++;
+    else if (blk_type != VIRTIO_BLK_T_FLUSH)
+        job->res->bytes += conf.blk_size;
+}
+
+static struct sim_slot *alloc_slots(int depth, uint64_t buf_size, uint64_t data_size)
+{
+    struct sim_slot *slots = calloc(depth, sizeof(*slots));
+    for (int i = 0; i < depth; i++) {
+        slots[i].buf = buf_size ? sim_guest_alloc(buf_size, 64) : NULL;
+        slots[i].data = data_size ? sim_guest_alloc(data_size, 4096) : NULL;
+        if ((buf_size && slots[i].buf == NULL) || (data_size && slots[i].data == NULL)) {
+            free(slots);
+            return NULL;
+        }
+    }
+    return slots;
+}
+
+static int run_blk(const char *name, uint32_t type)
+{
+    struct sim_result *res = new_result(name);
+    struct sim_job job = {
+        .res = res, .rng = 0x9e3779b97f4a7c15ULL,
+        .submit = blk_submit, .complete = blk_complete,
+    };
+    struct sim_slot *slots;
+    int err = -1;
+
+    sim_guest_mem_reset();
+    if (sim_dev_probe(&blk_dev, sim_features(), 1, VIRTQUEUE_BLK_MAX_SIZE))
+        goto out;
+    job.vq = &blk_dev.vqs[0];
+    // three descriptors per request
+    job.depth = conf.depth < job.vq->num / 3 ? conf.depth : job.vq->num / 3;
+    slots = alloc_slots(job.depth, sizeof(struct blk_buf), conf.blk_size);
+    if (slots == NULL)
+        goto reset;
+    blk_type = type;
+    err = run_closed_loop(&job, slots);
+    if (!err)
+        print_result(res);
+    free(slots);
+reset:
+    sim_dev_reset(&blk_dev);
+out:
+    free_result(res);
+    return err;
+}
+
+// Drain a peer fd until stop is set, standing in for the other end of a tap or a pty.
+struct peer_reader {
+    int fd;
+    volatile int stop;
+    uint64_t bytes;
+    pthread_t tid;
+};
+
+static void *peer_read_loop(void *arg)
+{
+    struct peer_reader *p = arg;
+    struct pollfd pfd = { .fd = p->fd, .events = POLLIN };
+    char buf[65536];
+    ssize_t len;
+    for (;;) {
+        // what was written before stop is still counted
+        if (poll(&pfd, 1, p->stop ? 10 : 100) <= 0) {
+            if (p->stop)
+                break;
+            continue;
+        }
+        len = read(p->fd, buf, sizeof(buf));
+        if (len > 0)
+            p->bytes += len;
+    }
+    return NULL;
+}
+
+// Config space reads of a device from its own vcpu, timed while a workload
+// loads the data path of the device from another one.
+#define SIM_CFG_READ_CPU 3
+#define SIM_CFG_READ_GAP_US 100
+struct config_reader {
+    struct sim_dev dev;
+    volatile int stop;
+    struct sim_result *res;
+    pthread_t tid;
+};
+
+static void *config_read_loop(void *arg)
+{
+    struct config_reader *r = arg;
+    uint64_t start = sim_now_ns(), t;
+    while (!r->stop) {
+        t = sim_now_ns();
+        sim_dev_read(&r->dev, VIRTIO_MMIO_CONFIG);
+        record_latency(r->res, sim_now_ns() - t);
+        r->res->ops++;
+        r->res->bytes += sizeof(uint32_t);
+        usleep(SIM_CFG_READ_GAP_US);
+    }
+    r->res->ns = sim_now_ns() - start;
+    return NULL;
+}
+
+static int net_tx_submit(struct sim_job *job, struct sim_slot *slot)
+{
+    struct sim_sg sg = { slot->buf, sizeof(struct virtio_net_hdr_v1) + conf.net_size };
+    return sim_vq_add(job->vq, &sg, 1, 0, slot);
+}
+
+static void tx_complete(struct sim_job *job, struct sim_slot *slot, uint32_t len)
+{
+    (void)slot;
+    (void)len;
+    job->res->bytes += job->vq->dev == &net_dev ? conf.net_size : conf.console_size;
+}
+
+static int console_tx_submit(struct sim_job *job, struct sim_slot *slot)
+{
+    struct sim_sg sg = { slot->buf, conf.console_size };
+    return sim_vq_add(job->vq, &sg, 1, 0, slot);
+}
+
+/// Run a tx workload, timing config reads of dev at the same time if cfg_reads is set.
+static int run_tx(const char *name, struct sim_dev *dev, int queue, uint16_t queue_num,
+        int peer_fd, uint32_t buf_size, int (*submit)(struct sim_job *, struct sim_slot *),
+        bool cfg_reads)
+{
+    struct sim_result *res = new_result(name);
+    struct sim_job job = { .res = res, .submit = submit, .complete = tx_complete };
+    struct peer_reader peer = { .fd = peer_fd };
+    struct config_reader cfg = { .dev = *dev };
+    struct sim_slot *slots;
+    int err = -1;
+
+    sim_guest_mem_reset();
+    if (sim_dev_probe(dev, sim_features(), 2, queue_num))
+        goto out;
+    job.vq = &dev->vqs[queue];
+    job.depth = conf.depth < job.vq->num ? conf.depth : job.vq->num;
+    slots = alloc_slots(job.depth, buf_size, 0);
+    if (slots == NULL)
+        goto reset;
+    for (int i = 0; i < job.depth; i++)
+        memset(slots[i].buf, 'a' + i % 26, buf_size);
+    pthread_create(&peer.tid, NULL, peer_read_loop, &peer);
+    if (cfg_reads) {
+        cfg.dev.cpu = SIM_CFG_READ_CPU;
+        cfg.res = new_result("config-read");
+        pthread_create(&cfg.tid, NULL, config_read_loop, &cfg);
+    }
+    err = run_closed_loop(&job, slots);
+    if (cfg_reads) {
+        cfg.stop = 1;
+        pthread_join(cfg.tid, NULL);
+    }
+    peer.stop = 1;
+    pthread_join(peer.tid, NULL);
+    // the device drops what can't be written at once
+    res->drops = (res->bytes - peer.bytes) / (dev == &net_dev ? conf.net_size : conf.console_size);
+    if (!err)
+        print_result(res);
+    if (cfg_reads) {
+        if (!err)
+            print_result(cfg.res);
+        free_result(cfg.res);
+    }
+    free(slots);
+reset:
+    sim_dev_reset(dev);
+out:
+    free_result(res);
+    return err;
+}
+
+// net rx: the peer sends frames stamped with their send time while the guest
+// has free rx buffers. The device still drops the frames coming before the
+// driver kicked rx, the guest gives up on them when no irq comes for a while.
+#define SIM_RX_IDLE_MS 100
+struct net_sender {
+    int fd;
+    int window;
+    volatile int stop;
+    volatile uint64_t sent;
+    volatile uint64_t received;
+    volatile uint64_t lost;
+    pthread_t tid;
+};
+
+static void *net_send_loop(void *arg)
+{
+    struct net_sender *s = arg;
+    char frame[SIM_NET_BUF_SIZE];
+    uint64_t now;
+    memset(frame, 0x5a, sizeof(frame));
+    while (!s->stop) {
+        if ((int64_t)(s->sent - __atomic_load_n(&s->received, __ATOMIC_ACQUIRE) - s->lost) >= s->window) {
+            sched_yield();
+            continue;
+        }
+        // after the ethernet header
+        now = sim_now_ns();
+        memcpy(frame + 14, &now, sizeof(now));
+        if (send(s->fd, frame, conf.net_size, 0) == (ssize_t)conf.net_size)
+            s->sent++;
+    }
+    return NULL;
+}
+
+static bool rx_notify_disabled(struct sim_vq *vq)
+{
+    if (vq->packed)
+        return __atomic_load_n(&vq->device_event->flags, __ATOMIC_RELAXED) == VRING_PACKED_EVENT_FLAG_DISABLE;
+    if (vq->dev->event_idx)
+        return *(volatile uint16_t *)&vring_avail_event(&vq->vring) != vq->avail_idx;
+    return *(volatile uint16_t *)&vq->vring.used->flags & VRING_USED_F_NO_NOTIFY;
+}
+
+static int run_net_rx(const char *name)
+{
+    struct sim_result *res = new_result(name);
+    struct net_sender sender = { .fd = net_peer_fd };
+    struct sim_hv_stats hv_start;
+    struct sim_slot *slots, *slot;
+    struct sim_vq *vq;
+    struct sim_sg sg;
+    uint64_t start, sent_ns;
+    uint32_t len;
+    int depth, err = -1;
+
+    sim_guest_mem_reset();
+    if (sim_dev_probe(&net_dev, sim_features(), 2, VIRTQUEUE_NET_MAX_SIZE))
+        goto out;
+    vq = &net_dev.vqs[0];
+    depth = conf.depth < vq->num ? conf.depth : vq->num;
+    slots = alloc_slots(depth, SIM_NET_BUF_SIZE, 0);
+    if (slots == NULL)
+        goto reset;
+    for (int i = 0; i < depth; i++) {
+        sg = (struct sim_sg) { slots[i].buf, SIM_NET_BUF_SIZE };
+        sim_vq_add(vq, &sg, 0, 1, &slots[i]);
+    }
+    sim_vq_kick(vq);
+    // Frames are dropped until the kick is handled, the device disables rx
+    // notifies then as it takes buffers when frames arrive.
+    start = sim_now_ns();
+    while (!rx_notify_disabled(vq) && sim_now_ns() - start < SIM_IRQ_TIMEOUT_MS * 1000000ULL)
+        usleep(100);
+    sender.window = depth > 1 ? depth / 2 : 1;
+    sim_vq_disable_cb(vq);
+    sim_hv_get_stats(&hv_start);
+    start = sim_now_ns();
+    pthread_create(&sender.tid, NULL, net_send_loop, &sender);
+    for (;;) {
+        if (!sender.stop && sim_now_ns() - start >= conf.duration_ns) {
+            sender.stop = 1;
+            pthread_join(sender.tid, NULL);
+        }
+        if (sender.stop && res->ops == sender.sent)
+            break;
+        while ((slot = sim_vq_get_used(vq, &len)) != NULL) {
+            memcpy(&sent_ns, (char *)slot->buf + sizeof(struct virtio_net_hdr_v1) + 14, sizeof(sent_ns));
+            if (len == sizeof(struct virtio_net_hdr_v1) + conf.net_size) {
+                record_latency(res, sim_now_ns() - sent_ns);
+                res->bytes += conf.net_size;
+            } else {
+                res->errors++;
+            }
+            res->ops++;
+            sg = (struct sim_sg) { slot->buf, SIM_NET_BUF_SIZE };
+            sim_vq_add(vq, &sg, 0, 1, slot);
+            // the buffer is back before the sender may use it
+            __atomic_store_n(&sender.received, res->ops, __ATOMIC_RELEASE);
+        }
+        sim_vq_kick(vq);
+        if (!sim_vq_enable_cb(vq))
+            continue;
+        if (sim_dev_wait_irq(&net_dev, SIM_RX_IDLE_MS)) {
+            if (sender.stop)
+                break;
+            // the frames in flight have been dropped
+            sender.lost = sender.sent - res->ops;
+        }
+        sim_vq_disable_cb(vq);
+    }
+    if (!sender.stop) {
+        sender.stop = 1;
+        pthread_join(sender.tid, NULL);
+    }
+    res->ns = sim_now_ns() - start;
+    res->drops = sender.sent - res->ops;
+    res->kicks = net_dev.kicks;
+    res->irqs = net_dev.irqs;
+    hv_stats_diff(&res->hv, &hv_start);
+    err = 0;
+    print_result(res);
+    free(slots);
+reset:
+    sim_dev_reset(&net_dev);
+out:
+    free_result(res);
+    return err;
+}
+
+// Submit one blk read and spin until it completes, without waiting for its irq.
+static int blk_read_polled(struct sim_vq *vq, struct sim_slot *slot)
+{
+    struct sim_job job = { .vq = vq, .rng = 1 };
+    uint64_t start = sim_now_ns();
+    uint32_t len;
+    blk_type = VIRTIO_BLK_T_IN;
+    if (blk_submit(&job, slot))
+        return -1;
+    sim_vq_kick(vq);
+    while (sim_vq_get_used(vq, &len) == NULL) {
+        if (sim_now_ns() - start > SIM_IRQ_TIMEOUT_MS * 1000000ULL)
+            return -1;
+    }
+    return 0;
+}
+
+/// Wait until the irqs injected to dev reach count, or a while.
+static uint64_t settle_irqs(struct sim_dev *dev, uint64_t count)
+{
+    uint64_t pending = 0, start = sim_now_ns();
+    // irqs are injected after the used ring is written, give them time to show up
+    while (sim_now_ns() - start < 50000000ULL) {
+        pending = sim_dev_pending_irqs(dev);
+        if (pending > count)
+            break;
+        usleep(1000);
+    }
+    return pending;
+}
+
+static bool wait_avail_event(struct sim_vq *vq, bool event_idx)
+{
+    uint64_t start = sim_now_ns();
+    while (sim_now_ns() - start < 100000000ULL) {
+        if (event_idx && *(volatile uint16_t *)&vring_avail_event(&vq->vring) == vq->avail_idx)
+            return true;
+        if (!event_idx && !(*(volatile uint16_t *)&vq->vring.used->flags & VRING_USED_F_NO_NOTIFY))
+            return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+/// Check that the device follows the driver's irq suppression, and asks to be notified when idle.
+static int run_event_idx_checks(void)
+{
+    struct sim_slot *slot;
+    struct sim_vq *vq;
+    uint64_t features = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_RING_F_EVENT_IDX);
+    bool ok;
+    int i;
+
+    // with event idx
+    sim_guest_mem_reset();
+    if (sim_dev_probe(&blk_dev, features, 1, VIRTQUEUE_BLK_MAX_SIZE))
+        return -1;
+    if (!blk_dev.event_idx) {
+        log_error("sim: blk doesn't offer event idx");
+        sim_dev_reset(&blk_dev);
+        return -1;
+    }
+    vq = &blk_dev.vqs[0];
+    slot = alloc_slots(1, sizeof(struct blk_buf), conf.blk_size);
+    if (slot == NULL)
+        return -1;
+
+    ok = wait_avail_event(vq, true);
+    check("event-idx: idle device asks for the next notify", ok);
+
+    // the used event half a ring away is never crossed
+    sim_vq_set_used_event(vq, vq->last_used + 0x8000);
+    for (i = 0, ok = true; i < 16 && ok; i++)
+        ok = blk_read_polled(vq, slot) == 0;
+    check("event-idx: requests complete without irqs", ok);
+    check("event-idx: no irq before the used event", settle_irqs(&blk_dev, 0) == 0);
+    ok = wait_avail_event(vq, true);
+    check("event-idx: avail event follows the avail idx", ok);
+
+    // irq exactly when the used idx moves past the used event
+    sim_vq_set_used_event(vq, vq->last_used + 3);
+    for (i = 0, ok = true; i < 3 && ok; i++)
+        ok = blk_read_polled(vq, slot) == 0;
+    check("event-idx: no irq until the used event is reached", ok && settle_irqs(&blk_dev, 0) == 0);
+    ok = blk_read_polled(vq, slot) == 0;
+    check("event-idx: one irq when the used event is passed", ok && settle_irqs(&blk_dev, 1) == 1);
+    sim_dev_reset(&blk_dev);
+    free(slot);
+
+    // without event idx
+    sim_guest_mem_reset();
+    if (sim_dev_probe(&blk_dev, 1ULL << VIRTIO_F_VERSION_1, 1, VIRTQUEUE_BLK_MAX_SIZE))
+        return -1;
+    vq = &blk_dev.vqs[0];
+    slot = alloc_slots(1, sizeof(struct blk_buf), conf.blk_size);
+    if (slot == NULL)
+        return -1;
+    ok = wait_avail_event(vq, false);
+    check("no-event-idx: idle device doesn't suppress notifies", ok);
+    sim_vq_disable_cb(vq);
+    for (i = 0, ok = true; i < 16 && ok; i++)
+        ok = blk_read_polled(vq, slot) == 0;
+    check("no-event-idx: no irq while the driver disables them", ok && settle_irqs(&blk_dev, 0) == 0);
+    sim_vq_enable_cb(vq);
+    ok = blk_read_polled(vq, slot) == 0;
+    check("no-event-idx: irq once the driver enables them", ok && settle_irqs(&blk_dev, 0) >= 1);
+    free(slot);
+    sim_dev_reset(&blk_dev);
+    return 0;
+}
+
+/// Drive blk over a packed queue: requests across ring laps, a chain with an invalid
+/// buffer id, and irq suppression.
+static int run_packed_checks(void)
+{
+    struct sim_job job = { .rng = 1 };
+    struct sim_slot *slot;
+    struct sim_vq *vq;
+    struct blk_buf *b;
+    struct sim_sg sg[3];
+    uint64_t features = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_F_RING_PACKED) |
+            (conf.event_idx ? 1ULL << VIRTIO_RING_F_EVENT_IDX : 0);
+    uint64_t start;
+    uint32_t len;
+    void *cookie;
+    bool ok;
+    int i;
+
+    sim_guest_mem_reset();
+    if (sim_dev_probe(&blk_dev, features, 1, VIRTQUEUE_BLK_MAX_SIZE))
+        return -1;
+    vq = &blk_dev.vqs[0];
+    if (!vq->packed) {
+        log_error("sim: blk doesn't offer packed rings");
+        sim_dev_reset(&blk_dev);
+        return -1;
+    }
+    slot = alloc_slots(1, sizeof(struct blk_buf), conf.blk_size);
+    if (slot == NULL)
+        return -1;
+    b = slot->buf;
+    job.vq = vq;
+
+    // 3 descriptors a request, the ring wraps around several times
+    for (i = 0, ok = true; i < 2 * vq->num && ok; i++)
+        ok = blk_read_polled(vq, slot) == 0 && b->status == VIRTIO_BLK_S_OK;
+    check("packed: reads complete across ring laps", ok);
+
+    // the device skips all descriptors of a chain with an invalid buffer id
+    sg[0] = (struct sim_sg){ &b->hdr, sizeof(b->hdr) };
+    sg[1] = (struct sim_sg){ slot->data, conf.blk_size };
+    sg[2] = (struct sim_sg){ &b->status, 1 };
+    b->hdr.type = VIRTIO_BLK_T_IN;
+    b->hdr.sector = 0;
+    b->status = 0xff;
+    ok = sim_vq_add_bad_id(vq, sg, 1, 2, slot) == 0;
+    sim_vq_kick(vq);
+    start = sim_now_ns();
+    while (ok && (cookie = sim_vq_get_used(vq, &len)) == NULL) {
+        if (sim_now_ns() - start > SIM_IRQ_TIMEOUT_MS * 1000000ULL)
+            ok = false;
+    }
+    check("packed: a chain with an invalid id completes with len 0", ok && cookie == slot && len == 0);
+    for (i = 0; i < vq->num && ok; i++)
+        ok = blk_read_polled(vq, slot) == 0 && b->status == VIRTIO_BLK_S_OK;
+    check("packed: the device stays in step after an invalid id", ok);
+
+    sim_vq_disable_cb(vq);
+    settle_irqs(&blk_dev, 0);
+    sim_dev_wait_irq(&blk_dev, 0);
+    for (i = 0, ok = true; i < 16 && ok; i++)
+        ok = blk_read_polled(vq, slot) == 0;
+    check("packed: no irq while the driver disables them", ok && settle_irqs(&blk_dev, 0) == 0);
+    ok = sim_vq_enable_cb(vq);
+    blk_type = VIRTIO_BLK_T_IN;
+    ok = ok && blk_submit(&job, slot) == 0;
+    sim_vq_kick(vq);
+    ok = ok && sim_dev_wait_irq(&blk_dev, SIM_IRQ_TIMEOUT_MS) == 0 && sim_vq_get_used(vq, &len) == slot;
+    check("packed: irq once the driver enables them", ok);
+    free(slot);
+    sim_dev_reset(&blk_dev);
+    return 0;
+}
+
+/// Check that the device skips a split avail entry with a head past the ring, asks
+/// for a reset, and doesn't put the head into the used ring.
+static int run_bad_head_checks(void)
+{
+    struct sim_slot *slot;
+    struct sim_vq *vq;
+    uint32_t len;
+    bool ok;
+
+    sim_guest_mem_reset();
+    if (sim_dev_probe(&blk_dev, 1ULL << VIRTIO_F_VERSION_1, 1, VIRTQUEUE_BLK_MAX_SIZE))
+        return -1;
+    vq = &blk_dev.vqs[0];
+    slot = alloc_slots(1, sizeof(struct blk_buf), conf.blk_size);
+    if (slot == NULL)
+        return -1;
+    ok = sim_vq_add_bad_id(vq, NULL, 0, 0, NULL) == 0;
+    // the read behind it completes alone, sim_vq_get_used aborts on a bad id
+    ok = ok && blk_read_polled(vq, slot) == 0 && ((struct blk_buf *)slot->buf)->status == VIRTIO_BLK_S_OK;
+    check("bad-head: the device skips a head past the ring", ok && sim_vq_get_used(vq, &len) == NULL);
+    check("bad-head: the device needs a reset",
+            sim_dev_read(&blk_dev, VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_NEEDS_RESET);
+    free(slot);
+    sim_dev_reset(&blk_dev);
+    check("bad-head: a reset clears it", sim_dev_read(&blk_dev, VIRTIO_MMIO_STATUS) == 0);
+    return 0;
+}
+
+static int run_workload(const char *name)
+{
+    if (strcmp(name, "blk-read") == 0)
+        return run_blk(name, VIRTIO_BLK_T_IN);
+    if (strcmp(name, "blk-write") == 0)
+        return run_blk(name, VIRTIO_BLK_T_OUT);
+    if (strcmp(name, "blk-flush") == 0)
+        return run_blk(name, VIRTIO_BLK_T_FLUSH);
+    if (strcmp(name, "net-tx") == 0)
+        return run_tx(name, &net_dev, 1, VIRTQUEUE_NET_MAX_SIZE, net_peer_fd,
+                sizeof(struct virtio_net_hdr_v1) + conf.net_size, net_tx_submit, false);
+    // config reads answered while tx keeps the device busy
+    if (strcmp(name, "net-tx-config") == 0)
+        return run_tx(name, &net_dev, 1, VIRTQUEUE_NET_MAX_SIZE, net_peer_fd,
+                sizeof(struct virtio_net_hdr_v1) + conf.net_size, net_tx_submit, true);
+    if (strcmp(name, "net-rx") == 0)
+        return run_net_rx(name);
+    if (strcmp(name, "console-tx") == 0)
+        return run_tx(name, &console_dev, CONSOLE_QUEUE_TX, VIRTQUEUE_CONSOLE_MAX_SIZE,
+                console_peer_fd, conf.console_size, console_tx_submit, false);
+    if (strcmp(name, "event-idx") == 0)
+        return run_event_idx_checks();
+    if (strcmp(name, "packed") == 0)
+        return run_packed_checks();
+    if (strcmp(name, "bad-head") == 0)
+        return run_bad_head_checks();
+    log_error("sim: unknown workload %s", name);
+    return -1;
+}
+
+static void *daemon_thread(void *arg)
+{
+    char **argv = arg;
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+    if (virtio_start(argc, argv))
+        log_error("sim: the daemon failed to start");
+    daemon_exited = 1;
+    return NULL;
+}
+
+static int wait_daemon_ready(void)
+{
+    volatile struct virtio_bridge *bridge;
+    uint64_t start = sim_now_ns();
+    while (!daemon_exited && sim_now_ns() - start < 5000000000ULL) {
+        bridge = sim_hv_bridge();
+        if (bridge != NULL && bridge->mmio_avail)
+            return 0;
+        usleep(1000);
+    }
+    return -1;
+}
+
+/// Open the pty of the console device in raw mode.
+static int open_console_peer(void)
+{
+    struct termios tio;
+    int fd;
+    for (int i = 0; i < vdevs_num; i++) {
+        if (vdevs[i]->type != VirtioTConsole)
+            continue;
+        fd = open(ptsname(((ConsoleDev *)vdevs[i]->dev)->master_fd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        tcgetattr(fd, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+        return fd;
+    }
+    return -1;
+}
+
+static void __attribute__((noreturn)) help(int exit_status)
+{
+    printf("Usage: hvisor-sim [options] [-- daemon options]\n"
+            "Run the virtio daemon against a simulated hvisor and guest driver.\n"
+            "  -w list   workloads, default %s\n"
+            "  -t secs   duration of each workload, default 2\n"
+            "  -q depth  requests in flight, default 32\n"
+            "  -b bytes  blk request size, default 4096\n"
+            "  -n bytes  net frame size, default 1514\n"
+            "  -c bytes  console write size, default 256\n"
+            "  -i path   blk image, a temporary %lu MiB file by default\n"
+            "  -o opts   more options of the blk device, like engine=io_uring\n"
+            "  -E        don't negotiate VIRTIO_RING_F_EVENT_IDX\n"
+            "  -P        drive the workloads over packed rings\n"
+            "  -j        print results as json lines\n",
+            conf.workloads, SIM_IMG_SIZE >> 20);
+    exit(exit_status);
+}
+
+static int create_image(char *path)
+{
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, SIM_IMG_SIZE)) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char img_template[] = "/tmp/hvisor-sim-XXXXXX";
+    char blk_opt[256], net_opt[128], console_opt[128], mem_opt[128];
+    char **dargv, *workloads = NULL, *name, *saveptr = NULL;
+    int socks[2], opt, dargc = 0, err = 0;
+    pthread_t daemon_tid;
+    sigset_t term_mask;
+
+    while ((opt = getopt(argc, argv, "w:t:q:b:n:c:i:o:EPjh")) != -1) {
+        switch (opt) {
+        case 'w': conf.workloads = optarg; break;
+        case 't': conf.duration_ns = strtod(optarg, NULL) * 1e9; break;
+        case 'q': conf.depth = strtoul(optarg, NULL, 10); break;
+        case 'b': conf.blk_size = strtoul(optarg, NULL, 10); break;
+        case 'n': conf.net_size = strtoul(optarg, NULL, 10); break;
+        case 'c': conf.console_size = strtoul(optarg, NULL, 10); break;
+        case 'i': conf.img = optarg; break;
+        case 'o': conf.blk_opts = optarg; break;
+        case 'E': conf.event_idx = false; break;
+        case 'P': conf.packed = true; break;
+        case 'j': conf.json = true; break;
+        case 'h': help(0);
+        default: help(1);
+        }
+    }
+    if (conf.depth < 1 || conf.blk_size < 512 || conf.blk_size % 512 || conf.blk_size > SIM_IMG_SIZE ||
+            conf.net_size < 64 || conf.net_size + sizeof(struct virtio_net_hdr_v1) > SIM_NET_BUF_SIZE ||
+            conf.console_size < 1)
+        help(1);
+
+    // SIGTERM stops the daemon, SIGUSR1 dumps its mmio latency and SIGUSR2 traces,
+    // they are read from signalfds of the daemon.
+    sigemptyset(&term_mask);
+    sigaddset(&term_mask, SIGTERM);
+    sigaddset(&term_mask, SIGUSR1);
+    sigaddset(&term_mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &term_mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (sim_hv_init()) {
+        log_error("sim: can't allocate guest memory");
+        return 1;
+    }
+    hvisor_platform = &sim_platform;
+    if (conf.img == NULL) {
+        if (create_image(img_template)) {
+            log_error("sim: can't create blk image, errno is %d", errno);
+            return 1;
+        }
+        conf.img = img_template;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks)) {
+        log_error("sim: socketpair failed, errno is %d", errno);
+        return 1;
+    }
+    net_peer_fd = socks[1];
+
+    snprintf(mem_opt, sizeof(mem_opt), "zone_id=%d,addr=%#lx,size=%#lx", SIM_ZONE_ID,
+            (unsigned long)SIM_RAM_GPA, SIM_RAM_SIZE);
+    snprintf(blk_opt, sizeof(blk_opt), "blk,addr=%#x,len=%#x,irq=%d,zone_id=%d,img=%s%s%s",
+            SIM_BLK_ADDR, SIM_MMIO_LEN, SIM_BLK_IRQ, SIM_ZONE_ID, conf.img,
+            conf.blk_opts ? "," : "", conf.blk_opts ? conf.blk_opts : "");
+    snprintf(net_opt, sizeof(net_opt), "net,addr=%#x,len=%#x,irq=%d,zone_id=%d,tap=fd:%d",
+            SIM_NET_ADDR, SIM_MMIO_LEN, SIM_NET_IRQ, SIM_ZONE_ID, socks[0]);
+    snprintf(console_opt, sizeof(console_opt), "console,addr=%#x,len=%#x,irq=%d,zone_id=%d",
+            SIM_CONSOLE_ADDR, SIM_MMIO_LEN, SIM_CONSOLE_IRQ, SIM_ZONE_ID);
+    dargv = calloc(argc - optind + 10, sizeof(char *));
+    dargv[dargc++] = argv[0];
+    dargv[dargc++] = "--memory";
+    dargv[dargc++] = mem_opt;
+    dargv[dargc++] = "-d";
+    dargv[dargc++] = blk_opt;
+    dargv[dargc++] = "-d";
+    dargv[dargc++] = net_opt;
+    dargv[dargc++] = "-d";
+    dargv[dargc++] = console_opt;
+    for (int i = optind; i < argc; i++)
+        dargv[dargc++] = argv[i];
+    // the daemon parses its options with getopt again
+    optind = 0;
+
+    if (sim_dev_init(&blk_dev, 0, SIM_BLK_ADDR, SIM_BLK_IRQ) ||
+            sim_dev_init(&net_dev, 1, SIM_NET_ADDR, SIM_NET_IRQ) ||
+            sim_dev_init(&console_dev, 2, SIM_CONSOLE_ADDR, SIM_CONSOLE_IRQ)) {
+        log_error("sim: can't register irqs");
+        return 1;
+    }
+    pthread_create(&daemon_tid, NULL, daemon_thread, dargv);
+    if (wait_daemon_ready()) {
+        log_error("sim: the daemon isn't ready");
+        err = 1;
+        goto stop;
+    }
+    console_peer_fd = open_console_peer();
+    if (console_peer_fd < 0) {
+        log_error("sim: can't open the console pty");
+        err = 1;
+        goto stop;
+    }
+
+    workloads = strdup(conf.workloads);
+    for (name = strtok_r(workloads, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+        if (run_workload(name)) {
+            log_error("sim: workload %s failed", name);
+            err = 1;
+        }
+    }
+    if (checks_failed) {
+        log_error("sim: %d checks failed", checks_failed);
+        err = 1;
+    }
+
+stop:
+    if (!daemon_exited)
+        kill(getpid(), SIGTERM);
+    pthread_join(daemon_tid, NULL);
+    close(net_peer_fd);
+    close(console_peer_fd);
+    if (conf.img == img_template)
+        unlink(img_template);
+    sim_hv_exit();
+    free(dargv);
+    free(workloads);
+    return err;
+}
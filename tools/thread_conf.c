@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "thread_conf.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// CPU set and scheduling policy of one thread class.
+struct thread_conf {
+    bool has_cpus;
+    cpu_set_t cpus;
+    bool has_sched;
+    int policy;
+    int priority;
+};
+
+static struct thread_conf confs[ThreadClassNum];
+static const char *class_names[ThreadClassNum] = {
+    [ThreadDispatcher] = "dispatcher",
+    [ThreadEvent] = "event",
+    [ThreadBlk] = "blk",
+    [ThreadNotify] = "notify",
+};
+
+/// Split "class=value", "all" selects every class. Return the classes as a bit mask.
+static int parse_class(char *arg, char **value)
+{
+    char *eq = strchr(arg, '=');
+    if (eq == NULL)
+        return 0;
+    *eq = '\0';
+    *value = eq + 1;
+    if (strcmp(arg, "all") == 0)
+        return (1 << ThreadClassNum) - 1;
+    for (int i = 0; i < ThreadClassNum; i++) {
+        if (strcmp(arg, class_names[i]) == 0)
+            return 1 << i;
+    }
+    log_error("unknown thread class %s", arg);
+    return 0;
+}
+
+/// Parse a cpu list like "0-3,6".
+static int parse_cpus(char *list, cpu_set_t *set)
+{
+    char *now, *end, *save;
+    unsigned long first, last;
+    CPU_ZERO(set);
+    for (now = strtok_r(list, ",", &save); now != NULL; now = strtok_r(NULL, ",", &save)) {
+        first = last = strtoul(now, &end, 10);
+        if (*end == '-')
+            last = strtoul(end + 1, &end, 10);
+        if (end == now || *end != '\0' || first > last || last >= CPU_SETSIZE)
+            return -1;
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+/// --affinity class=cpus
+int thread_conf_parse_affinity(char *arg)
+{
+    char *value;
+    cpu_set_t set;
+    int classes = parse_class(arg, &value);
+    if (classes == 0 || parse_cpus(value, &set)) {
+        log_error("affinity should be dispatcher|event|blk|notify|all=cpu list");
+        return -1;
+    }
+    for (int i = 0; i < ThreadClassNum; i++) {
+        if (classes & (1 << i)) {
+            confs[i].has_cpus = true;
+            confs[i].cpus = set;
+        }
+    }
+    return 0;
+}
+
+/// --sched class=fifo:prio|rr:prio|other
+int thread_conf_parse_sched(char *arg)
+{
+    char *value, *prio = NULL, *end;
+    int policy, priority = 0;
+    int classes = parse_class(arg, &value);
+    if (classes == 0)
+        goto err;
+    prio = strchr(value, ':');
+    if (prio != NULL)
+        *prio++ = '\0';
+    if (strcmp(value, "fifo") == 0)
+        policy = SCHED_FIFO;
+    else if (strcmp(value, "rr") == 0)
+        policy = SCHED_RR;
+    else if (strcmp(value, "other") == 0)
+        policy = SCHED_OTHER;
+    else
+        goto err;
+    if (policy != SCHED_OTHER) {
+        if (prio == NULL)
+            goto err;
+        priority = strtol(prio, &end, 10);
+        if (*end != '\0' || priority < sched_get_priority_min(policy) ||
+                priority > sched_get_priority_max(policy))
+            goto err;
+    }
+    for (int i = 0; i < ThreadClassNum; i++) {
+        if (classes & (1 << i)) {
+            confs[i].has_sched = true;
+            confs[i].policy = policy;
+            confs[i].priority = priority;
+        }
+    }
+    return 0;
+err:
+    log_error("sched should be dispatcher|event|blk|notify|all=fifo:prio|rr:prio|other");
+    return -1;
+}
+
+/// Lock the daemon's current and future memory, so the data path never waits for a page in.
+int thread_conf_mlock(void)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        log_error("mlockall failed, errno is %d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+/// Called by a thread of class cls when it starts.
+void thread_conf_apply(ThreadClass cls)
+{
+    struct thread_conf *conf = &confs[cls];
+    struct sched_param param;
+    int err;
+    if (conf->has_cpus) {
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &conf->cpus);
+        if (err)
+            log_warn("failed to set affinity of %s thread, errno is %d", class_names[cls], err);
+    }
+    if (conf->has_sched) {
+        param.sched_priority = conf->priority;
+        err = pthread_setschedparam(pthread_self(), conf->policy, &param);
+        if (err)
+            log_warn("failed to set scheduling of %s thread, errno is %d", class_names[cls], err);
+    }
+}
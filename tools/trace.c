@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include "latency.h"
+#include "log.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The ring of a thread, head counts the records written since the trace started.
+struct trace_buf {
+    uint64_t head;
+    uint32_t gen;       // the trace the records belong to
+    uint32_t tid;
+    struct trace_buf *next;
+    struct trace_rec recs[TRACE_RECORDS];
+};
+
+bool trace_on;
+static __thread struct trace_buf *trace_buf;
+static struct trace_buf *trace_bufs;
+static uint32_t trace_gen;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct trace_buf *trace_new_buf(void)
+{
+    struct trace_buf *buf = calloc(1, sizeof(struct trace_buf));
+    if (buf == NULL)
+        return NULL;
+    buf->tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&trace_lock);
+    buf->gen = trace_gen;
+    buf->next = trace_bufs;
+    __atomic_store_n(&trace_bufs, buf, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+    return buf;
+}
+
+void trace_record(uint16_t event, uint32_t dev, uint32_t queue, uint32_t idx, uint32_t len, uint32_t arg)
+{
+    struct trace_buf *buf = trace_buf;
+    struct trace_rec *rec;
+    uint32_t gen = __atomic_load_n(&trace_gen, __ATOMIC_ACQUIRE);
+    uint64_t head;
+
+    if (__builtin_expect(buf == NULL, 0)) {
+        buf = trace_buf = trace_new_buf();
+        if (buf == NULL) {
+            log_error("can't allocate the trace of thread %ld", syscall(SYS_gettid));
+            return;
+        }
+    }
+    // the records of the last trace are dropped by the first record of a new one
+    if (__builtin_expect(buf->gen != gen, 0)) {
+        __atomic_store_n(&buf->head, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&buf->gen, gen, __ATOMIC_RELEASE);
+    }
+    head = buf->head;
+    rec = &buf->recs[head & (TRACE_RECORDS - 1)];
+    rec->ts = lat_ticks();
+    rec->event = event;
+    rec->dev = dev < TRACE_NO_DEV ? dev : TRACE_NO_DEV;
+    rec->queue = queue;
+    rec->idx = idx;
+    rec->len = len;
+    rec->arg = arg;
+    __atomic_store_n(&buf->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/// Start a new trace, the records of the previous one are dropped.
+void trace_start(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    __atomic_store_n(&trace_gen, trace_gen + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_on, true, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&trace_lock);
+    log_info("virtio trace started");
+}
+
+// Copy the records of buf still in its ring to recs, oldest first.
+static uint32_t trace_copy(struct trace_buf *buf, struct trace_rec *recs, uint64_t *lost)
+{
+    uint64_t head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE), late;
+    uint64_t n = head < TRACE_RECORDS ? head : TRACE_RECORDS, first = head - n;
+
+    for (uint64_t i = 0; i < n; i++)
+        recs[i] = buf->recs[(first + i) & (TRACE_RECORDS - 1)];
+    // a thread that was recording when tracing stopped may have overwritten the oldest records
+    late = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE) - head;
+    if (late > n)
+        late = n;
+    if (late)
+        memmove(recs, recs + late, (n - late) * sizeof(*recs));
+    *lost = first + late;
+    return n - late;
+}
+
+/// Stop tracing and write the records of every thread to path.
+int trace_stop(const char *path)
+{
+    struct trace_file_hdr *hdr;
+    struct trace_thread_hdr thread;
+    struct trace_buf *buf;
+    struct trace_rec *recs;
+    char tmp[PATH_MAX];
+    uint32_t gen;
+    FILE *fp;
+    int err = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    __atomic_store_n(&trace_on, false, __ATOMIC_SEQ_CST);
+    gen = trace_gen;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    hdr = calloc(1, sizeof(*hdr));
+    recs = malloc(TRACE_RECORDS * sizeof(*recs));
+    if (fp == NULL || hdr == NULL || recs == NULL) {
+        log_error("can't write virtio trace to %s, errno is %d", tmp, errno);
+        err = -1;
+        goto out;
+    }
+    hdr->magic = TRACE_MAGIC;
+    hdr->version = TRACE_VERSION;
+    hdr->rec_size = sizeof(struct trace_rec);
+    hdr->ns_mult = lat_mult;
+    if (metrics != NULL) {
+        hdr->devs_num = __atomic_load_n(&metrics->devs_num, __ATOMIC_ACQUIRE);
+        memcpy(hdr->devs, metrics->devs, hdr->devs_num * sizeof(hdr->devs[0]));
+    }
+    for (buf = trace_bufs; buf != NULL; buf = buf->next)
+        if (__atomic_load_n(&buf->gen, __ATOMIC_ACQUIRE) == gen)
+            hdr->threads++;
+    fwrite(hdr, sizeof(*hdr), 1, fp);
+    for (buf = trace_bufs; buf != NULL; buf = buf->next) {
+        if (__atomic_load_n(&buf->gen, __ATOMIC_ACQUIRE) != gen)
+            continue;
+        thread.tid = buf->tid;
+        thread.records = trace_copy(buf, recs, &thread.lost);
+        fwrite(&thread, sizeof(thread), 1, fp);
+        fwrite(recs, sizeof(*recs), thread.records, fp);
+    }
+    if (ferror(fp)) {
+        log_error("can't write virtio trace to %s", tmp);
+        err = -1;
+    }
+out:
+    if (fp != NULL && fclose(fp) && !err) {
+        log_error("can't write virtio trace to %s, errno is %d", tmp, errno);
+        err = -1;
+    }
+    if (fp != NULL && !err && rename(tmp, path)) {
+        log_error("can't write virtio trace to %s, errno is %d", path, errno);
+        err = -1;
+    }
+    if (fp != NULL && err)
+        unlink(tmp);
+    free(hdr);
+    free(recs);
+    pthread_mutex_unlock(&trace_lock);
+    if (!err)
+        log_warn("virtio trace written to %s", path);
+    return err;
+}
@@ -0,0 +1,137 @@
+#include "uring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/// Create a ring of entries sqes and map its queues.
+/// \return 0, or a negative errno.
+int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    void *sqes;
+    int err;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = uring_setup(entries, &p);
+    if (ring->fd < 0)
+        return -errno;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // both queues are in one mapping since 5.4
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto err;
+        }
+    }
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        goto err;
+    ring->sqes = sqes;
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    // sqes are used in order, so the array maps every slot to itself once
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        ring->sq_array[i] = i;
+    return 0;
+err:
+    err = -errno;
+    if (ring->sq_ring != MAP_FAILED)
+        uring_exit(ring);
+    else
+        close(ring->fd);
+    return err;
+}
+
+void uring_exit(struct uring *ring)
+{
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/// A cleared sqe to fill, NULL if the submission queue is full.
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries)
+        return NULL;
+    sqe = &ring->sqes[ring->sqe_tail++ & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/// Pass the sqes got since the last submit to the kernel with one syscall, with
+/// the ones it left in the queue before. \return the number submitted, or a negative errno.
+int uring_submit(struct uring *ring)
+{
+    unsigned n;
+    int ret;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    n = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (n == 0)
+        return 0;
+    do {
+        ret = uring_enter(ring->fd, n, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -errno : ret;
+}
+
+/// Sleep until there is a completion to reap.
+/// \return 0, or a negative errno.
+int uring_wait(struct uring *ring)
+{
+    int ret;
+    if (uring_peek_cqe(ring) != NULL)
+        return 0;
+    ret = uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+    return ret < 0 ? -errno : 0;
+}
+
+/// Register n buffers, sqes refer to them by index with IORING_OP_READ_FIXED and
+/// IORING_OP_WRITE_FIXED. The kernel pins their pages once instead of on every request.
+/// \return 0, or a negative errno.
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned n)
+{
+    int ret = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, n);
+    return ret < 0 ? -errno : 0;
+}
@@ -6,6 +6,12 @@
 #include "virtio_blk.h"
 #include "virtio_net.h"
 #include "virtio_console.h"
+#include "guest_mem.h"
+#include "thread_conf.h"
+#include "platform.h"
+#include "metrics.h"
+#include "latency.h"
+#include "trace.h"
 #include "log.h"
 #include <sys/mman.h>
 #include <sys/uio.h>
@@ -15,22 +21,102 @@
 #include <sys/ioctl.h>
 #include <getopt.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "event_monitor.h"
 #include <time.h>
 #include <sys/time.h>                                                                                           
 #include <limits.h>
+#include <sched.h>
 #include <sys/stat.h>
 /// hvisor kernel module fd
 int ko_fd;
+/// signalfd for SIGTERM, polled together with ko_fd when the bridge loop parks.
+static int term_fd = -1;
+/// signalfd for SIGUSR1, which writes the mmio latency histograms to latency_file,
+/// and SIGUSR2, which starts a trace or stops it and writes it to trace_file.
+static int dump_fd = -1;
+static const char *latency_file = "mmio-latency.json";
+/// --latency-file was given, the histograms are also written at exit.
+static bool latency_at_exit;
+static const char *trace_file = "virtio-trace.bin";
+static bool trace_at_start;
 volatile struct virtio_bridge *virtio_bridge;
 
-pthread_mutex_t RES_MUTEX = PTHREAD_MUTEX_INITIALIZER;
-VirtIODevice *vdevs[MAX_DEVS];
+VirtIODevice **vdevs;
 int vdevs_num;
+static int vdevs_cap;
 
-void *virt_addr;
-void *phys_addr;
+// Dispatch index of mmio requests: an open addressing hash table from
+// (zone, 512 bytes block of mmio address) to the device covering the block.
+#define VDEV_BLOCK_SHIFT 9
+// largest mmio region of a device, which bounds its slots in the index
+#define VDEV_MAX_LEN 0x10000
+struct vdev_slot {
+	uint64_t block;
+	uint32_t zone_id;
+	VirtIODevice *vdev;	// NULL if the slot is empty
+};
+static struct vdev_slot *vdev_index;
+static uint32_t vdev_index_size, vdev_index_used;
 
-#define WAIT_TIME 1000 // 1ms
+/// geometry of the virtio bridge requested at HVISOR_INIT_VIRTIO
+static struct hvisor_virtio_init bridge_geometry = {
+	.abi_version = HVISOR_VIRTIO_ABI_VERSION,
+	.req_size = sizeof(struct device_req),
+	.cpus = DEFAULT_CPUS,
+	.req_depth = DEFAULT_REQ_DEPTH,
+	.res_depth = DEFAULT_RES_DEPTH,
+	.max_devs = DEFAULT_DEVS,
+};
+
+// Spin budget bounds of the adaptive polling policy, in nanoseconds.
+#define POLL_BUDGET_MIN 2000        // 2us
+#define POLL_BUDGET_INIT 50000      // 50us
+#define POLL_BUDGET_MAX 2000000     // 2ms
+// Fraction of the spin budget spent in low-power wait before parking.
+#define POLL_WAIT_SHIFT 2
+
+static PollPolicy poll_policy = PollAdaptive;
+
+/// Queue irqs of one drain pass in res_list and flush them with one HVISOR_FINISH_REQ.
+static bool irq_batching = true;
+/// irqs queued in res_list but not yet flushed to hvisor. A flush hands every
+/// published irq to hvisor, whichever thread queued it.
+static unsigned int irqs_pending;
+/// notify workers handling doorbells, the last one to go idle flushes their irqs.
+static unsigned int notify_busy;
+/// doorbell passes a notify worker may leave unflushed while other workers are busy.
+#define NOTIFY_FLUSH_PASSES 8
+// when the daemon started, for the rates printed at exit
+static uint64_t start_ns;
+
+/// res_list is a multi producer ring. Producers claim a slot by moving res_claim,
+/// fill it, then mark it in res_seq with its ticket + 1. Published slots are handed
+/// to hvisor in ticket order: whoever clears res_seq of the slot at res_publish
+/// moves res_rear past it. All counters are free running.
+static uint64_t res_claim, res_publish;
+static uint64_t *res_seq;
+/// claims that found res_list full
+#define RES_BACKOFF_MAX 1024
+
+// A dispatcher thread drains the request rings of the cpus it owns.
+struct dispatcher {
+	int id;
+	pthread_t tid;
+	int wake_fd;	// own /dev/hvisor file, woken up only for requests in rings
+	int rings_num;
+	volatile struct device_req_ring **rings;
+	struct poll_stats stats;
+};
+
+static struct dispatcher dispatchers[MAX_CPUS];
+static int dispatchers_num = 1;
+/// eventfd written when dispatchers should exit.
+static int stop_fd = -1;
+static volatile int stopping;
 
 int set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -67,6 +153,10 @@ static inline void write_barrier(void) {
     #ifdef RISCV64
         asm volatile ("fence w,w"::: "memory");
     #endif
+    #ifdef __x86_64__
+        // x86 doesn't reorder stores with stores, only the compiler may.
+        asm volatile ("":: : "memory");
+    #endif
 }
 
 static inline void read_barrier(void) {
@@ -76,6 +166,9 @@ static inline void read_barrier(void) {
     #ifdef RISCV64
         asm volatile ("fence r,r"::: "memory");
     #endif
+    #ifdef __x86_64__
+        asm volatile ("":: : "memory");
+    #endif
 }
 
 static inline void rw_barrier(void) {
@@ -85,6 +178,212 @@ static inline void rw_barrier(void) {
     #ifdef RISCV64
         asm volatile ("fence rw,rw"::: "memory");
     #endif
+    #ifdef __x86_64__
+        // a later load may pass an earlier store
+        asm volatile ("mfence":: : "memory");
+    #endif
+}
+
+/// Hint the cpu that we are in a spin loop.
+static inline void cpu_relax(void) {
+    #ifdef ARM64
+        asm volatile ("yield":: : "memory");
+    #elif defined(RISCV64)
+        // Zihintpause pause, encoded so that old assemblers accept it.
+        asm volatile (".word 0x0100000f":: : "memory");
+    #elif defined(__x86_64__)
+        asm volatile ("pause":: : "memory");
+    #endif
+}
+
+/// Wait in low power until an event happens. On arm64 wfe is woken up by the
+/// generic timer's event stream, other architectures fall back to cpu_relax.
+static inline void cpu_wait(void) {
+    #ifdef ARM64
+        asm volatile ("wfe":: : "memory");
+    #else
+        cpu_relax();
+    #endif
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline bool in_range(uint64_t value, uint64_t lower, uint64_t len)
+{
+    return ((value >= lower) && (value < (lower + len)));
+}
+
+static inline uint32_t vdev_hash(uint32_t zone_id, uint64_t block)
+{
+	uint64_t h = (block ^ ((uint64_t)zone_id << 40)) * 0x9E3779B97F4A7C15ULL;
+	return h >> 32;
+}
+
+/// The first slot of the probe sequence of (zone_id, block) that no device uses.
+static inline struct vdev_slot *vdev_index_free_slot(uint32_t zone_id, uint64_t block)
+{
+	uint32_t mask = vdev_index_size - 1;
+	uint32_t i = vdev_hash(zone_id, block) & mask;
+	while (vdev_index[i].vdev != NULL)
+		i = (i + 1) & mask;
+	return &vdev_index[i];
+}
+
+/// Find the device whose mmio region contains address in zone_id.
+static inline VirtIODevice *vdev_index_lookup(uint32_t zone_id, uint64_t address)
+{
+	uint64_t block = address >> VDEV_BLOCK_SHIFT;
+	uint32_t mask = vdev_index_size - 1, i;
+	struct vdev_slot *slot;
+	if (vdev_index_used == 0)
+		return NULL;
+	// Devices sharing a block have a slot each, and a region may cover only part
+	// of its first or last block.
+	for (i = vdev_hash(zone_id, block) & mask; vdev_index[i].vdev != NULL; i = (i + 1) & mask) {
+		slot = &vdev_index[i];
+		if (slot->block == block && slot->zone_id == zone_id &&
+				in_range(address, slot->vdev->base_addr, slot->vdev->len))
+			return slot->vdev;
+	}
+	return NULL;
+}
+
+/// Add a slot for each block of the mmio region of vdev.
+/// \return 0, or -1 if the index can't grow.
+static int vdev_index_insert(VirtIODevice *vdev)
+{
+	uint64_t first = vdev->base_addr >> VDEV_BLOCK_SHIFT;
+	uint64_t last = (vdev->base_addr + vdev->len - 1) >> VDEV_BLOCK_SHIFT;
+	struct vdev_slot *old = vdev_index, *slot;
+	uint32_t old_size = vdev_index_size, size, i;
+
+	// Keep the load factor under 1/2.
+	if ((vdev_index_used + last - first + 1) * 2 > vdev_index_size) {
+		size = vdev_index_size ? vdev_index_size : 64;
+		while ((vdev_index_used + last - first + 1) * 2 > size)
+			size <<= 1;
+		slot = calloc(size, sizeof(struct vdev_slot));
+		if (slot == NULL) {
+			log_error("failed to grow the mmio dispatch index");
+			return -1;
+		}
+		vdev_index = slot;
+		vdev_index_size = size;
+		for (i = 0; i < old_size; i++) {
+			if (old[i].vdev != NULL)
+				*vdev_index_free_slot(old[i].zone_id, old[i].block) = old[i];
+		}
+		free(old);
+	}
+	for (uint64_t block = first; block <= last; block++) {
+		slot = vdev_index_free_slot(vdev->zone_id, block);
+		slot->block = block;
+		slot->zone_id = vdev->zone_id;
+		slot->vdev = vdev;
+		vdev_index_used++;
+	}
+	return 0;
+}
+
+/// Check that no device of zone_id is already in [base_addr, base_addr + len).
+static bool vdev_region_is_free(uint32_t zone_id, uint64_t base_addr, uint64_t len)
+{
+	uint32_t mask = vdev_index_size - 1, i;
+	struct vdev_slot *slot;
+	uint64_t block;
+	if (vdev_index_used == 0)
+		return true;
+	for (block = base_addr >> VDEV_BLOCK_SHIFT; block <= (base_addr + len - 1) >> VDEV_BLOCK_SHIFT; block++) {
+		for (i = vdev_hash(zone_id, block) & mask; vdev_index[i].vdev != NULL; i = (i + 1) & mask) {
+			slot = &vdev_index[i];
+			if (slot->block == block && slot->zone_id == zone_id &&
+					slot->vdev->base_addr < base_addr + len &&
+					base_addr < slot->vdev->base_addr + slot->vdev->len)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Post a queue notify to the device's worker, waking it up if no doorbell was pending.
+static void virtio_ring_doorbell(VirtIODevice *vdev, uint32_t queue)
+{
+    uint64_t one = 1;
+    if (__atomic_fetch_or(&vdev->doorbell, 1U << queue, __ATOMIC_SEQ_CST) == 0) {
+        if (write(vdev->notify_fd, &one, sizeof(one)) < 0)
+            log_error("failed to wake up notify worker, errno is %d", errno);
+    }
+}
+
+static void *notify_worker(void *arg)
+{
+    VirtIODevice *vdev = arg;
+    uint64_t count;
+    uint32_t bits;
+    unsigned int passes = 0;
+    thread_conf_apply(ThreadNotify);
+    for (;;) {
+        if (read(vdev->notify_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            log_error("failed to read notify fd, errno is %d", errno);
+            break;
+        }
+        if (__atomic_load_n(&vdev->notify_stop, __ATOMIC_ACQUIRE))
+            break;
+        __atomic_fetch_add(&notify_busy, 1, __ATOMIC_SEQ_CST);
+        // Notifies posted while handling are picked up by the next exchange.
+        while ((bits = __atomic_exchange_n(&vdev->doorbell, 0, __ATOMIC_SEQ_CST)) != 0) {
+            pthread_mutex_lock(&vdev->notify_lock);
+            for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+                if ((bits & (1U << i)) && vdev->vqs[i].ready) {
+                    log_trace("queue %d notify", i);
+                    vdev->vqs[i].notify_handler(vdev, &vdev->vqs[i]);
+                }
+            }
+            pthread_mutex_unlock(&vdev->notify_lock);
+        }
+        // One hypercall for the irqs of all the workers, unless they keep overlapping.
+        if ((__atomic_sub_fetch(&notify_busy, 1, __ATOMIC_SEQ_CST) == 0 &&
+                    __atomic_load_n(&vdev->doorbell, __ATOMIC_SEQ_CST) == 0) ||
+                ++passes >= NOTIFY_FLUSH_PASSES) {
+            virtio_flush_irqs();
+            passes = 0;
+        }
+    }
+    return NULL;
+}
+
+static int start_notify_worker(VirtIODevice *vdev)
+{
+    if (vdev->vqs_len > 32) {
+        log_error("too many queues for the doorbell");
+        return -1;
+    }
+    pthread_mutex_init(&vdev->notify_lock, NULL);
+    vdev->notify_fd = eventfd(0, EFD_CLOEXEC);
+    if (vdev->notify_fd < 0) {
+        log_error("failed to create notify fd, errno is %d", errno);
+        return -1;
+    }
+    if (pthread_create(&vdev->notify_tid, NULL, notify_worker, vdev)) {
+        log_error("failed to create notify worker");
+        close(vdev->notify_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_notify_worker(VirtIODevice *vdev)
+{
+    uint64_t one = 1;
+    __atomic_store_n(&vdev->notify_stop, true, __ATOMIC_RELEASE);
+    if (write(vdev->notify_fd, &one, sizeof(one)) < 0)
+        log_error("failed to stop notify worker, errno is %d", errno);
+    pthread_join(vdev->notify_tid, NULL);
+    close(vdev->notify_fd);
 }
 
 // create a virtio device.
@@ -95,32 +394,48 @@ static VirtIODevice *create_virtio_device(VirtioDeviceType dev_type, uint32_t zo
 				dev_type, zone_id, base_addr, len, irq_id);
     VirtIODevice *vdev = NULL;
     int is_err;
+	if (len == 0 || len > VDEV_MAX_LEN || base_addr + len < base_addr) {
+		log_error("mmio region %#lx of zone %d should be 1 to %#x bytes long", base_addr, zone_id, VDEV_MAX_LEN);
+		return NULL;
+	}
+	if (!vdev_region_is_free(zone_id, base_addr, len)) {
+		log_error("mmio region %#lx of zone %d overlaps with another device", base_addr, zone_id);
+		return NULL;
+	}
 	vdev = calloc(1, sizeof(VirtIODevice));
+	if (vdev == NULL) {
+		log_error("failed to allocate virtio device");
+		return NULL;
+	}
 	init_mmio_regs(&vdev->regs, dev_type);
 	vdev->base_addr = base_addr;
 	vdev->len = len;
 	vdev->zone_id = zone_id;
 	vdev->irq_id = irq_id;
 	vdev->type = dev_type;
+	pthread_mutex_init(&vdev->mtx, NULL);
     switch (dev_type)
     {
     case VirtioTBlock: 
         vdev->regs.dev_feature = BLK_SUPPORTED_FEATURES;
         vdev->dev = init_blk_dev(vdev);
-        init_virtio_queue(vdev, dev_type);
-        is_err = virtio_blk_init(vdev, (const char*)arg);
+        if (vdev->dev == NULL || init_virtio_queue(vdev, dev_type))
+            goto err;
+        is_err = virtio_blk_init(vdev, (const struct blk_conf *)arg);
         break;
     case VirtioTNet:
         vdev->regs.dev_feature = NET_SUPPORTED_FEATURES;
         uint8_t mac[] = {0x00, 0x16, 0x3E, 0x10, 0x10, 0x10};
         vdev->dev = init_net_dev(mac);
-        init_virtio_queue(vdev, dev_type);
+        if (vdev->dev == NULL || init_virtio_queue(vdev, dev_type))
+            goto err;
         is_err = virtio_net_init(vdev, (char *)arg);
         break;
     case VirtioTConsole:
         vdev->regs.dev_feature = CONSOLE_SUPPORTED_FEATURES;
         vdev->dev = init_console_dev();
-        init_virtio_queue(vdev, dev_type);
+        if (vdev->dev == NULL || init_virtio_queue(vdev, dev_type))
+            goto err;
         is_err = virtio_console_init(vdev);
         break;
 	default:
@@ -128,36 +443,88 @@ static VirtIODevice *create_virtio_device(VirtioDeviceType dev_type, uint32_t zo
 		goto err;
     }
     if (is_err) goto err;
-    log_info("create virtio device %d success", dev_type);
+    vdev->id = metrics_add_dev(zone_id, dev_type, base_addr, irq_id, vdev->vqs_len);
+    if (start_notify_worker(vdev))
+        goto close;
+    if (vdevs_num == vdevs_cap) {
+        VirtIODevice **grown = realloc(vdevs, (vdevs_cap ? vdevs_cap * 2 : 8) * sizeof(VirtIODevice *));
+        if (grown == NULL) {
+            log_error("failed to grow the device list");
+            goto stop;
+        }
+        vdevs = grown;
+        vdevs_cap = vdevs_cap ? vdevs_cap * 2 : 8;
+    }
+    // Requests find the device once it is in the index.
+    if (vdev_index_insert(vdev))
+        goto stop;
     vdevs[vdevs_num++] = vdev;
+    log_info("create virtio device %d success", dev_type);
     return vdev;
 
+stop:
+	stop_notify_worker(vdev);
+close:
+	// The device threads are running, only the device may free it.
+	vdev->virtio_close(vdev);
+	return NULL;
 err:
+	free_virtio_queues(vdev);
+	if (dev_type == VirtioTBlock && vdev->dev != NULL)
+		free(((BlkDev *)vdev->dev)->reqs);
+	free(vdev->dev);
 	free(vdev);
 	return NULL;
 }
 
-void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type)
+/// Preallocate the iovs of every chain the queue can hold, one slot per head descriptor.
+/// The extra slot is where a packed chain is walked before its buffer id is known.
+/// Packed chains with an invalid buffer id get a stand-in id past the ring.
+static int virtqueue_init_arena(VirtQueue *vq, uint32_t slot_len)
+{
+    vq->iov_slot_len = slot_len;
+    vq->iov_arena = calloc((size_t)(vq->queue_num_max + 1) * slot_len, sizeof(struct iovec));
+    vq->flags_arena = calloc((size_t)(vq->queue_num_max + 1) * slot_len, sizeof(uint16_t));
+    vq->packed_desc_num = calloc(2 * vq->queue_num_max, sizeof(uint16_t));
+    if (vq->iov_arena == NULL || vq->flags_arena == NULL || vq->packed_desc_num == NULL) {
+        log_error("failed to allocate iov arena of virtqueue %d", vq->vq_idx);
+        return -1;
+    }
+    return 0;
+}
+
+int init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type)
 {
     VirtQueue *vq = NULL;
+    int err = 0;
     switch (type)
     {
     case VirtioTBlock:
         vdev->vqs_len = 1;
-        vq = malloc(sizeof(VirtQueue));
+        vq = calloc(1, sizeof(VirtQueue));
+        if (vq == NULL)
+            break;
         virtqueue_reset(vq, 0);
         vq->queue_num_max = VIRTQUEUE_BLK_MAX_SIZE;
         vq->notify_handler = virtio_blk_notify_handler;
         vq->dev = vdev;
+        vq->irq_timer_fd = -1;
         vdev->vqs = vq;
+        // header + data segments + status
+        err = virtqueue_init_arena(vq, BLK_SEG_MAX + 2);
         break;
     case VirtioTNet:
         vdev->vqs_len = NET_MAX_QUEUES;
-        vq = malloc(sizeof(VirtQueue) * NET_MAX_QUEUES);
+        vq = calloc(NET_MAX_QUEUES, sizeof(VirtQueue));
+        if (vq == NULL)
+            break;
         for (int i = 0; i < NET_MAX_QUEUES; ++i) {
             virtqueue_reset(vq, i);
             vq[i].queue_num_max = VIRTQUEUE_NET_MAX_SIZE;
             vq[i].dev = vdev;
+            vq[i].irq_timer_fd = -1;
+            // tx appends a padding iov
+            err |= virtqueue_init_arena(&vq[i], NET_SEG_MAX + 1);
         }
         vq[NET_QUEUE_RX].notify_handler = virtio_net_rxq_notify_handler;
         vq[NET_QUEUE_TX].notify_handler = virtio_net_txq_notify_handler;
@@ -165,11 +532,15 @@ void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type)
         break;
     case VirtioTConsole:
         vdev->vqs_len = CONSOLE_MAX_QUEUES;
-        vq = malloc(sizeof(VirtQueue) * CONSOLE_MAX_QUEUES);
+        vq = calloc(CONSOLE_MAX_QUEUES, sizeof(VirtQueue));
+        if (vq == NULL)
+            break;
         for (int i = 0; i < CONSOLE_MAX_QUEUES; ++i) {
             virtqueue_reset(vq, i);
             vq[i].queue_num_max = VIRTQUEUE_CONSOLE_MAX_SIZE;
             vq[i].dev = vdev;
+            vq[i].irq_timer_fd = -1;
+            err |= virtqueue_init_arena(&vq[i], CONSOLE_SEG_MAX);
         }
         vq[CONSOLE_QUEUE_RX].notify_handler = virtio_console_rxq_notify_handler;
         vq[CONSOLE_QUEUE_TX].notify_handler = virtio_console_txq_notify_handler;
@@ -178,6 +549,27 @@ void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type)
     default:
         break;
     }
+    if (vq == NULL || err) {
+        log_error("failed to allocate the virtqueues of device type %d", type);
+        free_virtio_queues(vdev);
+        return -1;
+    }
+    return 0;
+}
+
+void free_virtio_queues(VirtIODevice *vdev)
+{
+    if (vdev->vqs == NULL)
+        return;
+    for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+        free(vdev->vqs[i].iov_arena);
+        free(vdev->vqs[i].flags_arena);
+        free(vdev->vqs[i].packed_desc_num);
+        if (vdev->vqs[i].irq_timer_fd >= 0)
+            close(vdev->vqs[i].irq_timer_fd);
+    }
+    free(vdev->vqs);
+    vdev->vqs = NULL;
 }
 
 void init_mmio_regs(VirtMmioRegs *regs, VirtioDeviceType type)
@@ -193,6 +585,8 @@ void virtio_dev_reset(VirtIODevice *vdev)
     vdev->regs.status = 0;
     vdev->regs.interrupt_status = 0;
     vdev->regs.interrupt_count = 0;
+    // features, and the ring layout with them, are negotiated again
+    vdev->regs.drv_feature = 0;
     int idx = vdev->regs.queue_sel;
     vdev->vqs[idx].ready = 0;
     for(uint32_t i=0; i<vdev->vqs_len; i++) {
@@ -207,19 +601,55 @@ void virtqueue_reset(VirtQueue *vq, int idx)
     void *addr = vq->notify_handler;
     VirtIODevice *dev = vq->dev;
     uint32_t queue_num_max = vq->queue_num_max;
+    struct iovec *iov_arena = vq->iov_arena;
+    uint16_t *flags_arena = vq->flags_arena;
+    uint32_t iov_slot_len = vq->iov_slot_len;
+    uint16_t *packed_desc_num = vq->packed_desc_num;
+    struct irq_coalesce coalesce = vq->coalesce;
+    int irq_timer_fd = vq->irq_timer_fd;
     memset(vq, 0, sizeof(VirtQueue));
     vq->vq_idx = idx;
     vq->notify_handler = addr;
     vq->dev = dev;
     vq->queue_num_max = queue_num_max;
+    vq->iov_arena = iov_arena;
+    vq->flags_arena = flags_arena;
+    vq->iov_slot_len = iov_slot_len;
+    vq->packed_desc_num = packed_desc_num;
+    vq->coalesce = coalesce;
+    vq->irq_timer_fd = irq_timer_fd;
 	pthread_mutex_init(&vq->used_ring_lock, NULL);
+	pthread_mutex_init(&vq->irq_lock, NULL);
+}
+
+// The wrap counter of a free running packed index.
+static inline bool packed_wrap(VirtQueue *vq, uint16_t idx)
+{
+    return (idx & vq->num) == 0;
+}
+
+// A packed descriptor is available when its avail flag matches the driver's
+// wrap counter and its used flag doesn't.
+static inline bool packed_desc_is_avail(uint16_t flags, bool wrap)
+{
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+    return avail == wrap && used != wrap;
 }
 
 // check if virtqueue has new requests
 bool virtqueue_is_empty(VirtQueue *vq)
 {
+    if (vq->packed) {
+        if (vq->desc_packed == NULL) {
+            log_error_ratelimited("virtqueue's descriptor ring is invalid");
+            return true;
+        }
+        return !packed_desc_is_avail(vq->desc_packed[vq->last_avail_idx & (vq->num - 1)].flags,
+                    packed_wrap(vq, vq->last_avail_idx));
+    }
     if(vq->avail_ring == NULL) {
-        log_error("virtqueue's avail ring is invalid");
+        log_error_ratelimited("virtqueue's avail ring is invalid");
         return true;
     }
 	// read_barrier();
@@ -237,20 +667,11 @@ bool desc_is_writable(volatile VirtqDesc *desc_table, uint16_t idx)
     return false;
 }
 
-void* get_virt_addr(void *addr)
-{
-    return virt_addr - phys_addr + addr;
-}
-
-// get non root linux's ipa
-void* get_phys_addr(void *addr)
-{
-    return addr - virt_addr + phys_addr;
-}
-
 // When virtio device is processing virtqueue, driver adding an elem to virtqueue is no need to notify device.
 void virtqueue_disable_notify(VirtQueue *vq) {
-	if (vq->event_idx_enabled) {
+	if (vq->packed) {
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	} else if (vq->event_idx_enabled) {
 		VQ_AVAIL_EVENT(vq) = vq->last_avail_idx - 1;
 	} else {
     	vq->used_ring->flags |= (uint16_t)VRING_USED_F_NO_NOTIFY;
@@ -259,126 +680,421 @@ void virtqueue_disable_notify(VirtQueue *vq) {
 }
 
 void virtqueue_enable_notify(VirtQueue *vq) {
-	if (vq->event_idx_enabled) {
-		VQ_AVAIL_EVENT(vq) = vq->avail_ring->idx;
+	if (vq->packed && vq->event_idx_enabled) {
+		// notify us when the driver makes the next descriptor available
+		vq->device_event->off_wrap = (vq->last_avail_idx & (vq->num - 1)) |
+				packed_wrap(vq, vq->last_avail_idx) << VRING_PACKED_EVENT_F_WRAP_CTR;
+		write_barrier();
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+	} else if (vq->packed) {
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	} else if (vq->event_idx_enabled) {
+		// Not avail_ring->idx, the chains added after the last pop would never be notified.
+		VQ_AVAIL_EVENT(vq) = vq->last_avail_idx;
 	} else {
-   		vq->used_ring->flags &= !(uint16_t)VRING_USED_F_NO_NOTIFY;
+   		vq->used_ring->flags &= ~(uint16_t)VRING_USED_F_NO_NOTIFY;
 	} 
-	write_barrier();
+	// The caller checks the avail ring again, which must not be read before the event is visible.
+	rw_barrier();
 }
 
+// The rings are translated with the queue size, so the driver must set QUEUE_NUM first.
 void virtqueue_set_desc_table(VirtQueue *vq)
 {
     log_trace("desc table ipa is %#x", vq->desc_table_addr);
-    vq->desc_table = (VirtqDesc *)(virt_addr + vq->desc_table_addr - phys_addr);
+    vq->desc_table = guest_mem_translate(vq->dev->zone_id, vq->desc_table_addr,
+                sizeof(VirtqDesc) * vq->num);
+    if (vq->desc_table == NULL)
+        log_error("desc table %#lx of zone %d is out of guest memory", vq->desc_table_addr, vq->dev->zone_id);
 }
 
 void virtqueue_set_avail(VirtQueue *vq)
 {
     log_trace("avail ring ipa is %#x", vq->avail_addr);
-    vq->avail_ring = (VirtqAvail *)(virt_addr + vq->avail_addr - phys_addr);
+    // flags, idx, ring[num], used_event
+    vq->avail_ring = guest_mem_translate(vq->dev->zone_id, vq->avail_addr,
+                vq->packed ? sizeof(VirtqPackedEvent) : sizeof(uint16_t) * (3 + vq->num));
+    if (vq->avail_ring == NULL)
+        log_error("avail ring %#lx of zone %d is out of guest memory", vq->avail_addr, vq->dev->zone_id);
 }
 
 void virtqueue_set_used(VirtQueue *vq)
 {
     log_trace("used ring ipa is %#x", vq->used_addr);
-    vq->used_ring = (VirtqUsed *)(virt_addr + vq->used_addr - phys_addr);
+    // flags, idx, ring[num], avail_event
+    vq->used_ring = guest_mem_translate(vq->dev->zone_id, vq->used_addr,
+                vq->packed ? sizeof(VirtqPackedEvent) : sizeof(uint16_t) * 3 + sizeof(VirtqUsedElem) * vq->num);
+    if (vq->used_ring == NULL)
+        log_error("used ring %#lx of zone %d is out of guest memory", vq->used_addr, vq->dev->zone_id);
 }
 
+// Copy a guest descriptor once, the guest may change it under us.
+static inline void read_desc(volatile VirtqDesc *vd, VirtqDesc *d)
+{
+    d->addr = vd->addr;
+    d->len = vd->len;
+    d->flags = vd->flags;
+    d->next = vd->next;
+}
+
+static inline void read_packed_desc(volatile VirtqPackedDesc *vd, VirtqPackedDesc *d)
+{
+    d->addr = vd->addr;
+    d->len = vd->len;
+    d->id = vd->id;
+    d->flags = vd->flags;
+}
+
+// A chain being walked into an arena slot.
+struct chain_walk {
+    struct iovec *iov;
+    uint16_t *flags; // NULL if the caller doesn't want them
+    int n;
+    int max_len;
+    uint64_t total_len;
+    uint64_t out_len;   // of the descriptors read by the device
+};
+
 // record one descriptor to iov.
-static inline int descriptor2iov(int i, volatile VirtqDesc *vd,
-           struct iovec *iov, uint16_t *flags) {
+static inline int descriptor2iov(VirtQueue *vq, struct chain_walk *w,
+           uint64_t addr, uint32_t len, uint16_t flags) {
     void *host_addr;
-    host_addr = get_virt_addr((void *)vd->addr);
-    iov[i].iov_base = host_addr;
-    iov[i].iov_len = vd->len;
-    // log_debug("vd->addr ipa is %x, iov_base is %x, iov_len is %d", vd->addr, host_addr, vd->len);
-    if (flags != NULL)
-        flags[i] = vd->flags;
+    if (w->n >= w->max_len) {
+        log_error_ratelimited("descriptor chain is longer than %d", w->max_len);
+        return -E2BIG;
+    }
+    // the used len is 32 bits
+    w->total_len += len;
+    if (w->total_len > UINT32_MAX) {
+        log_error_ratelimited("descriptor chain is too large");
+        return -EINVAL;
+    }
+    host_addr = guest_mem_translate(vq->dev->zone_id, addr, len);
+    if (host_addr == NULL) {
+        log_error_ratelimited("descriptor %#lx, len %d of zone %d is out of guest memory",
+                addr, len, vq->dev->zone_id);
+        return -EFAULT;
+    }
+    if (!(flags & VRING_DESC_F_WRITE))
+        w->out_len += len;
+    w->iov[w->n].iov_base = host_addr;
+    w->iov[w->n].iov_len = len;
+    if (w->flags != NULL)
+        w->flags[w->n] = flags;
+    w->n++;
     return 0;
 }
 
-/// record one descriptor list to iov
-/// \param desc_idx the first descriptor's idx in descriptor list.
-/// \param iov the iov to record
-/// \param flags each descriptor's flags
+// Translate an indirect table, both layouts have 16 bytes descriptors.
+static inline volatile void *indirect_table(VirtQueue *vq, uint64_t addr, uint32_t len, uint32_t *table_len)
+{
+    volatile void *table;
+    if (len == 0 || len % sizeof(VirtqDesc) != 0) {
+        log_error_ratelimited("invalid indirect table len %d", len);
+        return NULL;
+    }
+    table = guest_mem_translate(vq->dev->zone_id, addr, len);
+    if (table == NULL)
+        log_error_ratelimited("indirect table %#lx of zone %d is out of guest memory", addr, vq->dev->zone_id);
+    *table_len = len / sizeof(VirtqDesc);
+    return table;
+}
+
+static int pop_split(VirtQueue *vq, uint16_t avail_idx, uint16_t *desc_idx, struct chain_walk *w,
+            bool record_flags, int append_len)
+{
+    volatile VirtqDesc *table = vq->desc_table;
+    VirtqDesc d;
+    uint16_t next, idx;
+    uint32_t table_len = vq->num, walked = 0;
+    int indirect = 0, err;
+
+    for (;;) {
+        idx = vq->last_avail_idx;
+        if(idx == avail_idx)
+            return 0;
+        vq->last_avail_idx++;
+        // read the ring entry after the avail idx
+        read_barrier();
+        next = vq->avail_ring->ring[idx & (vq->num - 1)];
+        if (next < vq->num)
+            break;
+        // There is no id to give it back with, a used entry past the ring would break
+        // the driver. Skip it, and tell the driver the device needs a reset.
+        log_error_ratelimited("invalid head descriptor %d", next);
+        __atomic_fetch_or(&vq->dev->regs.status, VIRTIO_CONFIG_S_NEEDS_RESET, __ATOMIC_RELAXED);
+    }
+    *desc_idx = next;
+    w->iov = &vq->iov_arena[next * vq->iov_slot_len];
+    if (record_flags)
+        w->flags = &vq->flags_arena[next * vq->iov_slot_len];
+    w->max_len = (int)vq->iov_slot_len - append_len;
+
+    for (;;) {
+        if (next >= table_len) {
+            log_error_ratelimited("descriptor %d is out of a table of %d", next, table_len);
+            return -EINVAL;
+        }
+        // a chain can't be longer than its table, otherwise it loops
+        if (++walked > table_len) {
+            log_error_ratelimited("descriptor chain has a loop");
+            return -EINVAL;
+        }
+        read_desc(&table[next], &d);
+        if (d.flags & VRING_DESC_F_INDIRECT) {
+            if (indirect || (d.flags & VRING_DESC_F_NEXT)) {
+                log_error_ratelimited("nested or chained indirect descriptor");
+                return -EINVAL;
+            }
+            table = indirect_table(vq, d.addr, d.len, &table_len);
+            if (table == NULL)
+                return -EINVAL;
+            indirect = 1;
+            walked = 0;
+            next = 0;
+            continue;
+        }
+        err = descriptor2iov(vq, w, d.addr, d.len, d.flags);
+        if (err)
+            return err;
+        if ((d.flags & VRING_DESC_F_NEXT) == 0)
+            break;
+        next = d.next;
+    }
+    return w->n;
+}
+
+// A packed chain occupies consecutive ring descriptors and its buffer id is in the
+// last one, so it is walked into the spare slot and copied to the id's slot afterwards.
+static int pop_packed(VirtQueue *vq, uint16_t *desc_idx, struct chain_walk *w,
+            bool record_flags, int append_len)
+{
+    volatile VirtqPackedDesc *ring = vq->desc_packed, *table;
+    VirtqPackedDesc d = {0}, ind;
+    uint16_t idx = vq->last_avail_idx, ndesc = 0;
+    uint32_t table_len;
+    int err = 0;
+
+    if (!packed_desc_is_avail(ring[idx & (vq->num - 1)].flags, packed_wrap(vq, idx)))
+        return 0;
+    // read the descriptors after their flags
+    read_barrier();
+    w->iov = &vq->iov_arena[vq->queue_num_max * vq->iov_slot_len];
+    if (record_flags)
+        w->flags = &vq->flags_arena[vq->queue_num_max * vq->iov_slot_len];
+    w->max_len = (int)vq->iov_slot_len - append_len;
+
+    // Even if the chain is malformed, walk to its end to keep in step with the driver.
+    do {
+        if (ndesc == vq->num) {
+            log_error_ratelimited("descriptor chain is longer than the ring");
+            err = -EINVAL;
+            break;
+        }
+        read_packed_desc(&ring[(idx + ndesc) & (vq->num - 1)], &d);
+        ndesc++;
+        if (err)
+            continue;
+        if (d.flags & VRING_DESC_F_INDIRECT) {
+            if (d.flags & VRING_DESC_F_NEXT) {
+                log_error_ratelimited("chained indirect descriptor");
+                err = -EINVAL;
+                continue;
+            }
+            table = indirect_table(vq, d.addr, d.len, &table_len);
+            if (table == NULL) {
+                err = -EINVAL;
+                continue;
+            }
+            // the entries of an indirect table are in order, without NEXT
+            for (uint32_t i = 0; i < table_len && !err; i++) {
+                read_packed_desc(&table[i], &ind);
+                if (ind.flags & VRING_DESC_F_INDIRECT) {
+                    log_error_ratelimited("nested indirect descriptor");
+                    err = -EINVAL;
+                } else {
+                    err = descriptor2iov(vq, w, ind.addr, ind.len, ind.flags);
+                }
+            }
+        } else {
+            err = descriptor2iov(vq, w, d.addr, d.len, d.flags);
+        }
+    } while (d.flags & VRING_DESC_F_NEXT);
+
+    vq->last_avail_idx = idx + ndesc;
+    if (d.id >= vq->num) {
+        log_error_ratelimited("invalid buffer id %d", d.id);
+        // The chain is completed under a stand-in id past the ring, so that as many
+        // descriptors are used as were made available. At most num chains are in flight.
+        d.id = vq->num + (vq->packed_bad_ids++ & (vq->num - 1));
+        err = -EINVAL;
+    }
+    *desc_idx = d.id;
+    vq->packed_desc_num[d.id] = ndesc;
+    if (err)
+        return err;
+    memcpy(&vq->iov_arena[d.id * vq->iov_slot_len], w->iov, w->n * sizeof(struct iovec));
+    w->iov = &vq->iov_arena[d.id * vq->iov_slot_len];
+    if (record_flags) {
+        memcpy(&vq->flags_arena[d.id * vq->iov_slot_len], w->flags, w->n * sizeof(uint16_t));
+        w->flags = &vq->flags_arena[d.id * vq->iov_slot_len];
+    }
+    return w->n;
+}
+
+/// record one descriptor list to iov, walking the chain once.
+/// \param desc_idx the first descriptor's idx in descriptor list, or the buffer id
+/// of a packed queue. It is set even if the chain is malformed, so the caller can
+/// complete it with len 0.
+/// \param iov the iov to record, it points to the arena slot of desc_idx and
+/// stays valid until desc_idx is put into the used ring. Don't free it.
+/// \param flags each descriptor's flags, in the same slot
 /// \param append_len the number of iovs to append
-/// \return the len of iovs
+/// \return the len of iovs, 0 if the avail ring is empty,
+/// -EINVAL if the chain is malformed (bad index, loop, bad indirect table),
+/// -E2BIG if it doesn't fit in the slot, -EFAULT if it is out of the zone's memory
 int process_descriptor_chain(VirtQueue *vq, uint16_t *desc_idx,
                 struct iovec **iov, uint16_t **flags, int append_len)
 {
-    uint16_t next, idx;
-    volatile VirtqDesc *vdesc, *ind_table, *ind_desc;
-	int chain_len = 0, i, table_len;
-    idx = vq->last_avail_idx;
-    if(idx == vq->avail_ring->idx)
+    struct chain_walk w = { 0 };
+    uint64_t *m;
+    int n;
+
+    *iov = NULL;
+    if (flags != NULL)
+        *flags = NULL;
+    if (vq->packed)
+        n = pop_packed(vq, desc_idx, &w, flags != NULL, append_len);
+    else
+        n = pop_split(vq, vq->avail_ring->idx, desc_idx, &w, flags != NULL, append_len);
+    if (n == 0)
         return 0;
-    vq->last_avail_idx++;
-    *desc_idx = next = vq->avail_ring->ring[idx & (vq->num - 1)];
-	// record desc chain' len to chain_len
-	for (i=0; i<(int)vq->num; i++, next = vdesc->next) {
-        vdesc = &vq->desc_table[next];
-		// TODO: vdesc->len may be not chain_len, virtio specification doesn't say it.
-		if (vdesc->flags & VRING_DESC_F_INDIRECT) {
-			chain_len += vdesc->len / 16;
-			i--;
-		}
-		if ((vdesc->flags & VRING_DESC_F_NEXT) == 0)
+    trace_event(TRACE_POP, vq->dev->id, vq->vq_idx, *desc_idx, w.out_len, n);
+    m = metrics_queue(vq->dev->id, vq->vq_idx);
+    metrics_inc(&m[METRIC_REQS], 1);
+    metrics_inc(&m[METRIC_BYTES_OUT], w.out_len);
+    if (n < 0)
+        return n;
+    *iov = w.iov;
+    if (flags != NULL)
+        *flags = w.flags;
+    return n;
+}
+
+/// Give back a chain that was popped but not used, it will be popped again.
+void virtqueue_unpop(VirtQueue *vq, uint16_t idx)
+{
+    metrics_queue_add(vq->dev->id, vq->vq_idx, METRIC_REQS, -1);
+    if (vq->packed)
+        vq->last_avail_idx -= vq->packed_desc_num[idx];
+    else
+        vq->last_avail_idx--;
+}
+
+/// Pop up to max chains, reading the avail idx of a split queue only once.
+/// \return the number of elements popped. A malformed chain has a negative errno
+/// in its n and must still be completed with len 0.
+int virtqueue_pop_batch(VirtQueue *vq, VirtqElem *elems, int max, bool want_flags, int append_len)
+{
+    struct chain_walk w;
+    uint16_t avail_idx = 0;
+    uint64_t out_len = 0, *m;
+    int i, n;
+
+    if (!vq->packed)
+        avail_idx = vq->avail_ring->idx;
+    for (i = 0; i < max; i++) {
+        memset(&w, 0, sizeof(w));
+        if (vq->packed)
+            n = pop_packed(vq, &elems[i].idx, &w, want_flags, append_len);
+        else
+            n = pop_split(vq, avail_idx, &elems[i].idx, &w, want_flags, append_len);
+        if (n == 0)
             break;
-	}
+        trace_event(TRACE_POP, vq->dev->id, vq->vq_idx, elems[i].idx, w.out_len, n);
+        out_len += w.out_len;
+        elems[i].n = n;
+        elems[i].iov = n > 0 ? w.iov : NULL;
+        elems[i].flags = n > 0 ? w.flags : NULL;
+    }
+    if (i > 0) {
+        m = metrics_queue(vq->dev->id, vq->vq_idx);
+        metrics_inc(&m[METRIC_REQS], i);
+        metrics_inc(&m[METRIC_BYTES_OUT], out_len);
+    }
+    return i;
+}
 
-	chain_len += i + 1, next = *desc_idx;
-	
-	*iov = malloc(sizeof(struct iovec) * ( chain_len + append_len));
-	if (flags != NULL)
-		*flags = malloc(sizeof(uint16_t) * ( chain_len + append_len));
-
-	for (i=0; i<chain_len; i++, next = vdesc->next) {
-		vdesc = &vq->desc_table[next];
-		if (vdesc->flags & VRING_DESC_F_INDIRECT) {
-			ind_table = (VirtqDesc *)(get_virt_addr((void *)vdesc->addr));
-			table_len = vdesc->len / 16;
-			log_debug("table_len is %d", table_len);
-			next = 0;
-			for (;;) {
-				log_debug("next is %d", next);
-				ind_desc = &ind_table[next];
-				descriptor2iov(i, ind_desc, *iov, flags == NULL ? NULL : *flags);
-				table_len--;
-				i++;
-				if ((ind_desc->flags & VRING_DESC_F_NEXT) == 0)
-            		break;
-				next = ind_desc->next;
-			}
-			if (table_len != 0) {
-				log_error("invalid indirect descriptor chain");
-				break;
-			}
-		} else {
-			descriptor2iov(i, vdesc, *iov, flags == NULL ? NULL : *flags);
-		}
-	}
-    return chain_len;
+// Write used descriptors over the ring. The flags of the first one are
+// written last, the driver doesn't look past it before it is used.
+static void update_used_packed(VirtQueue *vq, const VirtqUsedElem *elems, int num)
+{
+    volatile VirtqPackedDesc *desc;
+    uint16_t used_idx = vq->next_used_idx, first_flags = 0, flags;
+    for (int i = 0; i < num; i++) {
+        desc = &vq->desc_packed[used_idx & (vq->num - 1)];
+        desc->id = elems[i].id;
+        desc->len = elems[i].len;
+        flags = packed_wrap(vq, used_idx) ?
+                (1 << VRING_PACKED_DESC_F_AVAIL | 1 << VRING_PACKED_DESC_F_USED) : 0;
+        if (i == 0)
+            first_flags = flags;
+        else
+            desc->flags = flags;
+        // skip the other descriptors of the buffer
+        used_idx += elems[i].id < 2 * vq->num ? vq->packed_desc_num[elems[i].id] : 1;
+    }
+    write_barrier();
+    vq->desc_packed[vq->next_used_idx & (vq->num - 1)].flags = first_flags;
+    vq->next_used_idx = used_idx;
+    log_debug("update used ring: used_idx is %d, %d elems, vq->num is %d", used_idx, num, vq->num);
 }
 
-void update_used_ring(VirtQueue *vq, uint16_t idx, uint32_t iolen)
+/// Put num chains into the used ring with one barrier and one used idx update.
+void update_used_ring_batch(VirtQueue *vq, const VirtqUsedElem *elems, int num)
 {
     volatile VirtqUsed *used_ring;
     volatile VirtqUsedElem *elem;
     uint16_t used_idx, mask;
-	// There is no need to worry about if used_ring is full, because used_ring's len is equal to descriptor table's. 
-    write_barrier();
-	// pthread_mutex_lock(&vq->used_ring_lock);
+    uint64_t in_len = 0, *m;
+    if (num <= 0)
+        return;
+    for (int i = 0; i < num; i++)
+        in_len += elems[i].len;
+    if (trace_enabled()) {
+        for (int i = 0; i < num; i++)
+            trace_record(TRACE_PUSH, vq->dev->id, vq->vq_idx, elems[i].id, elems[i].len, 0);
+    }
+    m = metrics_queue(vq->dev->id, vq->vq_idx);
+    metrics_inc(&m[METRIC_COMPLETIONS], num);
+    metrics_inc(&m[METRIC_BYTES_IN], in_len);
+    // Completions of a queue may come from its notify handler and a worker thread.
+    pthread_mutex_lock(&vq->used_ring_lock);
+    if (vq->packed) {
+        update_used_packed(vq, elems, num);
+        pthread_mutex_unlock(&vq->used_ring_lock);
+        return;
+    }
+    // There is no need to worry about if used_ring is full, because used_ring's len is equal to descriptor table's.
     used_ring = vq->used_ring;
     used_idx = used_ring->idx;
     mask = vq->num - 1;
-    elem = &used_ring->ring[used_idx++ & mask];
-    elem->id = idx;
-    elem->len = iolen;
+    for (int i = 0; i < num; i++) {
+        elem = &used_ring->ring[used_idx++ & mask];
+        elem->id = elems[i].id;
+        elem->len = elems[i].len;
+    }
+    // the buffers and the elements are visible before the idx
+    write_barrier();
     used_ring->idx = used_idx;
-	write_barrier();
-	// pthread_mutex_unlock(&vq->used_ring_lock);
-    log_debug("update used ring: used_idx is %d, elem->idx is %d, vq->num is %d", used_idx, idx, vq->num);
+    pthread_mutex_unlock(&vq->used_ring_lock);
+    log_debug("update used ring: used_idx is %d, %d elems, vq->num is %d", used_idx, num, vq->num);
+}
+
+void update_used_ring(VirtQueue *vq, uint16_t idx, uint32_t iolen)
+{
+    VirtqUsedElem elem = { .id = idx, .len = iolen };
+    update_used_ring_batch(vq, &elem, 1);
 }
 
 static uint64_t virtio_mmio_read(VirtIODevice *vdev, uint64_t offset, unsigned size)
@@ -404,7 +1120,7 @@ static uint64_t virtio_mmio_read(VirtIODevice *vdev, uint64_t offset, unsigned s
     }
 
     if (size != 4) {
-        log_error("virtio-mmio-read: wrong size access to register!");
+        log_error_ratelimited("virtio-mmio-read: wrong size access to register!");
         return 0;
     }
 
@@ -429,7 +1145,7 @@ static uint64_t virtio_mmio_read(VirtIODevice *vdev, uint64_t offset, unsigned s
         return vdev->vqs[vdev->regs.queue_sel].ready;
     case VIRTIO_MMIO_INTERRUPT_STATUS:
 		if (vdev->regs.interrupt_status == 0) {
-			log_error("virtio-mmio-read: interrupt status is 0, type is %d", vdev->type);
+			log_error_ratelimited("virtio-mmio-read: interrupt status is 0, type is %d", vdev->type);
 		}
         return vdev->regs.interrupt_status;
     case VIRTIO_MMIO_STATUS:
@@ -449,34 +1165,61 @@ static uint64_t virtio_mmio_read(VirtIODevice *vdev, uint64_t offset, unsigned s
     case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
     case VIRTIO_MMIO_QUEUE_USED_LOW:
     case VIRTIO_MMIO_QUEUE_USED_HIGH:
-        log_error("read of write-only register");
+        log_error_ratelimited("read of write-only register");
         return 0;
     default:
-        log_error("bad register offset %#x", offset);
+        log_error_ratelimited("bad register offset %#x", offset);
         return 0;
     }
     return 0;
 }
 
+// Whether a write to the register changes the queues the notify worker walks:
+// their rings, size and ready, their layout through the features, or a reset.
+static bool mmio_reg_changes_queues(uint64_t offset)
+{
+    switch (offset) {
+    case VIRTIO_MMIO_DRIVER_FEATURES:
+    case VIRTIO_MMIO_QUEUE_NUM:
+    case VIRTIO_MMIO_QUEUE_READY:
+    case VIRTIO_MMIO_STATUS:
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+    case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
+    case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
+    case VIRTIO_MMIO_QUEUE_USED_LOW:
+    case VIRTIO_MMIO_QUEUE_USED_HIGH:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value, unsigned size)
 {
     log_debug("virtio mmio write at %#x, value is %#x\n", offset, value);
     VirtMmioRegs *regs = &vdev->regs;
     VirtQueue *vqs = vdev->vqs;
+    bool queue_reg;
     if (!vdev) {
         return;
     }
 
     if (offset >= VIRTIO_MMIO_CONFIG) {
         offset -= VIRTIO_MMIO_CONFIG;
-        log_error("virtio_mmio_write: can't write config space");
+        log_error_ratelimited("virtio_mmio_write: can't write config space");
         return;
     }
     if (size != 4) {
-        log_error("virtio_mmio_write: wrong size access to register!");
+        log_error_ratelimited("virtio_mmio_write: wrong size access to register!");
         return;
     }
 
+    // The notify worker runs the handlers of the queues without the device lock,
+    // it must not see a queue half way through being changed.
+    queue_reg = mmio_reg_changes_queues(offset);
+    if (queue_reg)
+        pthread_mutex_lock(&vdev->notify_lock);
     switch (offset) {
     case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
         if (value) {
@@ -496,6 +1239,11 @@ static void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t valu
 			for (int i=0; i<len; i++) 
 				vqs[i].event_idx_enabled = 1;
 		}
+		// Queues are set up after features, so the ring layout is known before their addresses.
+		if (regs->drv_feature & regs->dev_feature & (1ULL << VIRTIO_F_RING_PACKED)) {
+			for (uint32_t i = 0; i < vdev->vqs_len; i++)
+				vqs[i].packed = 1;
+		}
         break;
     case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
         if (value) {
@@ -510,34 +1258,43 @@ static void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t valu
         }
         break;
     case VIRTIO_MMIO_QUEUE_NUM:
+        // the iov arena has queue_num_max slots
+        if (value == 0 || value > vqs[regs->queue_sel].queue_num_max || (value & (value - 1))) {
+            log_error("invalid virtqueue num %d", value);
+            break;
+        }
         vqs[regs->queue_sel].num = value;
         log_trace("virtqueue num is %d", value);
         break;
     case VIRTIO_MMIO_QUEUE_READY:
+        if (value && (vqs[regs->queue_sel].desc_table == NULL ||
+                vqs[regs->queue_sel].avail_ring == NULL || vqs[regs->queue_sel].used_ring == NULL)) {
+            log_error("queue %d of zone %d has rings out of guest memory", regs->queue_sel, vdev->zone_id);
+            break;
+        }
         vqs[regs->queue_sel].ready = value;
         break;
     case VIRTIO_MMIO_QUEUE_NOTIFY:
-        log_debug("queue notify begin");
-        if (value < vdev->vqs_len) {
-            log_trace("queue notify ready, handler addr is %#x", vqs[value].notify_handler);
-            vqs[value].notify_handler(vdev, &vqs[value]);
+        if (value < vdev->vqs_len && vqs[value].ready) {
+            metrics_queue_add(vdev->id, value, METRIC_NOTIFIES, 1);
+            trace_event(TRACE_NOTIFY, vdev->id, value, 0, 0, 0);
+            virtio_ring_doorbell(vdev, value);
         }
-        log_debug("queue notify end");
         break;
     case VIRTIO_MMIO_INTERRUPT_ACK:
         if (value == regs->interrupt_status && regs->interrupt_count > 0) {
-            regs->interrupt_count --;
+            // completion threads increase interrupt_count without the device lock.
+            __atomic_fetch_sub(&regs->interrupt_count, 1, __ATOMIC_RELAXED);
             break;
         } else if (value != regs->interrupt_status) {
-            log_error("interrupt_status is not equal to ack, type is %d", vdev->type);
+            log_error_ratelimited("interrupt_status is not equal to ack, type is %d", vdev->type);
         }
-        regs->interrupt_status &= !value;
+        regs->interrupt_status &= ~value;
         break;
     case VIRTIO_MMIO_STATUS:
         regs->status = value;
-        if (regs->status == 0) {
+        if (regs->status == 0)
             virtio_dev_reset(vdev);
-        }
         break;
     case VIRTIO_MMIO_QUEUE_DESC_LOW:
         vqs[regs->queue_sel].desc_table_addr |= value & UINT32_MAX;
@@ -568,35 +1325,142 @@ static void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t valu
     case VIRTIO_MMIO_QUEUE_NUM_MAX:
     case VIRTIO_MMIO_INTERRUPT_STATUS:
     case VIRTIO_MMIO_CONFIG_GENERATION:
-        log_error("%s: write to read-only register 0#x", __func__, offset);
+        log_error_ratelimited("%s: write to read-only register 0#x", __func__, offset);
         break;
 
     default:
-        log_error("%s: bad register offset 0#x", __func__, offset);
+        log_error_ratelimited("%s: bad register offset 0#x", __func__, offset);
     }
+    if (queue_reg)
+        pthread_mutex_unlock(&vdev->notify_lock);
 }
 
-static inline bool in_range(uint64_t value, uint64_t lower, uint64_t len)
+/// Notify hypervisor of the irqs added to res list by any thread.
+void virtio_flush_irqs(void)
 {
-    return ((value >= lower) && (value < (lower + len)));
+	unsigned int n = __atomic_exchange_n(&irqs_pending, 0, __ATOMIC_ACQ_REL);
+	if (n == 0)
+		return;
+	metrics_global_add(METRIC_HYPERCALLS, 1);
+	trace_event(TRACE_FLUSH, TRACE_NO_DEV, 0, 0, n, 0);
+	hvisor_platform->finish_req(ko_fd);
 }
 
-// Inject irq_id to target zone. It will add to res list, and notify hypervisor through ioctl.
-void virtio_inject_irq(VirtQueue *vq)
+/// Claim a slot of res_list, backing off while it is full.
+/// \return the ticket of the claimed slot.
+static uint64_t res_ring_claim(unsigned int res_depth)
+{
+	uint64_t claim;
+	unsigned int i, backoff = 1;
+	bool stalled = false;
+	claim = __atomic_load_n(&res_claim, __ATOMIC_RELAXED);
+	for (;;) {
+		read_barrier();
+		if (!is_queue_full(virtio_bridge->res_front, claim & (res_depth - 1), res_depth)) {
+			if (__atomic_compare_exchange_n(&res_claim, &claim, claim + 1, true,
+						__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				return claim;
+			continue;
+		}
+		if (!stalled) {
+			stalled = true;
+			metrics_global_add(METRIC_RES_FULL, 1);
+			// hvisor only consumes res list on HVISOR_FINISH_REQ, so never wait on our own batch.
+			virtio_flush_irqs();
+		}
+		if (backoff < RES_BACKOFF_MAX) {
+			for (i = 0; i < backoff; i++)
+				cpu_relax();
+			backoff <<= 1;
+		} else {
+			sched_yield();
+		}
+		claim = __atomic_load_n(&res_claim, __ATOMIC_RELAXED);
+	}
+}
+
+/// Move res_rear over every slot published in ticket order.
+static void res_ring_publish(unsigned int res_depth)
+{
+	uint64_t pub, expected;
+	for (;;) {
+		pub = __atomic_load_n(&res_publish, __ATOMIC_SEQ_CST);
+		expected = pub + 1;
+		// Only the thread clearing this slot may move res_rear and res_publish.
+		if (!__atomic_compare_exchange_n(&res_seq[pub & (res_depth - 1)], &expected, 0, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			break;
+		// The slot may be written by another thread, order it before res_rear.
+		rw_barrier();
+		virtio_bridge->res_rear = (pub + 1) & (res_depth - 1);
+		__atomic_store_n(&res_publish, pub + 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+// Check the driver event suppression of a packed queue, new and old are free running used idxes.
+static bool packed_need_irq(VirtQueue *vq, uint16_t new, uint16_t old)
+{
+	uint16_t flags, off_wrap, event_idx, lap = 2 * vq->num;
+	int16_t dist;
+	// read the event after the used descriptors are written
+	rw_barrier();
+	flags = vq->driver_event->flags;
+	if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		return false;
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC || !vq->event_idx_enabled)
+		return true;
+	off_wrap = vq->driver_event->off_wrap;
+	// Turn the ring offset and wrap counter into the free running idx closest to new.
+	event_idx = (new & ~(lap - 1)) | (off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR));
+	if (!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR))
+		event_idx += vq->num;
+	dist = (int16_t)(event_idx - new);
+	if (dist > (int16_t)vq->num)
+		event_idx -= lap;
+	else if (dist < -(int16_t)vq->num)
+		event_idx += lap;
+	return vring_need_event(event_idx, new, old);
+}
+
+// Inject irq_id to target zone. It will add to res list, and notify hypervisor through ioctl
+// immediately, or when virtio_flush_irqs is called at the end of the drain pass if irqs are batched.
+static void inject_irq(VirtQueue *vq, bool timeout)
 {
 	uint16_t last_used_idx, idx, event_idx;
+	struct irq_coalesce *co = &vq->coalesce;
+	pthread_mutex_lock(&vq->irq_lock);
 	last_used_idx = vq->last_used_idx;
-	vq->last_used_idx = idx = vq->used_ring->idx;
-	// read_barrier();
+	idx = vq->packed ? vq->next_used_idx : vq->used_ring->idx;
 	if (idx == last_used_idx) {
+		pthread_mutex_unlock(&vq->irq_lock);
 		log_debug("idx equals last_used_idx");
 		return ;
 	}
-    if (!vq->event_idx_enabled && (vq->avail_ring->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
+	// Wait for more completions, the timer injects the irq if they don't come in time.
+	if (!timeout && co->usec && (co->count == 0 || (uint16_t)(idx - last_used_idx) < co->count)) {
+		if (!vq->irq_timer_armed) {
+			struct itimerspec its = {
+				.it_value = { .tv_sec = co->usec / 1000000, .tv_nsec = co->usec % 1000000 * 1000 },
+			};
+			if (timerfd_settime(vq->irq_timer_fd, 0, &its, NULL) == 0)
+				vq->irq_timer_armed = true;
+		}
+		if (vq->irq_timer_armed) {
+			pthread_mutex_unlock(&vq->irq_lock);
+			return ;
+		}
+	}
+	vq->last_used_idx = idx;
+	pthread_mutex_unlock(&vq->irq_lock);
+	if (vq->packed && !packed_need_irq(vq, idx, last_used_idx))
+		return ;
+	// read the driver's flags or used event after the used idx is written
+	rw_barrier();
+    if (!vq->packed && !vq->event_idx_enabled && (vq->avail_ring->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
 		log_debug("no interrupt");
 		return ;
 	}
-	if (vq->event_idx_enabled) {
+	if (!vq->packed && vq->event_idx_enabled) {
 		event_idx = VQ_USED_EVENT(vq);
 		log_debug("idx is %d, event_idx is %d, last_used_idx is %d", idx, event_idx, last_used_idx);
 		if(!vring_need_event(event_idx, idx, last_used_idx)) {
@@ -604,42 +1468,86 @@ void virtio_inject_irq(VirtQueue *vq)
 		}
 	}
     volatile struct device_res *res;
-    while (is_queue_full(virtio_bridge->res_front, virtio_bridge->res_rear, MAX_REQ));
-    pthread_mutex_lock(&RES_MUTEX);
-    unsigned int res_rear = virtio_bridge->res_rear;
-    res = &virtio_bridge->res_list[res_rear];
+    unsigned int res_depth = virtio_bridge->res_depth, pending;
+    uint64_t ticket;
+	// The driver reads interrupt status once hvisor injects the irq.
+	vq->dev->regs.interrupt_status = VIRTIO_MMIO_INT_VRING;
+    __atomic_fetch_add(&vq->dev->regs.interrupt_count, 1, __ATOMIC_RELAXED);
+    ticket = res_ring_claim(res_depth);
+    res = &bridge_res_list(virtio_bridge)[ticket & (res_depth - 1)];
     res->irq_id = vq->dev->irq_id;
     res->target_zone = vq->dev->zone_id;
-    write_barrier();
-    virtio_bridge->res_rear = (res_rear + 1) & (MAX_REQ - 1);
-    write_barrier();
-	vq->dev->regs.interrupt_status = VIRTIO_MMIO_INT_VRING;
-    vq->dev->regs.interrupt_count ++;
-    pthread_mutex_unlock(&RES_MUTEX);
+    __atomic_store_n(&res_seq[ticket & (res_depth - 1)], ticket + 1, __ATOMIC_SEQ_CST);
+    res_ring_publish(res_depth);
 	log_debug("inject irq to device %d, vq is %d", vq->dev->type, vq->vq_idx);
-    ioctl(ko_fd, HVISOR_FINISH_REQ);
+    metrics_queue_add(vq->dev->id, vq->vq_idx, METRIC_IRQS, 1);
+    trace_event(TRACE_IRQ, vq->dev->id, vq->vq_idx, 0, 0, 0);
+    // counted once published, so that a flush seeing the count covers the irq
+    pending = __atomic_add_fetch(&irqs_pending, 1, __ATOMIC_ACQ_REL);
+    if (!irq_batching || pending >= res_depth / 2)
+        virtio_flush_irqs();
+}
+
+void virtio_inject_irq(VirtQueue *vq)
+{
+	inject_irq(vq, false);
+}
+
+// The coalescing time of a queue is up, inject for what has completed since the last irq.
+static void irq_timer_handler(int fd, int epoll_type, void *param)
+{
+	VirtQueue *vq = param;
+	uint64_t expirations;
+	(void)epoll_type;
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		log_error("read irq timer failed, errno is %d", errno);
+	pthread_mutex_lock(&vq->irq_lock);
+	vq->irq_timer_armed = false;
+	pthread_mutex_unlock(&vq->irq_lock);
+	inject_irq(vq, true);
+}
+
+int virtqueue_set_coalesce(VirtQueue *vq, struct irq_coalesce *coalesce)
+{
+	if (coalesce->count > 1 && coalesce->usec == 0) {
+		log_error("irq coalescing of %d completions needs a time limit", coalesce->count);
+		return -1;
+	}
+	vq->coalesce = *coalesce;
+	if (coalesce->usec == 0 || vq->irq_timer_fd >= 0)
+		return 0;
+	vq->irq_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (vq->irq_timer_fd < 0) {
+		log_error("failed to create irq timer, errno is %d", errno);
+		return -1;
+	}
+	if (add_event(vq->irq_timer_fd, EPOLLIN, irq_timer_handler, vq) == NULL) {
+		close(vq->irq_timer_fd);
+		vq->irq_timer_fd = -1;
+		return -1;
+	}
+	return 0;
 }
 
 static void virtio_finish_cfg_req(uint32_t target_cpu, uint64_t value) {
-    virtio_bridge->cfg_values[target_cpu] = value;
+    bridge_cfg_values(virtio_bridge)[target_cpu] = value;
     write_barrier();
-    virtio_bridge->cfg_flags[target_cpu]++;
+    bridge_cfg_flags(virtio_bridge)[target_cpu]++;
     write_barrier();
 }
 
 static int virtio_handle_req(volatile struct device_req *req)
 {
-    int i;
-    uint64_t value = 0;
-    for (i = 0; i < vdevs_num; ++i) {
-        if ((req->src_zone == vdevs[i]->zone_id) && in_range(req->address, vdevs[i]->base_addr, vdevs[i]->len))
-            break;
+    uint64_t value = 0, start = lat_ticks();
+    VirtIODevice *vdev = vdev_index_lookup(req->src_zone, req->address);
+    if (vdev == NULL) {
+        log_error_ratelimited("no matched virtio dev");
+        return -1;
     }
-    if (i == vdevs_num) {
-        log_error("no matched virtio dev");
+    if (req->src_cpu >= virtio_bridge->cpus) {
+        log_error_ratelimited("invalid src_cpu %lld", req->src_cpu);
         return -1;
     }
-    VirtIODevice *vdev = vdevs[i];
     if (vdev->type == VirtioTNet)
         log_debug("vdev type is net");
     else if (vdev->type == VirtioTBlock)
@@ -647,87 +1555,362 @@ static int virtio_handle_req(volatile struct device_req *req)
     else if (vdev->type == VirtioTConsole)
         log_debug("vdev type is con");
     uint64_t offs = req->address - vdev->base_addr;
+    metrics_mmio_add(vdev->id);
+    // vcpus of one zone may access the same device from different dispatchers.
+    pthread_mutex_lock(&vdev->mtx);
     if (req->is_write) {
         virtio_mmio_write(vdev, offs, req->value, req->size);
     } else {
         value = virtio_mmio_read(vdev, offs, req->size);
         log_debug("read value is 0x%x\n", value);
     }
+    pthread_mutex_unlock(&vdev->mtx);
+    trace_event(req->is_write ? TRACE_MMIO_WRITE : TRACE_MMIO_READ, vdev->id, 0, offs,
+            req->is_write ? req->value : value, req->src_cpu);
     if (!req->need_interrupt) {
         // If a request is a control not a data request
         virtio_finish_cfg_req(req->src_cpu, value);
     } 
+    lat_record(vdev->id, offs, req->enqueue_ts, start, lat_ticks());
     log_trace("src_zone is %d, src_cpu is %lld", req->src_zone, req->src_cpu);
     return 0;
 }
 
+static void print_poll_stats(int id, struct poll_stats *st) {
+	uint64_t total = st->spin_ns + st->wait_ns + st->sleep_ns + st->handle_ns;
+	if (total == 0)
+		return;
+	log_warn("dispatcher %d, poll policy %d: spin %llums (%llu%%), wait %llums (%llu%%), sleep %llums (%llu%%), "
+			"handle %llums (%llu%%), %llu wakeups, %llu requests", id, poll_policy,
+			st->spin_ns / 1000000, st->spin_ns * 100 / total,
+			st->wait_ns / 1000000, st->wait_ns * 100 / total,
+			st->sleep_ns / 1000000, st->sleep_ns * 100 / total,
+			st->handle_ns / 1000000, st->handle_ns * 100 / total,
+			st->wakeups, st->reqs);
+	if (st->wakeups)
+		log_warn("irq to wakeup latency: avg %lluns, max %lluns",
+				st->wakeup_lat_ns / st->wakeups, st->wakeup_lat_max_ns);
+}
+
+static void print_irq_stats(void) {
+	uint64_t secs = (now_ns() - start_ns) / 1000000000;
+	uint64_t irqs, total = 0, flushes = metrics_sum_global(METRIC_HYPERCALLS);
+	uint64_t stalls = metrics_sum_global(METRIC_RES_FULL);
+	VirtQueue *vq;
+	if (secs == 0)
+		secs = 1;
+	for (int i = 0; i < vdevs_num; i++) {
+		for (uint32_t j = 0; j < vdevs[i]->vqs_len; j++) {
+			vq = &vdevs[i]->vqs[j];
+			irqs = metrics_sum_queue(vdevs[i]->id, j, METRIC_IRQS);
+			total += irqs;
+			if (irqs == 0)
+				continue;
+			log_warn("device %d of zone %d, queue %d: %llu irqs, %llu irqs/s, coalesce %u:%uus",
+					vdevs[i]->type, vdevs[i]->zone_id, j, irqs, irqs / secs,
+					vq->coalesce.count, vq->coalesce.usec);
+		}
+	}
+	if (flushes)
+		log_warn("irq injection: %llu irqs, %llu hypercalls, average batch %llu.%02llu",
+				total, flushes, total / flushes, total * 100 / flushes % 100);
+	if (stalls)
+		log_warn("res list was full %llu times", stalls);
+}
+
 static void virtio_close() {
 	log_info("virtio devices will be closed");
+	for (int i = 0; i < dispatchers_num; i++)
+		print_poll_stats(i, &dispatchers[i].stats);
+	print_irq_stats();
 	destroy_event_monitor();
-	for(int i=0; i<vdevs_num; i++)
+	for(int i=0; i<vdevs_num; i++) {
+		stop_notify_worker(vdevs[i]);
         vdevs[i]->virtio_close(vdevs[i]);
+	}
+	free(vdevs);
+	free(vdev_index);
 	close(ko_fd);
-	munmap((void *)virtio_bridge, MMAP_SIZE);
-	munmap((void *)virt_addr, NON_ROOT_PHYS_SIZE);
+	close(term_fd);
+	close(stop_fd);
+	for (int i = 0; i < dispatchers_num; i++)
+		free(dispatchers[i].rings);
+	free(res_seq);
+	munmap((void *)virtio_bridge, bridge_geometry.size);
+	guest_mem_unmap();
+	if (latency_at_exit)
+		lat_dump(latency_file);
+	if (trace_enabled())
+		trace_stop(trace_file);
+	close(dump_fd);
+	metrics_exit();
 	mutithread_log_exit();
 	log_warn("virtio daemon exit successfully");
 }
 
-void handle_virtio_requests()
-{
-	int sig;
-	sigset_t wait_set;
-	struct timespec timeout;
-    unsigned int req_front = virtio_bridge->req_front;
-    volatile struct device_req *req;
-	timeout.tv_sec = 0;
-	timeout.tv_nsec = WAIT_TIME;
-	sigemptyset(&wait_set);
-	sigaddset(&wait_set, SIGHVI);
-	sigaddset(&wait_set, SIGTERM);
-	virtio_bridge->need_wakeup = 1;
-	
-	int signal_count = 0, proc_count = 0;
-	unsigned long long count = 0;
+static bool dispatcher_rings_empty(struct dispatcher *d)
+{
+	volatile struct device_req_ring *ring;
+	read_barrier();
+	for (int i = 0; i < d->rings_num; i++) {
+		ring = d->rings[i];
+		if (!is_queue_empty(ring->front, ring->rear))
+			return false;
+	}
+	return true;
+}
+
+static void dispatcher_set_wakeup(struct dispatcher *d, int need_wakeup)
+{
+	for (int i = 0; i < d->rings_num; i++)
+		d->rings[i]->need_wakeup = need_wakeup;
+	// hvisor checks need_wakeup after queueing a request, so the rings
+	// must not be checked again before need_wakeup is visible.
+	rw_barrier();
+}
+
+/// Handle every request queued in the rings of d.
+/// \return the number of handled requests.
+static uint64_t dispatcher_drain(struct dispatcher *d)
+{
+	volatile struct device_req_ring *ring;
+	unsigned int front, mask = virtio_bridge->req_depth - 1;
+	uint64_t count = 0;
+	for (int i = 0; i < d->rings_num; i++) {
+		ring = d->rings[i];
+		// Only this dispatcher moves the front of its rings.
+		front = ring->front;
+		read_barrier();
+		while (!is_queue_empty(front, ring->rear)) {
+			virtio_handle_req(&ring->req_list[front]);
+			front = (front + 1) & mask;
+			ring->front = front;
+			write_barrier();
+			count++;
+			read_barrier();
+		}
+	}
+	return count;
+}
+
+/// Sleep until hvisor raises an irq or the daemon is stopping.
+static void park_dispatcher(struct dispatcher *d)
+{
+	struct pollfd fds[2] = {
+		{ .fd = d->wake_fd, .events = POLLIN },
+		{ .fd = stop_fd, .events = POLLIN },
+	};
+	struct hvisor_wakeup wakeup;
+	struct poll_stats *st = &d->stats;
+	uint64_t lat;
+	int ret;
+
+	ret = poll(fds, 2, -1);
+	if (ret < 0) {
+		if (errno != EINTR)
+			log_error("poll hvisor failed, errno is %d", errno);
+		return;
+	}
+	if (fds[0].revents & POLLIN) {
+		if (read(d->wake_fd, &wakeup, sizeof(wakeup)) != sizeof(wakeup))
+			return;
+		st->wakeups++;
+		lat = now_ns() - wakeup.irq_ns;
+		st->wakeup_lat_ns += lat;
+		if (lat > st->wakeup_lat_max_ns)
+			st->wakeup_lat_max_ns = lat;
+	}
+}
+
+/// Spin on the request rings of d for at most budget ns, in low power if low_power is set.
+/// \return true if a new request arrived.
+static bool poll_req_rings(struct dispatcher *d, uint64_t budget, bool low_power)
+{
+	uint64_t start = now_ns(), now;
+	unsigned int i;
 	for (;;) {
-		log_warn("signal_count is %d, proc_count is %d", signal_count, proc_count);
-		sigwait(&wait_set, &sig);
-		sig = SIGHVI;
-		signal_count++;
-		if (sig == SIGTERM) {
-			virtio_close();
+		// Reading the clock is much more expensive than checking the rings.
+		for (i = 0; i < 64; i++) {
+			if (!dispatcher_rings_empty(d)) {
+				now = now_ns();
+				goto out;
+			}
+			if (low_power)
+				cpu_wait();
+			else
+				cpu_relax();
+		}
+		now = now_ns();
+		if (now - start >= budget || stopping)
 			break;
-		} else if (sig != SIGHVI) {
-			log_error("unknown signal %d", sig);
+	}
+out:
+	if (low_power)
+		d->stats.wait_ns += now - start;
+	else
+		d->stats.spin_ns += now - start;
+	return !dispatcher_rings_empty(d);
+}
+
+/// Adapt the spin budget to the average inter-arrival time of requests, so that
+/// a request following the previous burst is likely to be caught by spinning.
+static uint64_t adapt_poll_budget(uint64_t budget, uint64_t *gap_avg, uint64_t gap)
+{
+	*gap_avg = (*gap_avg * 7 + gap) / 8;
+	if (*gap_avg * 2 <= POLL_BUDGET_MAX)
+		budget = *gap_avg * 2;
+	else
+		// Requests are too sparse to be worth spinning for, shrink the budget.
+		budget /= 2;
+	if (budget < POLL_BUDGET_MIN)
+		budget = POLL_BUDGET_MIN;
+	return budget;
+}
+
+static void *dispatcher_loop(void *arg)
+{
+	struct dispatcher *d = arg;
+	struct poll_stats *st = &d->stats;
+	uint64_t t, last_req, budget, gap_avg;
+	bool parked = poll_policy != PollAlways;
+	thread_conf_apply(ThreadDispatcher);
+
+	budget = gap_avg = POLL_BUDGET_INIT;
+	last_req = now_ns();
+	dispatcher_set_wakeup(d, parked);
+	while (!stopping) {
+		if (parked) {
+			// hvisor may have queued a request before need_wakeup was seen.
+			if (dispatcher_rings_empty(d)) {
+				t = now_ns();
+				park_dispatcher(d);
+				st->sleep_ns += now_ns() - t;
+				continue;
+			}
+			parked = false;
+			dispatcher_set_wakeup(d, 0);
+		}
+
+		if (!dispatcher_rings_empty(d)) {
+			t = now_ns();
+			if (poll_policy == PollAdaptive)
+				budget = adapt_poll_budget(budget, &gap_avg, t - last_req);
+			st->reqs += dispatcher_drain(d);
+			virtio_flush_irqs();
+			last_req = now_ns();
+			st->handle_ns += last_req - t;
 			continue;
 		}
-		while(1) {
-			// read_barrier();
-			if (!is_queue_empty(req_front, virtio_bridge->req_rear)) {
-				count = 0;
-				proc_count++;
-				req = &virtio_bridge->req_list[req_front];
-				virtio_bridge->need_wakeup = 0;
-				virtio_handle_req(req);
-				req_front = (req_front + 1) & (MAX_REQ - 1);
-				virtio_bridge->req_front = req_front;
-				write_barrier();
-			} 
-			else {
-				count++;
-				if (count < 10000000) 
-					continue;
-				count = 0;
-				virtio_bridge->need_wakeup = 1;
-				write_barrier();
-				nanosleep(&timeout, NULL);
-				read_barrier();
-				if(is_queue_empty(req_front, virtio_bridge->req_rear)) {
-					break;
-				} 		
-			}
+
+		switch (poll_policy) {
+		case PollAlways:
+			poll_req_rings(d, POLL_BUDGET_MAX, false);
+			break;
+		case PollAdaptive:
+			if (poll_req_rings(d, budget, false) ||
+				poll_req_rings(d, budget >> POLL_WAIT_SHIFT, true))
+				break;
+			// fall through
+		case PollIrq:
+			dispatcher_set_wakeup(d, 1);
+			parked = true;
+			break;
 		}
 	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/// Let irqs wake d up only when one of its rings has requests, not on every irq.
+static void dispatcher_set_wakeup_rings(struct dispatcher *d, int cpus)
+{
+	struct hvisor_wakeup_rings rings;
+	memset(&rings, 0, sizeof(rings));
+	for (int cpu = d->id; cpu < cpus; cpu += dispatchers_num)
+		rings.cpus[cpu / 64] |= 1ULL << (cpu % 64);
+	// every irq still wakes d up, it only costs a scan of its rings
+	if (hvisor_platform->set_wakeup_rings(d->wake_fd, &rings))
+		log_warn("dispatcher %d is woken up by every irq, errno is %d", d->id, errno);
+}
+
+/// Start the dispatcher threads, then wait for SIGTERM in the calling thread.
+/// \return 0 once stopped by SIGTERM, -1 if the dispatchers couldn't be started.
+int handle_virtio_requests()
+{
+	struct signalfd_siginfo info;
+	struct dispatcher *d;
+	uint64_t one = 1;
+	int i, cpus, started = 0, err = -1;
+
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd < 0) {
+		log_error("eventfd failed, errno is %d", errno);
+		goto out;
+	}
+	// Dispatcher i owns the rings of cpu i, i + dispatchers_num, ...
+	cpus = virtio_bridge->cpus;
+	for (i = 0; i < dispatchers_num; i++) {
+		dispatchers[i].rings = calloc(cpus / dispatchers_num + 1, sizeof(*dispatchers[i].rings));
+		if (dispatchers[i].rings == NULL) {
+			log_error("can't allocate the rings of dispatcher %d", i);
+			goto out;
+		}
+	}
+	for (i = 0; i < cpus; i++) {
+		d = &dispatchers[i % dispatchers_num];
+		d->rings[d->rings_num++] = bridge_req_ring(virtio_bridge, i);
+	}
+	for (; started < dispatchers_num; started++) {
+		d = &dispatchers[started];
+		d->id = started;
+		d->wake_fd = hvisor_platform->open();
+		if (d->wake_fd < 0) {
+			log_error("open hvisor failed");
+			goto stop;
+		}
+		dispatcher_set_wakeup_rings(d, cpus);
+		errno = pthread_create(&d->tid, NULL, dispatcher_loop, d);
+		if (errno) {
+			log_error("create dispatcher %d failed, errno is %d", started, errno);
+			close(d->wake_fd);
+			goto stop;
+		}
+	}
+
+	while (read(term_fd, &info, sizeof(info)) != sizeof(info)) {
+		if (errno != EINTR) {
+			log_error("read signalfd failed, errno is %d", errno);
+			break;
+		}
+	}
+	err = 0;
+stop:
+	stopping = 1;
+	// dispatchers parked in poll only see stopping once stop_fd is readable
+	if (write(stop_fd, &one, sizeof(one)) != sizeof(one))
+		log_error("wake up dispatchers failed, errno is %d", errno);
+	for (i = 0; i < started; i++) {
+		pthread_join(dispatchers[i].tid, NULL);
+		close(dispatchers[i].wake_fd);
+	}
+out:
+	virtio_close();
+	return err;
+}
+
+static void dump_handler(int fd, int epoll_type, void *param)
+{
+	struct signalfd_siginfo info;
+	(void)epoll_type;
+	(void)param;
+	while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGUSR1)
+			lat_dump(latency_file);
+		else if (trace_enabled())
+			trace_stop(trace_file);
+		else
+			trace_start();
+	}
 }
 
 int virtio_init()
@@ -736,59 +1919,132 @@ int virtio_init()
     int err;
 	int log_level = LOG_WARN;
 
-	sigset_t block_mask;
+	start_ns = now_ns();
+	sigset_t block_mask, term_mask;
 	sigfillset(&block_mask);
 	pthread_sigmask(SIG_BLOCK, &block_mask, NULL);
+	sigemptyset(&term_mask);
+	sigaddset(&term_mask, SIGTERM);
+	term_fd = signalfd(-1, &term_mask, SFD_CLOEXEC);
+	sigemptyset(&term_mask);
+	sigaddset(&term_mask, SIGUSR1);
+	sigaddset(&term_mask, SIGUSR2);
+	dump_fd = signalfd(-1, &term_mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (term_fd < 0 || dump_fd < 0) {
+		log_error("signalfd failed, errno is %d", errno);
+		exit(1);
+	}
 
 	multithread_log_init();
     log_set_level(log_level);
     FILE *log_file = fopen("log.txt", "w+");
     log_add_fp(log_file, LOG_WARN);
     log_info("hvisor init");
-    ko_fd = open("/dev/hvisor", O_RDWR);
+    ko_fd = hvisor_platform->open();
     if (ko_fd < 0) {
-        log_error("open hvisor failed");
+        log_error("open %s failed", hvisor_platform->name);
         exit(1);
     }
-    // ioctl for init virtio
-    err = ioctl(ko_fd, HVISOR_INIT_VIRTIO);
+    // init virtio, hvisor returns the bridge size of the geometry.
+    err = hvisor_platform->init_virtio(ko_fd, &bridge_geometry);
     if (err) {
-        log_error("ioctl failed, err code is %d", err);
+        if (errno == EPROTO)
+            log_error("the kernel module or hvisor doesn't know the virtio bridge abi %u, update them",
+                    HVISOR_VIRTIO_ABI_VERSION);
+        else if (errno == EINVAL)
+            log_error("the kernel module rejected the bridge geometry, or its struct device_req isn't %zu bytes",
+                    sizeof(struct device_req));
+        log_error("init virtio failed, err code is %d", err);
         close(ko_fd);
         exit(1);
     }
+    res_seq = calloc(bridge_geometry.res_depth, sizeof(*res_seq));
+    log_info("virtio bridge: %u cpus, req depth %u, res depth %u, %u devs, size %#llx",
+            bridge_geometry.cpus, bridge_geometry.req_depth, bridge_geometry.res_depth,
+            bridge_geometry.max_devs, bridge_geometry.size);
 
     // mmap: create shared memory
-    virtio_bridge = (struct virtio_bridge *) mmap(NULL, MMAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ko_fd, 0);
-    if (virtio_bridge == (void *)-1) {
+    virtio_bridge = hvisor_platform->map(ko_fd, NULL, bridge_geometry.size, 0);
+    if (virtio_bridge == MAP_FAILED) {
         log_error("mmap failed");
         goto unmap;
     }
+    // A kernel module older than the negotiation leaves the header zeroed.
+    if (virtio_bridge->magic != HVISOR_VIRTIO_MAGIC ||
+            virtio_bridge->abi_version != HVISOR_VIRTIO_ABI_VERSION) {
+        log_error("the bridge has abi %u, the daemon %u, update the kernel module",
+                virtio_bridge->abi_version, HVISOR_VIRTIO_ABI_VERSION);
+        goto unmap;
+    }
+    if (virtio_bridge->req_size != sizeof(struct device_req)) {
+        log_error("the bridge has %u bytes requests, the daemon %zu bytes, update the kernel module",
+                virtio_bridge->req_size, sizeof(struct device_req));
+        goto unmap;
+    }
 
-	// mmap: map non root linux physical memory to virtual memory
-    phys_addr = (void *)NON_ROOT_PHYS_START;
-    virt_addr = mmap(NULL, NON_ROOT_PHYS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED , ko_fd, (off_t) phys_addr);
-    log_info("mmap virt addr is %#x", virt_addr);
+	// mmap: map non root zones' physical memory to virtual memory
+    if (guest_mem_map(ko_fd)) {
+        guest_mem_unmap();
+        goto unmap;
+    }
+    // Counters stay in the daemon if the segment read by hvisor stat can't be created.
+    if (metrics_init(METRICS_SHM_NAME)) {
+        guest_mem_unmap();
+        goto unmap;
+    }
 
-    initialize_event_monitor();
+    // irqs injected by the event handlers are flushed to hvisor together
+    initialize_event_monitor(virtio_flush_irqs);
+    lat_init();
+    if (add_event(dump_fd, EPOLLIN, dump_handler, NULL) == NULL)
+        log_warn("can't watch SIGUSR1 and SIGUSR2, mmio latency is only written at exit with --latency-file");
+    if (trace_at_start)
+        trace_start();
     log_info("hvisor init okay!");
 	return 0;
 unmap:
-    munmap((void *)virtio_bridge, MMAP_SIZE);
+    munmap((void *)virtio_bridge, bridge_geometry.size);
     return -1;
 }
 
+// Parse "count:usec" of the coalesce option.
+static int parse_coalesce(char *value, struct irq_coalesce *co) {
+	char *end;
+	if (value == NULL)
+		return -1;
+	co->count = strtoul(value, &end, 10);
+	if (*end != ':')
+		return -1;
+	co->usec = strtoul(end + 1, &end, 10);
+	return *end == '\0' ? 0 : -1;
+}
+
+#define MAX_COALESCE_QUEUES 8
+
 static int create_virtio_device_from_cmd(char *cmd) {
 	log_info("cmd is %s", cmd);
 	VirtioDeviceType dev_type = VirtioTNone;
+	VirtIODevice *vdev;
 	uint64_t base_addr = 0, len = 0;
 	uint32_t zone_id = 0, irq_id = 0;
-	char *opt, *now, *arg = NULL;
+	char *opt, *now, *end;
+	void *arg = NULL;
+	struct blk_conf blk = {.engine = BlkEngineThread, .cache = BlkCacheWriteback};
+	// coalesce=count:usec applies to every queue, coalesceN=count:usec to queue N
+	struct irq_coalesce coalesce = {0}, queue_coalesce[MAX_COALESCE_QUEUES];
+	bool queue_coalesce_set[MAX_COALESCE_QUEUES] = {false};
+	unsigned long q;
+	int ret = -1;
 
 	opt = strdup(cmd);
+	if (opt == NULL)
+		return -1;
 	now = strtok(opt, ",");
 
-	if (strcmp(now, "blk") == 0) {
+	if (now == NULL) {
+		log_error("missing device type");
+		goto out;
+	} else if (strcmp(now, "blk") == 0) {
 		dev_type = VirtioTBlock;
 	} else if (strcmp(now, "net") == 0) {
 		dev_type = VirtioTNet;
@@ -796,7 +2052,7 @@ static int create_virtio_device_from_cmd(char *cmd) {
         dev_type = VirtioTConsole;
     } else {
 		log_error("unknown device type %s", now);
-		return -1;
+		goto out;
 	}
 
 	while ((now = strtok(NULL, "=")) != NULL) {
@@ -815,62 +2071,258 @@ static int create_virtio_device_from_cmd(char *cmd) {
 		} else if (strcmp(now, "img") == 0) {
 			if (dev_type != VirtioTBlock) {
 				log_error("image path only for block device");
-				return -1;
+				goto out;
+			}
+			blk.img = strtok(NULL, ",");
+			arg = &blk;
+		} else if (strcmp(now, "engine") == 0) {
+			if (dev_type != VirtioTBlock) {
+				log_error("engine only for block device");
+				goto out;
+			}
+			now = strtok(NULL, ",");
+			if (now != NULL && strcmp(now, "thread") == 0) {
+				blk.engine = BlkEngineThread;
+			} else if (now != NULL && strcmp(now, "io_uring") == 0) {
+				blk.engine = BlkEngineIoUring;
+			} else {
+				log_error("engine should be thread or io_uring");
+				goto out;
+			}
+		} else if (strcmp(now, "cache") == 0) {
+			if (dev_type != VirtioTBlock) {
+				log_error("cache only for block device");
+				goto out;
+			}
+			now = strtok(NULL, ",");
+			if (now != NULL && strcmp(now, "writeback") == 0) {
+				blk.cache = BlkCacheWriteback;
+			} else if (now != NULL && strcmp(now, "writethrough") == 0) {
+				blk.cache = BlkCacheWritethrough;
+			} else if (now != NULL && strcmp(now, "none") == 0) {
+				blk.cache = BlkCacheNone;
+			} else {
+				log_error("cache should be none, writeback or writethrough");
+				goto out;
 			}
-			arg = strtok(NULL, ",");
 		} else if (strcmp(now, "tap") == 0) {
 			if (dev_type != VirtioTNet) {
 				log_error("tap only for net device");
-				return -1;
+				goto out;
 			}
 			arg = strtok(NULL, ",");
+		} else if (strcmp(now, "coalesce") == 0) {
+			if (parse_coalesce(strtok(NULL, ","), &coalesce)) {
+				log_error("coalesce should be count:usec");
+				goto out;
+			}
+		} else if (strncmp(now, "coalesce", 8) == 0) {
+			q = strtoul(now + 8, &end, 10);
+			if (*end != '\0' || q >= MAX_COALESCE_QUEUES ||
+					parse_coalesce(strtok(NULL, ","), &queue_coalesce[q])) {
+				log_error("coalesce of a queue should be coalesceN=count:usec");
+				goto out;
+			}
+			queue_coalesce_set[q] = true;
 		} else {
 			log_error("unknown option %s", now);
-			return -1;
+			goto out;
 		}
 	}
-	free(opt);
 
-	if (base_addr == 0 || len == 0 || irq_id == 0 || zone_id == 0) {
+	if (base_addr == 0 || len == 0 || irq_id == 0 || zone_id == 0 ||
+			(dev_type == VirtioTBlock && blk.img == NULL)) {
 		log_error("missing arguments");
-		return -1;
+		goto out;
+	}
+	// arg points into opt, so opt is freed after the device is created.
+	vdev = create_virtio_device(dev_type, zone_id, base_addr, len, irq_id, arg);
+	if (vdev == NULL)
+		goto out;
+	for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+		if (virtqueue_set_coalesce(&vdev->vqs[i],
+				i < MAX_COALESCE_QUEUES && queue_coalesce_set[i] ? &queue_coalesce[i] : &coalesce))
+			goto out;
+	}
+	for (q = vdev->vqs_len; q < MAX_COALESCE_QUEUES; q++) {
+		if (queue_coalesce_set[q])
+			log_warn("device %d has no queue %lu to coalesce", dev_type, q);
+	}
+	ret = 0;
+out:
+	free(opt);
+	return ret;
+}
+
+static bool is_pow2(uint32_t value) {
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+// parse "cpus=16,req_depth=32,res_depth=32,devs=4"
+static int parse_bridge_geometry(char *arg) {
+	char *now;
+	uint32_t value;
+	for (now = strtok(arg, "="); now != NULL; now = strtok(NULL, "=")) {
+		char *key = now;
+		now = strtok(NULL, ",");
+		if (now == NULL) {
+			log_error("missing value of %s", key);
+			return -1;
+		}
+		value = strtoul(now, NULL, 0);
+		if (strcmp(key, "cpus") == 0 && value > 0 && value <= MAX_CPUS) {
+			bridge_geometry.cpus = value;
+		} else if (strcmp(key, "req_depth") == 0 && is_pow2(value) && value <= MAX_REQ_DEPTH) {
+			bridge_geometry.req_depth = value;
+		} else if (strcmp(key, "res_depth") == 0 && is_pow2(value) && value <= MAX_REQ_DEPTH) {
+			bridge_geometry.res_depth = value;
+		} else if (strcmp(key, "devs") == 0 && value > 0 && value <= MAX_DEVS) {
+			bridge_geometry.max_devs = value;
+		} else {
+			log_error("invalid bridge option %s=%s", key, now);
+			return -1;
+		}
 	}
-	create_virtio_device(dev_type, zone_id, base_addr, len, irq_id, arg);
 	return 0;
 }
 
 int virtio_start(int argc, char *argv[]) {
 	static struct option long_options[] = {
 		{"device", required_argument, 0, 'd'},	
+		{"poll", required_argument, 0, 'p'},
+		{"threads", required_argument, 0, 't'},
+		{"bridge", required_argument, 0, 'b'},
+		{"irq-batch", required_argument, 0, 'i'},
+		{"memory", required_argument, 0, 'm'},
+		{"prefault", no_argument, 0, 'f'},
+		{"affinity", required_argument, 0, 'a'},
+		{"sched", required_argument, 0, 's'},
+		{"mlock", no_argument, 0, 'l'},
+		{"latency-file", required_argument, 0, 'L'},
+		{"trace", no_argument, 0, 'T'},
+		{"trace-file", required_argument, 0, 'F'},
 		{0, 0, 0, 0},
 	};
-	char *optstring = "d:";
-	int opt, err = 0;
-	virtio_init();
+	char *optstring = "d:p:t:b:i:m:fa:s:lL:TF:";
+	char **dev_cmds;
+	int opt, err = 0, dev_cmds_num = 0;
+	bool mlock_all = false;
+	dev_cmds = calloc(argc, sizeof(char *));
+	// The bridge geometry must be known before virtio_init, so devices are created afterwards.
 	while ( (opt = getopt_long(argc, argv, optstring, long_options, NULL)) != -1) {
 		switch (opt) {
 			case 'd':
-				err = create_virtio_device_from_cmd(optarg);
-				if (err) {
-					log_error("create virtio device failed");
-					goto err_out;
+				dev_cmds[dev_cmds_num++] = optarg;
+				break;
+			case 'p':
+				if (strcmp(optarg, "always") == 0) {
+					poll_policy = PollAlways;
+				} else if (strcmp(optarg, "adaptive") == 0) {
+					poll_policy = PollAdaptive;
+				} else if (strcmp(optarg, "irq") == 0) {
+					poll_policy = PollIrq;
+				} else {
+					log_error("unknown poll policy %s", optarg);
+					goto err_args;
+				}
+				break;
+			case 't':
+				dispatchers_num = strtoul(optarg, NULL, 10);
+				if (dispatchers_num < 1 || dispatchers_num > MAX_CPUS) {
+					log_error("dispatcher threads should be in [1, %d]", MAX_CPUS);
+					goto err_args;
+				}
+				break;
+			case 'b':
+				if (parse_bridge_geometry(optarg))
+					goto err_args;
+				break;
+			case 'm':
+				if (guest_mem_parse_region(optarg))
+					goto err_args;
+				break;
+			case 'f':
+				guest_mem_set_prefault(1);
+				break;
+			case 'a':
+				if (thread_conf_parse_affinity(optarg))
+					goto err_args;
+				break;
+			case 's':
+				if (thread_conf_parse_sched(optarg))
+					goto err_args;
+				break;
+			case 'l':
+				mlock_all = true;
+				break;
+			case 'L':
+				latency_file = optarg;
+				latency_at_exit = true;
+				break;
+			case 'T':
+				trace_at_start = true;
+				break;
+			case 'F':
+				trace_file = optarg;
+				break;
+			case 'i':
+				if (strcmp(optarg, "on") == 0) {
+					irq_batching = true;
+				} else if (strcmp(optarg, "off") == 0) {
+					irq_batching = false;
+				} else {
+					log_error("irq-batch should be on or off");
+					goto err_args;
 				}
 				break;
 			default:
 				log_error("unknown option %c", opt);
-				goto err_out;
+				goto err_args;
+		}
+	}
+	if ((uint32_t)dispatchers_num > bridge_geometry.cpus)
+		dispatchers_num = bridge_geometry.cpus;
+	// hvisor finds a device by its mmio address in the bridge, each device needs a slot.
+	if ((uint32_t)dev_cmds_num > bridge_geometry.max_devs) {
+		if (dev_cmds_num > MAX_DEVS) {
+			log_error("%d devices, the bridge holds at most %d", dev_cmds_num, MAX_DEVS);
+			goto err_args;
 		}
+		log_info("bridge devs grown from %u to %d", bridge_geometry.max_devs, dev_cmds_num);
+		bridge_geometry.max_devs = dev_cmds_num;
+	}
+	// before any thread or mapping is created, so that all of them are locked
+	if (mlock_all && thread_conf_mlock())
+		goto err_args;
+
+	if (virtio_init())
+		goto err_args;
+	for (int i = 0; i < dev_cmds_num; i++) {
+		err = create_virtio_device_from_cmd(dev_cmds[i]);
+		if (err) {
+			log_error("create virtio device failed");
+			goto err_out;
+		}
+	}
+	free(dev_cmds);
+	if ((uint32_t)vdevs_num > virtio_bridge->max_devs) {
+		log_error("the bridge records the mmio addresses of %u devices, not %d",
+				virtio_bridge->max_devs, vdevs_num);
+		err = -1;
+		goto err_out;
 	}
 	for (int i=0; i<vdevs_num; i++) {
-		virtio_bridge->mmio_addrs[i] = vdevs[i]->base_addr;	
+		bridge_mmio_addrs(virtio_bridge)[i] = vdevs[i]->base_addr;	
 	}
 	write_barrier();
 	virtio_bridge->mmio_avail = 1;
 	write_barrier();
-    handle_virtio_requests();
-	return 0;
+    return handle_virtio_requests();
 err_out:
+	free(dev_cmds);
 	virtio_close();
 	return err;
+err_args:
+	free(dev_cmds);
+	return -1;
 }
-
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "virtio_blk.h"
 #include "virtio.h"
 #include <stdlib.h>
@@ -5,11 +6,19 @@
 #include <sys/param.h>
 #include <errno.h>
 #include "log.h"
+#include "thread_conf.h"
+#include "guest_mem.h"
 #include <fcntl.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 
-static void complete_block_operation(BlkDev *dev, struct blkp_req *req, VirtQueue *vq, int err, ssize_t written_len) {
+TAILQ_HEAD(blkp_queue, blkp_req);
+
+// Write the status of a request, return its used len.
+static uint32_t complete_block_operation(struct blkp_req *req, int err, ssize_t written_len) {
     uint8_t *vstatus = (uint8_t *)(req->iov[req->iovcnt-1].iov_base);
-	int is_empty = 0;
     if (err == EOPNOTSUPP)
         *vstatus = VIRTIO_BLK_S_UNSUPP;
     else if (err != 0) 
@@ -17,56 +26,164 @@ static void complete_block_operation(BlkDev *dev, struct blkp_req *req, VirtQueu
     else 
         *vstatus = VIRTIO_BLK_S_OK;
     if (err != 0) {
-        log_error("virt blk err, num is %d", err);
+        log_error_ratelimited("virt blk err, num is %d", err);
     }
-    update_used_ring(vq, req->idx, written_len + 1);
-    pthread_mutex_lock(&dev->mtx);
-	is_empty = TAILQ_EMPTY(&dev->procq);
-	pthread_mutex_unlock(&dev->mtx);
-	if (is_empty)
-		virtio_inject_irq(vq);
-	free(req->iov);
-    free(req);
-}
-// get a blk req from procq
-static int get_breq(BlkDev *dev, struct blkp_req **req) {
-    struct blkp_req *elem;
-    elem = TAILQ_FIRST(&dev->procq);
-    if (elem == NULL) {
+    return written_len + 1;
+}
+
+// O_DIRECT alignment when the kernel doesn't report it.
+#define BLK_DIO_ALIGN_DEFAULT 4096
+// A larger bounce buffer is freed once its request completes.
+#define BLK_BOUNCE_KEEP (64UL << 10)
+
+static inline bool blk_dio_aligned(BlkDev *dev, void *base, size_t len)
+{
+    return len == 0 || (!dev->dio_bounce_all &&
+            (uintptr_t)base % dev->dio_mem_align == 0 && len % dev->dio_align == 0);
+}
+
+// Give the guest's data segments of req to the kernel in iovs that O_DIRECT accepts. A run of
+// segments starting at a misaligned one is copied to the bounce buffer of req, until the run
+// ends on an aligned length. \return the number of iovs in req->dio_iov, 0 if iov needs no bounce.
+static int blk_dio_bounce(BlkDev *dev, struct blkp_req *req)
+{
+    struct iovec *seg = &req->iov[1], *dio;
+    int n = req->iovcnt - 2, i, k;
+    size_t run, need = 0, off;
+    void *buf;
+
+    for (i = 0; i < n; ) {
+        if (blk_dio_aligned(dev, seg[i].iov_base, seg[i].iov_len)) {
+            i++;
+            continue;
+        }
+        for (run = 0; i < n && (run == 0 || run % dev->dio_align); i++)
+            run += seg[i].iov_len;
+        need += run;
+    }
+    if (need == 0)
         return 0;
+    if (req->bounce_size < need) {
+        free(req->bounce);
+        req->bounce_size = 0;
+        if (posix_memalign(&buf, MAX(dev->dio_mem_align, dev->dio_align), need))
+            return -1;
+        req->bounce = buf;
+        req->bounce_size = need;
+    }
+    if (req->dio_iov == NULL) {
+        req->dio_iov = malloc(BLK_SEG_MAX * sizeof(struct iovec));
+        if (req->dio_iov == NULL)
+            return -1;
+    }
+    dio = req->dio_iov;
+    for (i = 0, k = 0, off = 0; i < n; k++) {
+        if (blk_dio_aligned(dev, seg[i].iov_base, seg[i].iov_len)) {
+            dio[k] = seg[i++];
+            continue;
+        }
+        dio[k].iov_base = req->bounce + off;
+        for (run = 0; i < n && (run == 0 || run % dev->dio_align); run += seg[i++].iov_len) {
+            if (req->type == VIRTIO_BLK_T_OUT)
+                memcpy(req->bounce + off + run, seg[i].iov_base, seg[i].iov_len);
+        }
+        dio[k].iov_len = run;
+        off += run;
+    }
+    return k;
+}
+
+static inline bool blk_is_bounce(struct blkp_req *req, struct iovec *iov)
+{
+    return (char *)iov->iov_base >= req->bounce && (char *)iov->iov_base < req->bounce + req->bounce_size;
+}
+
+// The fd a read or write of req is done on, and the iovs with its data in *iov and *iovcnt.
+// \return -1 if the bounce buffer can't be allocated.
+static int blk_io_prepare(BlkDev *dev, struct blkp_req *req, struct iovec **iov, int *iovcnt)
+{
+    uint64_t len = 0;
+    *iov = &req->iov[1];
+    *iovcnt = req->iovcnt - 2;
+    req->dio_iovcnt = 0;
+    if (dev->cache != BlkCacheNone)
+        return dev->img_fd;
+    for (int i = 0; i < *iovcnt; i++)
+        len += (*iov)[i].iov_len;
+    // nothing in memory can align an unaligned file range, it goes through the page cache
+    if (req->offset % dev->dio_align || len % dev->dio_align)
+        return dev->buffered_fd;
+    req->dio_iovcnt = blk_dio_bounce(dev, req);
+    if (req->dio_iovcnt < 0) {
+        log_error_ratelimited("can't allocate a blk bounce buffer of request %d", req->idx);
+        req->dio_iovcnt = 0;
+        return -1;
+    }
+    if (req->dio_iovcnt > 0) {
+        *iov = req->dio_iov;
+        *iovcnt = req->dio_iovcnt;
+    }
+    return dev->img_fd;
+}
+
+// Copy what a read put in the bounce buffer of req to the guest's segments.
+static void blk_io_finish(struct blkp_req *req)
+{
+    struct iovec *seg = &req->iov[1], *dio;
+    int i = 0;
+    size_t off;
+    if (req->dio_iovcnt == 0)
+        return;
+    for (int k = 0; k < req->dio_iovcnt; k++) {
+        dio = &req->dio_iov[k];
+        if (!blk_is_bounce(req, dio)) {
+            i++;
+            continue;
+        }
+        for (off = 0; off < dio->iov_len; off += seg[i++].iov_len) {
+            if (req->type == VIRTIO_BLK_T_IN)
+                memcpy(seg[i].iov_base, (char *)dio->iov_base + off, seg[i].iov_len);
+        }
+    }
+    req->dio_iovcnt = 0;
+    if (req->bounce_size > BLK_BOUNCE_KEEP) {
+        free(req->bounce);
+        req->bounce = NULL;
+        req->bounce_size = 0;
     }
-    TAILQ_REMOVE(&dev->procq, elem, link);
-    *req = elem;
-    return 1;
 }
 
-static void blkproc(BlkDev *dev, struct blkp_req *req, VirtQueue *vq) {
-    struct iovec *iov = req->iov;
-    int n = req->iovcnt, err = 0;
+static uint32_t blkproc(BlkDev *dev, struct blkp_req *req) {
+    struct iovec *iov = req->iov, *data;
+    int err = 0, fd, datacnt;
     ssize_t len, written_len = 0; 
 	
     switch (req->type)
     {
     case VIRTIO_BLK_T_IN:
-        written_len = len = preadv(dev->img_fd, &iov[1], n - 2, req->offset);
-        // log_debug("readv data is ");
-        // for(int i = 1; i < n-1; i++) {
-        //     log_debug("n-1 is %d, iov[i].iov_len is %d", n-1, iov[i].iov_len);
-        //     for (int j = 0; j < iov[i].iov_len; j++) 
-        //         printf("%x", *(int*)(iov[i].iov_base + j));
-        //     printf("\n");
-        // }
+        fd = blk_io_prepare(dev, req, &data, &datacnt);
+        written_len = len = fd < 0 ? -1 : preadv(fd, data, datacnt, req->offset);
 		log_debug("preadv, len is %d, offset is %d", len, req->offset);
         if (len < 0) {
-            log_error("pread failed");
-            err = errno;
+            log_error_ratelimited("pread failed");
+            err = fd < 0 ? ENOMEM : errno;
         }
+        blk_io_finish(req);
         break;
     case VIRTIO_BLK_T_OUT:
-        len = pwritev(dev->img_fd, &iov[1], n-2, req->offset);
+        fd = blk_io_prepare(dev, req, &data, &datacnt);
+        len = fd < 0 ? -1 : pwritev(fd, data, datacnt, req->offset);
 		log_debug("pwritev, len is %d, offset is %d", len, req->offset);
         if (len < 0) {
-            log_error("pwrite failed");
+            log_error_ratelimited("pwrite failed");
+            err = fd < 0 ? ENOMEM : errno;
+        }
+        blk_io_finish(req);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        // every write completed before the flush reaches the disk
+        if (fdatasync(dev->img_fd)) {
+            log_error_ratelimited("fdatasync failed");
             err = errno;
         }
         break;
@@ -81,7 +198,7 @@ static void blkproc(BlkDev *dev, struct blkp_req *req, VirtQueue *vq) {
         err = EOPNOTSUPP;
         break;
     }
-    complete_block_operation(dev, req, vq, err, written_len);
+    return complete_block_operation(req, err, written_len);
 }
 
 // Every virtio-blk has a blkproc_thread that is used for reading and writing.
@@ -89,15 +206,34 @@ static void *blkproc_thread(void *arg)
 {
     VirtIODevice *vdev = arg;
     BlkDev *dev = vdev->dev;
+    VirtQueue *vq = vdev->vqs;
     struct blkp_req *breq;
-    // get_breq will access the critical section, so lock it.
+    VirtqUsedElem used[BLK_BATCH];
+    int nused;
+    TAILQ_HEAD(, blkp_req) procq;
+    TAILQ_INIT(&procq);
+    thread_conf_apply(ThreadBlk);
+    // procq is the critical section, so lock it.
     pthread_mutex_lock(&dev->mtx);
     
     for (;;) {
-        while (get_breq(dev, &breq)) {
-            // blk_proc don't access the critical section, so unlock.
+        while (!TAILQ_EMPTY(&dev->procq)) {
+            // Take all the queued requests, and complete them with one used idx update.
+            TAILQ_CONCAT(&procq, &dev->procq, link);
             pthread_mutex_unlock(&dev->mtx);
-            blkproc(dev, breq, vdev->vqs);
+            nused = 0;
+            while ((breq = TAILQ_FIRST(&procq)) != NULL) {
+                TAILQ_REMOVE(&procq, breq, link);
+                used[nused].id = breq->idx;
+                used[nused].len = blkproc(dev, breq);
+                // breq belongs to the driver again once it is used
+                if (++nused == BLK_BATCH) {
+                    update_used_ring_batch(vq, used, nused);
+                    nused = 0;
+                }
+            }
+            update_used_ring_batch(vq, used, nused);
+            virtio_inject_irq(vq);
             pthread_mutex_lock(&dev->mtx);
         }
 
@@ -105,42 +241,232 @@ static void *blkproc_thread(void *arg)
 			pthread_mutex_unlock(&dev->mtx);
             break;
 		}
-        pthread_cond_wait(&dev->cond, &dev->mtx);
+        // Don't hold the lock over the hypercall, notify handlers are waiting for it.
+        pthread_mutex_unlock(&dev->mtx);
+        virtio_flush_irqs();
+        pthread_mutex_lock(&dev->mtx);
+        if (TAILQ_EMPTY(&dev->procq) && !dev->close)
+            pthread_cond_wait(&dev->cond, &dev->mtx);
     }
     pthread_exit(NULL);
     return NULL;
 }
 
 
+// The ring can't complete requests anymore, fail those in flight so that the driver
+// doesn't wait for them forever. The kernel may still use their buffers.
+static void blk_uring_fail(VirtIODevice *vdev)
+{
+    BlkDev *dev = vdev->dev;
+    VirtQueue *vq = vdev->vqs;
+    struct blkp_req *breq;
+    VirtqUsedElem used[BLK_BATCH];
+    int nused = 0;
+    pthread_mutex_lock(&dev->mtx);
+    dev->uring_failed = true;
+    for (int i = 0; i < VIRTQUEUE_BLK_MAX_SIZE; i++) {
+        breq = &dev->reqs[i];
+        if (!breq->in_uring)
+            continue;
+        breq->in_uring = false;
+        // the bounce buffer is kept, the kernel may still write to it
+        breq->dio_iovcnt = 0;
+        __atomic_fetch_sub(&dev->inflight, 1, __ATOMIC_RELEASE);
+        used[nused].id = breq->idx;
+        used[nused].len = complete_block_operation(breq, EIO, 0);
+        if (++nused == BLK_BATCH) {
+            update_used_ring_batch(vq, used, nused);
+            nused = 0;
+        }
+    }
+    pthread_mutex_unlock(&dev->mtx);
+    update_used_ring_batch(vq, used, nused);
+    virtio_inject_irq(vq);
+    virtio_flush_irqs();
+}
+
+// Reap the completions of the io_uring engine, and put them into the used ring in batches.
+static void *blk_uring_thread(void *arg)
+{
+    VirtIODevice *vdev = arg;
+    BlkDev *dev = vdev->dev;
+    VirtQueue *vq = vdev->vqs;
+    struct io_uring_cqe *cqe;
+    struct blkp_req *breq;
+    VirtqUsedElem used[BLK_BATCH];
+    int nused, ndone, err;
+    bool closing = false;
+    thread_conf_apply(ThreadBlk);
+
+    // The kernel may still write to the requests of the ring after the stop nop
+    // completes, so wait for them before the device frees it.
+    while (!closing || __atomic_load_n(&dev->inflight, __ATOMIC_ACQUIRE) > 0) {
+        err = uring_wait(&dev->ring);
+        // a full cq (EBUSY) is only emptied by reaping it, so keep going
+        if (err < 0 && err != -EINTR && err != -EAGAIN && err != -EBUSY) {
+            log_error("wait for blk completions failed, errno is %d, failing the requests in flight", -err);
+            blk_uring_fail(vdev);
+            break;
+        }
+        nused = ndone = 0;
+        while ((cqe = uring_peek_cqe(&dev->ring)) != NULL) {
+            breq = (struct blkp_req *)(uintptr_t)cqe->user_data;
+            // the nop of virtio_blk_close has no request
+            if (breq == NULL) {
+                closing = true;
+            } else {
+                if (cqe->res < 0)
+                    log_error_ratelimited("blk %s failed, errno is %d", breq->type == VIRTIO_BLK_T_IN ? "read" :
+                            breq->type == VIRTIO_BLK_T_OUT ? "write" : "flush", -cqe->res);
+                blk_io_finish(breq);
+                breq->in_uring = false;
+                __atomic_fetch_sub(&dev->inflight, 1, __ATOMIC_RELEASE);
+                used[nused].id = breq->idx;
+                used[nused].len = complete_block_operation(breq, cqe->res < 0 ? -cqe->res : 0,
+                        breq->type == VIRTIO_BLK_T_IN && cqe->res > 0 ? cqe->res : 0);
+                ndone++;
+                if (++nused == BLK_BATCH) {
+                    update_used_ring_batch(vq, used, nused);
+                    nused = 0;
+                }
+            }
+            uring_cqe_seen(&dev->ring);
+        }
+        if (ndone == 0)
+            continue;
+        update_used_ring_batch(vq, used, nused);
+        virtio_inject_irq(vq);
+        // the ring is drained, so inject now like blkproc_thread does when idle
+        virtio_flush_irqs();
+    }
+    pthread_exit(NULL);
+    return NULL;
+}
+
 // create blk dev.
 BlkDev *init_blk_dev(VirtIODevice *vdev)
 {
-    BlkDev *dev = malloc(sizeof(BlkDev));
+    BlkDev *dev = calloc(1, sizeof(BlkDev));
+    (void)vdev;
+    if (dev == NULL)
+        return NULL;
+    dev->reqs = calloc(VIRTQUEUE_BLK_MAX_SIZE, sizeof(struct blkp_req));
+    if (dev->reqs == NULL) {
+        log_error("failed to allocate the requests of blk");
+        free(dev);
+        return NULL;
+    }
     dev->config.capacity = -1;
     dev->config.size_max = -1;
     dev->config.seg_max = BLK_SEG_MAX;
     dev->img_fd = -1;
+    dev->buffered_fd = -1;
     dev->close = 0;
 	// TODO: chang to thread poll
     pthread_mutex_init(&dev->mtx, NULL);
     pthread_cond_init(&dev->cond, NULL);
     TAILQ_INIT(&dev->procq);
-    pthread_create(&dev->tid, NULL, blkproc_thread, vdev);
     return dev;
 }
 
-int virtio_blk_init(VirtIODevice *vdev, const char *img_path) {
-    int img_fd = open(img_path, O_RDWR);
+// The kernel takes at most 1GiB in one fixed buffer.
+#define BLK_FIXED_BUF_MAX (1UL << 30)
+
+// Register the guest memory of the device's zone as fixed buffers, so that the
+// kernel doesn't pin the pages of every request. The memory of the kernel module
+// can't be pinned on some platforms, then every request is a readv or writev.
+static void blk_register_guest_mem(VirtIODevice *vdev)
+{
+    BlkDev *dev = vdev->dev;
+    struct guest_mem_region *regions;
+    struct iovec *bufs;
+    uint64_t off, len;
+    int i, n, err;
+
+    n = guest_mem_regions(vdev->zone_id, &regions);
+    for (i = 0; i < n; i++) {
+        for (off = 0; regions[i].hva != NULL && off < regions[i].size; off += len) {
+            len = MIN(regions[i].size - off, BLK_FIXED_BUF_MAX);
+            bufs = realloc(dev->bufs, (dev->bufs_num + 1) * sizeof(struct iovec));
+            if (bufs == NULL) {
+                log_warn("can't allocate the fixed buffers of io_uring, blk uses readv and writev");
+                goto out;
+            }
+            dev->bufs = bufs;
+            dev->bufs[dev->bufs_num].iov_base = (char *)regions[i].hva + off;
+            dev->bufs[dev->bufs_num++].iov_len = len;
+        }
+    }
+    if (dev->bufs_num == 0)
+        return;
+    err = uring_register_buffers(&dev->ring, dev->bufs, dev->bufs_num);
+    if (err == 0)
+        return;
+    log_warn("can't register guest memory with io_uring, errno is %d, blk uses readv and writev", -err);
+out:
+    free(dev->bufs);
+    dev->bufs = NULL;
+    dev->bufs_num = 0;
+}
+
+// Find the alignment O_DIRECT needs on the image.
+static void blk_dio_init_align(BlkDev *dev, struct stat *st)
+{
+    int sector_size;
+    dev->dio_mem_align = dev->dio_align = BLK_DIO_ALIGN_DEFAULT;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(dev->img_fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+            (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align != 0) {
+        dev->dio_mem_align = stx.stx_dio_mem_align;
+        dev->dio_align = stx.stx_dio_offset_align;
+        return;
+    }
+#endif
+    if (S_ISBLK(st->st_mode) && ioctl(dev->img_fd, BLKSSZGET, &sector_size) == 0)
+        dev->dio_mem_align = dev->dio_align = sector_size;
+}
+
+// Direct I/O pins the pages of the buffer, which fails on memory the kernel can't pin,
+// like the VM_PFNMAP mapping of the kernel module. Decide it from the mappings of the
+// device's zone, the guest may be running already when the daemon is restarted.
+static void blk_dio_probe(VirtIODevice *vdev)
+{
+    BlkDev *dev = vdev->dev;
+    struct guest_mem_region *regions;
+    int i, n, pinnable = 1;
+
+    n = guest_mem_regions(vdev->zone_id, &regions);
+    for (i = 0; i < n && pinnable == 1; i++) {
+        if (regions[i].hva != NULL)
+            pinnable = guest_mem_pinnable(regions[i].hva, regions[i].size);
+    }
+    if (pinnable != 1) {
+        dev->dio_bounce_all = true;
+        log_warn("direct I/O into guest memory %s, every blk data segment is bounced",
+                pinnable == 0 ? "can't pin its pages" : "is untested");
+    }
+}
+
+static const int blk_cache_flags[] = {
+    [BlkCacheWriteback] = O_RDWR,
+    [BlkCacheWritethrough] = O_RDWR | O_DSYNC,
+    [BlkCacheNone] = O_RDWR | O_DIRECT,
+};
+
+int virtio_blk_init(VirtIODevice *vdev, const struct blk_conf *conf) {
+    int img_fd = open(conf->img, blk_cache_flags[conf->cache]);
     BlkDev *dev = vdev->dev;
     struct stat st;
     uint64_t blk_size;
+    int err;
     if (img_fd == -1) {
-        log_error("cannot open %s, Error code is %d\n", img_path, errno);
+        log_error("cannot open %s, Error code is %d\n", conf->img, errno);
         close(img_fd);
         return -1;
     }
     if (fstat(img_fd, &st) == -1) {
-        log_error("cannot stat %s, Error code is %d\n", img_path, errno);
+        log_error("cannot stat %s, Error code is %d\n", conf->img, errno);
         close(img_fd);
         return -1;
     }
@@ -148,39 +474,77 @@ int virtio_blk_init(VirtIODevice *vdev, const char *img_path) {
     dev->config.capacity = blk_size;
     dev->config.size_max = blk_size;
     dev->img_fd = img_fd;
+    dev->engine = conf->engine;
+    dev->cache = conf->cache;
+    if (dev->cache == BlkCacheNone) {
+        dev->buffered_fd = open(conf->img, O_RDWR);
+        if (dev->buffered_fd == -1) {
+            log_error("cannot open %s, Error code is %d\n", conf->img, errno);
+            close(img_fd);
+            return -1;
+        }
+        blk_dio_init_align(dev, &st);
+        blk_dio_probe(vdev);
+        // the guest sends aligned requests once it knows the block size
+        if (dev->dio_align > SECTOR_BSIZE) {
+            dev->config.blk_size = dev->dio_align;
+            vdev->regs.dev_feature |= 1ULL << VIRTIO_BLK_F_BLK_SIZE;
+        }
+        log_info("%s: O_DIRECT needs memory aligned to %u and offsets to %u",
+                conf->img, dev->dio_mem_align, dev->dio_align);
+    }
+    if (dev->engine == BlkEngineIoUring) {
+        // every request in flight has its own head, so the queue size bounds a batch
+        err = uring_init(&dev->ring, VIRTQUEUE_BLK_MAX_SIZE);
+        if (err < 0) {
+            log_error("cannot create io_uring for %s, errno is %d", conf->img, -err);
+            close(img_fd);
+            if (dev->buffered_fd >= 0)
+                close(dev->buffered_fd);
+            return -1;
+        }
+        blk_register_guest_mem(vdev);
+        pthread_create(&dev->tid, NULL, blk_uring_thread, vdev);
+    } else {
+        pthread_create(&dev->tid, NULL, blkproc_thread, vdev);
+    }
     vdev->virtio_close = virtio_blk_close;
     return 0;
 }
 
-// handle one descriptor list
-static struct blkp_req* virtq_blk_handle_one_request(VirtQueue *vq)
+// handle one descriptor list, a malformed one returns NULL and must be completed with len 0.
+static struct blkp_req* virtq_blk_handle_one_request(BlkDev *dev, VirtqElem *elem)
 {
 	log_debug("virtq_blk_handle_one_request enter");
     struct blkp_req *breq;
-    struct iovec *iov = NULL;
-    uint16_t *flags;
-    int i, n;
+    struct iovec *iov = elem->iov;
+    uint16_t *flags = elem->flags;
+    uint16_t idx = elem->idx;
+    int i, n = elem->n;
     BlkReqHead *hdr;
-    breq = malloc(sizeof(struct blkp_req));
-    n = process_descriptor_chain(vq, &breq->idx, &iov, &flags, 0);
+    if (n < 0)
+        return NULL;
+    // The head is in flight until it is put into the used ring, so is its request.
+    breq = &dev->reqs[idx];
+    breq->idx = idx;
 	breq->iov = iov;
     if (n < 2 || n > BLK_SEG_MAX + 2) {
-        log_error("iov's num is wrong, n is %d", n);
+        log_error_ratelimited("iov's num is wrong, n is %d", n);
         goto err_out;
     }
 
     if ((flags[0] & VRING_DESC_F_WRITE) != 0) {
-        log_error("virt queue's desc chain header should not be writable!");
+        log_error_ratelimited("virt queue's desc chain header should not be writable!");
         goto err_out;
     }
 
     if (iov[0].iov_len != sizeof(BlkReqHead)) {
-        log_error("the size of blk header is %d, it should be %d!", iov[0].iov_len, sizeof(BlkReqHead));
+        log_error_ratelimited("the size of blk header is %d, it should be %d!", iov[0].iov_len, sizeof(BlkReqHead));
 		goto err_out;
     }
 
     if(iov[n-1].iov_len != 1 || ((flags[n-1] & VRING_DESC_F_WRITE) == 0)) {
-        log_error("status iov is invalid!, status len is %d, flag is %d, n is %d", iov[n-1].iov_len, flags[n-1], n);
+        log_error_ratelimited("status iov is invalid!, status len is %d, flag is %d, n is %d", iov[n-1].iov_len, flags[n-1], n);
 		goto err_out;
     }
 
@@ -192,39 +556,177 @@ static struct blkp_req* virtq_blk_handle_one_request(VirtQueue *vq)
 
     for (i=1; i<n-1; i++) 
         if (((flags[i] & VRING_DESC_F_WRITE) == 0) != (breq->type == VIRTIO_BLK_T_OUT)) {
-            log_error("flag is conflict with operation");
+            log_error_ratelimited("flag is conflict with operation");
 			goto err_out;
         }
-
-    free(flags);
-	return breq;
+    return breq;
 
 err_out:
-	free(flags);
-	free(iov);
-    free(breq);
 	return NULL;
 }
 
+// The registered buffer holding [base, base + len), -1 if there is none.
+static int blk_fixed_buf(BlkDev *dev, void *base, size_t len)
+{
+    char *start;
+    for (int i = 0; i < dev->bufs_num; i++) {
+        start = dev->bufs[i].iov_base;
+        if ((char *)base >= start && len <= dev->bufs[i].iov_len &&
+                (size_t)((char *)base - start) <= dev->bufs[i].iov_len - len)
+            return i;
+    }
+    return -1;
+}
+
+// Fill sqe with the io of a read or write request, done on fd with data prepared by blk_io_prepare.
+static void blk_uring_prep(BlkDev *dev, struct io_uring_sqe *sqe, struct blkp_req *req,
+        int fd, struct iovec *data, int datacnt)
+{
+    int buf = -1;
+    // a request of one segment in registered memory needs no page pinning
+    if (datacnt == 1)
+        buf = blk_fixed_buf(dev, data->iov_base, data->iov_len);
+    if (buf >= 0) {
+        sqe->opcode = req->type == VIRTIO_BLK_T_IN ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->addr = (uintptr_t)data->iov_base;
+        sqe->len = data->iov_len;
+        sqe->buf_index = buf;
+    } else {
+        sqe->opcode = req->type == VIRTIO_BLK_T_IN ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)data;
+        sqe->len = datacnt;
+    }
+    sqe->fd = fd;
+    sqe->off = req->offset;
+    sqe->user_data = (uintptr_t)req;
+}
+
+// Submit the sqes got so far, called with dev->mtx held. The kernel refuses them while
+// the cq overflows, the lock is dropped while the completion thread reaps it.
+static int blk_uring_flush(BlkDev *dev)
+{
+	int err;
+	while ((err = uring_submit(&dev->ring)) == -EAGAIN || err == -EBUSY) {
+		pthread_mutex_unlock(&dev->mtx);
+		sched_yield();
+		pthread_mutex_lock(&dev->mtx);
+		if (dev->uring_failed)
+			return -EIO;
+	}
+	return err;
+}
+
+// An sqe to fill, submitting the queue if it is full. Called with dev->mtx held.
+// \return NULL if the ring failed.
+static struct io_uring_sqe *blk_uring_get_sqe(BlkDev *dev)
+{
+	struct io_uring_sqe *sqe;
+	if (dev->uring_failed)
+		return NULL;
+	// the kernel takes the sqes on submit, so a full queue is only a batch of its size
+	while ((sqe = uring_get_sqe(&dev->ring)) == NULL) {
+		if (blk_uring_flush(dev) < 0)
+			return NULL;
+	}
+	return sqe;
+}
+
+// Submit the reads and writes of procq with one syscall, the other requests complete here.
+static void blk_uring_submit(VirtIODevice *vdev, VirtQueue *vq, struct blkp_queue *procq)
+{
+	BlkDev *dev = vdev->dev;
+	struct blkp_req *breq;
+	struct io_uring_sqe *sqe;
+	struct iovec *data;
+	VirtqUsedElem used[BLK_BATCH];
+	int nused = 0, err, fd, datacnt;
+
+	pthread_mutex_lock(&dev->mtx);
+	while ((breq = TAILQ_FIRST(procq)) != NULL) {
+		TAILQ_REMOVE(procq, breq, link);
+		fd = -1;
+		if (breq->type == VIRTIO_BLK_T_IN || breq->type == VIRTIO_BLK_T_OUT)
+			fd = blk_io_prepare(dev, breq, &data, &datacnt);
+		else if (breq->type == VIRTIO_BLK_T_FLUSH)
+			fd = dev->img_fd;
+		sqe = fd >= 0 ? blk_uring_get_sqe(dev) : NULL;
+		if (sqe == NULL) {
+			used[nused].id = breq->idx;
+			if (fd >= 0) {
+				// the ring failed
+				blk_io_finish(breq);
+				used[nused].len = complete_block_operation(breq, EIO, 0);
+			} else if (breq->type == VIRTIO_BLK_T_IN || breq->type == VIRTIO_BLK_T_OUT) {
+				used[nused].len = complete_block_operation(breq, ENOMEM, 0);
+			} else {
+				used[nused].len = blkproc(dev, breq);
+			}
+			if (++nused == BLK_BATCH) {
+				update_used_ring_batch(vq, used, nused);
+				nused = 0;
+			}
+			continue;
+		}
+		if (breq->type == VIRTIO_BLK_T_FLUSH) {
+			// not ordered with the writes in flight, the guest waits for those it flushes
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = fd;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			sqe->user_data = (uintptr_t)breq;
+		} else {
+			blk_uring_prep(dev, sqe, breq, fd, data, datacnt);
+		}
+		breq->in_uring = true;
+		__atomic_fetch_add(&dev->inflight, 1, __ATOMIC_RELAXED);
+	}
+	err = dev->uring_failed ? 0 : blk_uring_flush(dev);
+	if (err < 0 && !dev->uring_failed)
+		log_error_ratelimited("blk io_uring submit failed, errno is %d", -err);
+	pthread_mutex_unlock(&dev->mtx);
+	if (nused) {
+		update_used_ring_batch(vq, used, nused);
+		virtio_inject_irq(vq);
+	}
+}
+
 int virtio_blk_notify_handler(VirtIODevice *vdev, VirtQueue *vq)
 {
     log_debug("virtio blk notify handler enter");
 	BlkDev *blkDev = (BlkDev *)vdev->dev;
 	struct blkp_req *breq;
-	TAILQ_HEAD(, blkp_req) procq;
+	VirtqElem elems[BLK_BATCH];
+	VirtqUsedElem bad[BLK_BATCH];
+	int i, n, nbad, dropped = 0;
+	struct blkp_queue procq;
 	TAILQ_INIT(&procq);
 	while(!virtqueue_is_empty(vq)) {
 		virtqueue_disable_notify(vq);
-		while(!virtqueue_is_empty(vq)) {
-			breq = virtq_blk_handle_one_request(vq);
-			TAILQ_INSERT_TAIL(&procq, breq, link);
+		while ((n = virtqueue_pop_batch(vq, elems, BLK_BATCH, true, 0)) > 0) {
+			for (i = 0, nbad = 0; i < n; i++) {
+				breq = virtq_blk_handle_one_request(blkDev, &elems[i]);
+				if (breq != NULL) {
+					TAILQ_INSERT_TAIL(&procq, breq, link);
+				} else {
+					// Give the chain back so that the driver doesn't wait for it forever.
+					bad[nbad].id = elems[i].idx;
+					bad[nbad++].len = 0;
+				}
+			}
+			update_used_ring_batch(vq, bad, nbad);
+			dropped += nbad;
 		}
 		virtqueue_enable_notify(vq);
 	}
 	if (TAILQ_EMPTY(&procq)) {
+		if (dropped)
+			virtio_inject_irq(vq);
 		log_debug("virtio blk notify handler exit, procq is empty");
         return 0;
 	}
+	if (blkDev->engine == BlkEngineIoUring) {
+		blk_uring_submit(vdev, vq, &procq);
+		return 0;
+	}
 	pthread_mutex_lock(&blkDev->mtx);
 	TAILQ_CONCAT(&blkDev->procq, &procq, link);
 	pthread_cond_signal(&blkDev->cond);
@@ -234,15 +736,36 @@ int virtio_blk_notify_handler(VirtIODevice *vdev, VirtQueue *vq)
 
 void virtio_blk_close(VirtIODevice *vdev) {
 	BlkDev *dev = vdev->dev;
+	struct io_uring_sqe *sqe;
 	pthread_mutex_lock(&dev->mtx);
 	dev->close = 1;
+	if (dev->engine == BlkEngineIoUring) {
+		// a nop without request stops the completion thread once the requests in flight
+		// completed, a failed ring has stopped it already
+		sqe = blk_uring_get_sqe(dev);
+		if (sqe != NULL) {
+			sqe->opcode = IORING_OP_NOP;
+			blk_uring_flush(dev);
+		}
+	}
 	pthread_cond_signal(&dev->cond);
 	pthread_mutex_unlock(&dev->mtx);
 	pthread_join(dev->tid, NULL);
+	if (dev->engine == BlkEngineIoUring) {
+		uring_exit(&dev->ring);
+		free(dev->bufs);
+	}
 	pthread_mutex_destroy(&dev->mtx);
 	pthread_cond_destroy(&dev->cond);
 	close(dev->img_fd);
+	if (dev->buffered_fd >= 0)
+		close(dev->buffered_fd);
+	for (int i = 0; i < VIRTQUEUE_BLK_MAX_SIZE; i++) {
+		free(dev->reqs[i].dio_iov);
+		free(dev->reqs[i].bounce);
+	}
+	free(dev->reqs);
 	free(dev);
-	free(vdev->vqs);
+	free_virtio_queues(vdev);
 	free(vdev);
 }
\ No newline at end of file
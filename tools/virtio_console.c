@@ -4,12 +4,15 @@
 #include<stdlib.h>
 #include<fcntl.h>
 #include "log.h"
+#include "metrics.h"
 #include <errno.h>
 #include <termios.h>
 static uint8_t trashbuf[1024];
 
 ConsoleDev *init_console_dev() {
     ConsoleDev *dev = (ConsoleDev *)malloc(sizeof(ConsoleDev));
+    if (dev == NULL)
+        return NULL;
     dev->config.cols = 80;
     dev->config.rows = 25;
     dev->master_fd = -1;
@@ -37,10 +40,13 @@ static void virtio_console_event_handler(int fd, int epoll_type, void *param) {
     } 
     if (dev->rx_ready <= 0) {
         read(dev->master_fd, trashbuf, sizeof(trashbuf));
+        metrics_queue_add(vdev->id, CONSOLE_QUEUE_RX, METRIC_DROPS, 1);
         return ;
     }
     if (virtqueue_is_empty(vq)) {
         read(dev->master_fd, trashbuf, sizeof(trashbuf));
+        metrics_queue_add(vdev->id, CONSOLE_QUEUE_RX, METRIC_DROPS, 1);
+        metrics_queue_add(vdev->id, CONSOLE_QUEUE_RX, METRIC_RING_FULL, 1);
         virtio_inject_irq(vq);
         return ;
     }
@@ -48,23 +54,21 @@ static void virtio_console_event_handler(int fd, int epoll_type, void *param) {
     while (!virtqueue_is_empty(vq)) {
         n = process_descriptor_chain(vq, &idx, &iov, NULL, 0);
         if (n < 1) {
-            log_error("process_descriptor_chain failed");
-            break;
+            log_error_ratelimited("process_descriptor_chain failed");
+            update_used_ring(vq, idx, 0);
+            continue;
         }
         len = readv(dev->master_fd, iov, n);
         if (len < 0 && errno == EWOULDBLOCK) {
             log_info("no more bytes");
-			vq->last_avail_idx--;
-            free(iov);
+			virtqueue_unpop(vq, idx);
 			break;
         } else if (len < 0) {
-            log_error("Failed to read from console, errno is %d", errno);
-			vq->last_avail_idx--;
-            free(iov);
+            log_error_ratelimited("Failed to read from console, errno is %d", errno);
+			virtqueue_unpop(vq, idx);
             break;
         } 
         update_used_ring(vq, idx, len);
-        free(iov);
     }
     virtio_inject_irq(vq);
     return ;
@@ -128,43 +132,50 @@ int virtio_console_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
     return 0;
 }
 
-static void virtq_tx_handle_one_request(ConsoleDev *dev, VirtQueue *vq) {
-    int i, n;
-    uint16_t idx;
+static void virtq_tx_handle_one_request(VirtIODevice *vdev, VirtqElem *elem) {
+    ConsoleDev *dev = vdev->dev;
+    int n = elem->n;
     ssize_t len;
-    struct iovec *iov = NULL;
+    struct iovec *iov = elem->iov;
     static int count = 0;
     count++;
-    if (dev->master_fd <= 0) {
-        log_error("Console master fd is not ready");
+
+    if (n < 1) {
         return ;
     }
-
-    n = process_descriptor_chain(vq, &idx, &iov, NULL, 0);
     if (count % 100 == 0) {
         log_info("console txq: n is %d, data is ", n);
         for (int i=0; i<iov->iov_len; i++)
             log_printf("%c", *(char*)&iov->iov_base[i]);
         log_printf("\n");
     }
-    if (n < 1) {
-        return ;
-    }
 
     len = writev(dev->master_fd, iov, n);
     if (len < 0) {
-        log_error("Failed to write to console, errno is %d", errno);
+        log_error_ratelimited("Failed to write to console, errno is %d", errno);
+        metrics_queue_add(vdev->id, CONSOLE_QUEUE_TX, METRIC_DROPS, 1);
     }
-    update_used_ring(vq, idx, 0);
-    free(iov);
 }
 
 int virtio_console_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
     log_debug("%s", __func__);
+    ConsoleDev *dev = vdev->dev;
+    VirtqElem elems[CONSOLE_BATCH];
+    VirtqUsedElem used[CONSOLE_BATCH];
+    int i, n;
+    if (dev->master_fd <= 0) {
+        log_error_ratelimited("Console master fd is not ready");
+        return 0;
+    }
     while (!virtqueue_is_empty(vq)) {
         virtqueue_disable_notify(vq);
-        while(!virtqueue_is_empty(vq)) {
-            virtq_tx_handle_one_request(vdev->dev, vq);
+        while ((n = virtqueue_pop_batch(vq, elems, CONSOLE_BATCH, false, 0)) > 0) {
+            for (i = 0; i < n; i++) {
+                virtq_tx_handle_one_request(vdev, &elems[i]);
+                used[i].id = elems[i].idx;
+                used[i].len = 0;
+            }
+            update_used_ring_batch(vq, used, n);
         }
         virtqueue_enable_notify(vq);
     }
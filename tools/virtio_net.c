@@ -2,6 +2,7 @@
 #include "log.h"
 #include "event_monitor.h"
 #include "virtio.h"
+#include "metrics.h"
 #include <stdlib.h>
 #include <net/if.h>
 #include <fcntl.h>
@@ -17,6 +18,8 @@ static uint8_t trashbuf[1600];
 NetDev *init_net_dev(uint8_t mac[])
 {
     NetDev *dev = malloc(sizeof(NetDev));
+    if (dev == NULL)
+        return NULL;
     dev->config.mac[0] = mac[0];
     dev->config.mac[1] = mac[1];
     dev->config.mac[2] = mac[2];
@@ -36,6 +39,16 @@ static int open_tap(char *devname)
     log_info("virtio net tap open");
     int tunfd;
     struct ifreq ifr;
+    char *end;
+    // "fd:N" is a tap, or a packet socket, opened by whoever started the daemon.
+    if (strncmp(devname, "fd:", 3) == 0) {
+        tunfd = strtol(devname + 3, &end, 10);
+        if (*end != '\0' || tunfd < 0 || fcntl(tunfd, F_GETFD) < 0) {
+            log_error("invalid tap fd %s", devname + 3);
+            return -1;
+        }
+        return tunfd;
+    }
     tunfd = open("/dev/net/tun", O_RDWR);
     if (tunfd < 0) {
         log_error("Failed to open tap device");
@@ -70,7 +83,7 @@ int virtio_net_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq)
 /// remove the header in iov, return the new iov. the new iov num is in niov.
 static inline struct iovec *rm_iov_header(struct iovec *iov, int *niov, int header_len) {
 	if (iov == NULL || *niov == 0 || iov[0].iov_len < (size_t)header_len) { 
-		log_error("invalid iov");
+		log_error_ratelimited("invalid iov");
 		return NULL;
 	}
 	
@@ -95,7 +108,8 @@ void virtio_net_event_handler(int fd, int epoll_type, void *param)
 	struct iovec *iov, *iov_packet;
     NetDev *net = vdev->dev;
     VirtQueue *vq = &vdev->vqs[NET_QUEUE_RX];
-    int n, len;
+    VirtqUsedElem used[NET_BATCH];
+    int n, len, nused = 0;
     uint16_t idx;
 	if (fd != net->tapfd || epoll_type != EPOLLIN) {
 		log_error("invalid event");
@@ -109,64 +123,70 @@ void virtio_net_event_handler(int fd, int epoll_type, void *param)
     // if vq is not setup, drop the packet
     if (!net->rx_ready) {
         read(net->tapfd, trashbuf, sizeof(trashbuf));
+        metrics_queue_add(vdev->id, NET_QUEUE_RX, METRIC_DROPS, 1);
         return;
     }
 	// if rx_vq is empty, drop the packet
     if (virtqueue_is_empty(vq)) {
         read(net->tapfd, trashbuf, sizeof(trashbuf));
+        metrics_queue_add(vdev->id, NET_QUEUE_RX, METRIC_DROPS, 1);
+        metrics_queue_add(vdev->id, NET_QUEUE_RX, METRIC_RING_FULL, 1);
         virtio_inject_irq(vq);
         return;
     }
     while (!virtqueue_is_empty(vq)) {
+        // packets are put into the used ring in batches
+        if (nused == NET_BATCH) {
+            update_used_ring_batch(vq, used, nused);
+            nused = 0;
+        }
         n = process_descriptor_chain(vq, &idx, &iov, NULL, 0);
-        if (n < 1 || n > VIRTQUEUE_NET_MAX_SIZE) {
-            log_error("process_descriptor_chain failed");
-            goto free_iov;
+        used[nused].id = idx;
+        used[nused].len = 0;
+        if (n < 1) {
+            log_error_ratelimited("process_descriptor_chain failed");
+            nused++;
+            continue;
         }
         vnet_header = iov[0].iov_base;
         iov_packet = rm_iov_header(iov, &n, sizeof(NetHdr));
-        if(iov_packet == NULL)
-            goto free_iov;
+        if(iov_packet == NULL) {
+            nused++;
+            continue;
+        }
 		// Read a packet from tap device
         len = readv(net->tapfd, iov_packet, n);
 
         if (len < 0 && errno == EWOULDBLOCK) {
             // No more packets from tapfd, restore last_avail_idx.
             log_info("no more packets");
-			vq->last_avail_idx--;
-    		free(iov);
+			virtqueue_unpop(vq, idx);
 			break;
         }
 
         memset(vnet_header, 0, sizeof(NetHdr));
 		vnet_header->num_buffers = 1;
 
-        update_used_ring(vq, idx, len + sizeof(NetHdr));
-		free(iov);
+        used[nused++].len = len + sizeof(NetHdr);
     }
 
+    update_used_ring_batch(vq, used, nused);
     virtio_inject_irq(vq);
-	return ;
-free_iov:
-    free(iov);
 }
 
-static void virtq_tx_handle_one_request(NetDev *net, VirtQueue *vq)
+// send one packet, return its used len.
+static uint32_t virtq_tx_handle_one_request(VirtIODevice *vdev, VirtqElem *elem)
 {
-    struct iovec *iov = NULL;
-    int i, n;
+    NetDev *net = vdev->dev;
+    struct iovec *iov = elem->iov;
+    int i, n = elem->n;
     int packet_len, all_len; // all_len include the header length.
-    uint16_t idx;
 	static char pad[64]; 
 	ssize_t len;
-    if (net->tapfd == -1) {
-        log_error("tap device is invalid");
-        return;
-    }
 
-    n = process_descriptor_chain(vq, &idx, &iov, NULL, 1);
-    if (n < 1) {
-        return ;
+    if (n < 1 || iov[0].iov_len < sizeof(NetHdr)) {
+        log_error_ratelimited("invalid tx descriptor chain");
+        return 0;
 	}
 
 	for (i = 0, all_len = 0; i < n; i++) 
@@ -185,22 +205,36 @@ static void virtq_tx_handle_one_request(NetDev *net, VirtQueue *vq)
     }
     len = writev(net->tapfd, iov, n);
     if (len < 0) {
-		log_error("write tap failed, errno %d", errno);
+		log_error_ratelimited("write tap failed, errno %d", errno);
+		metrics_queue_add(vdev->id, NET_QUEUE_TX, METRIC_DROPS, 1);
 	}
-	update_used_ring(vq, idx, all_len);
-	free(iov);
+	return all_len;
 }
 
 int virtio_net_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq)
 {
     log_debug("virtio_net_txq_notify_handler");
-    virtqueue_disable_notify(vq);
-    while(!virtqueue_is_empty(vq)) {
-        virtq_tx_handle_one_request(vdev->dev, vq);
+    NetDev *net = vdev->dev;
+    VirtqElem elems[NET_BATCH];
+    VirtqUsedElem used[NET_BATCH];
+    int i, n;
+    if (net->tapfd == -1) {
+        log_error("tap device is invalid");
+        return 0;
+    }
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while ((n = virtqueue_pop_batch(vq, elems, NET_BATCH, false, 1)) > 0) {
+            for (i = 0; i < n; i++) {
+                used[i].id = elems[i].idx;
+                used[i].len = virtq_tx_handle_one_request(vdev, &elems[i]);
+            }
+            update_used_ring_batch(vq, used, n);
+        }
+        virtqueue_enable_notify(vq);
     }
-    virtqueue_enable_notify(vq);
-	// TODO: Can we don't inject irq when send packets to improve performance? Linux will recycle the used ring when send packets.
-	// virtio_inject_irq(vq);
+	// With event idx the driver only asks for this irq when it waits for free tx descriptors.
+	virtio_inject_irq(vq);
     return 0;
 }
 
@@ -237,6 +271,6 @@ void virtio_net_close(VirtIODevice *vdev) {
 	close(dev->tapfd);
 	free(dev->event);
 	free(dev);
-	free(vdev->vqs);
+	free_virtio_queues(vdev);
 	free(vdev);
 }